@@ -12,146 +12,246 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are found through a hash table with one lock per bucket,
+// so lookups of different blocks don't contend. Buffers nobody
+// references are kept in an LRU list, misses recycle its tail.
+// Misses are serialized by bcache.evictlock, so a block can't
+// end up in two buffers.
+//
+// The cache starts with NBUF buffers and never shrinks below
+// bcache.minbuf, which initlog() raises to fit two transactions of
+// the log. Misses add buffers up to bcache.target while more than
+// BCACHE_HIWAT pages are free, and give buffers back to kalloc
+// while less than BCACHE_LOWAT are.
+// bcachectl() queries and sets the target.
+//
+// Lock order: bcache.evictlock, bucket lock, bcache.lrulock.
 
 
 #include "defs.h"
 #include "buf.h"
 
-
+struct bucket {
+  struct spinlock lock;
+  BigBuf *head;      // hash chain
+  uint64 hits;
+};
 
 struct {
-  struct spinlock lock;
-  // Buffer are in array, which is sorted
-  BigBuf cacheBuffers[NBUF];
-  BigBuf* sortedBuffers[NBUF];
-  uint64 generation;
+  struct spinlock evictlock;
+  struct spinlock lrulock;
+  BigBuf *lruhead;   // most recently released
+  BigBuf *lrutail;   // recycled next
+  struct kmem_cache cache; // BigBuf descriptors
+  struct bucket buckets[NBUFHASH];
+  int nbuf;          // protected by evictlock
+  int minbuf;        // never shrinks below, at least NBUF
+  int target;
+  uint64 misses;
+  uint64 evictions;
 } bcache;
 
-uint64 reuses = 0;
-uint64 newBufs = 0;
+// Allocate a buffer that holds no block.
+// Returns 0 if memory ran out.
+static BigBuf*
+bufalloc(void)
+{
+  BigBuf *b;
 
-void debug_buffer() {
-  pr_debug("PRINTING: BSEARCH--------------------------------------\n");
-  for (int i = 0 ; i < NBUF; i++) {
-    BigBuf* buf = bcache.sortedBuffers[i];
-    pr_debug("ind:%d, refC: %x,sK:%p, gen: %p, size: %d\n",i, buf->refcount,buf->searchKey, buf->generation, buf->size);
+  if ((b = kmem_cache_alloc(&bcache.cache)) == 0)
+    return 0;
+  if ((b->page = kalloc()) == 0) {
+    kmem_cache_free(&bcache.cache, b);
+    return 0;
+  }
+  b->device = -1;
+  b->blockno = 0;
+  b->hashed = 0;
+  b->refcount = 0;
+  b->hnext = 0;
+  b->onlru = 0;
+  for (int i = 0; i < BLOCKS_PER_PAGE; i++) {
+    initsleeplock(&(b->smallBuf[i].lock), "smolBuff");
+    b->smallBuf[i].disk = 0;
+    b->smallBuf[i].iodone = 0;
   }
-  pr_debug("END-----------------------------------------\n");
+  return b;
 }
 
+static void
+buffree(BigBuf *b)
+{
+  kfree(b->page);
+  kmem_cache_free(&bcache.cache, b);
+}
+
+static void lru_push(BigBuf *b);
 
 void
 binit(void)
 {
   BigBuf *b;
 
-  initlock(&bcache.lock, "bcache");
-  bcache.generation = 0;
+  initlock(&bcache.evictlock, "bcache.evict");
+  initlock(&bcache.lrulock, "bcache.lru");
+  kmem_cache_init(&bcache.cache, "bigbuf", sizeof(BigBuf));
+  for (int i = 0; i < NBUFHASH; i++) {
+    initlock(&bcache.buckets[i].lock, "bcache.bucket");
+    bcache.buckets[i].head = 0;
+    bcache.buckets[i].hits = 0;
+  }
+  bcache.lruhead = 0;
+  bcache.lrutail = 0;
   for (int i = 0 ; i < NBUF; i++) {
-    b = bcache.cacheBuffers + i;
-    bcache.sortedBuffers[i] = b;
-    b->size = 0;
-    b->page = kalloc();
-    if (b->page == 0) {
+    if ((b = bufalloc()) == 0) {
       panic("binit: kalloc buffer alloc fail");
     }
-    b->device = -1;
-    b->blockno = 0;
-    b->generation = 0;
-    b->refcount = 0;
-    //pr_debug("Invalid start key:%p\n", b->searchKey);
-    for (int i = 0; i < BLOCKS_PER_PAGE; i++) {
-      initsleeplock(&(b->smallBuf[i].lock), "smolBuff");
-    }
+    // All buffers start out unused
+    lru_push(b);
   }
+  bcache.nbuf = NBUF;
+  bcache.minbuf = NBUF;
+  // Grow up to an eighth of the memory by default
+  bcache.target = kalloc_nfree() / 8;
+  if (bcache.target < NBUF)
+    bcache.target = NBUF;
 }
 
-static int binary_search(int start, int end, uint64 targetKey) {
-  while (start != end) {
-    int mid = (start + end) / 2;
-    //pr_debug("start_%d, end:%d\n", start, end);
-    BigBuf* midEntry = bcache.sortedBuffers[mid];
+// Hash bucket of the buffer holding blockno on dev.
+// blockno must be aligned to BLOCKS_PER_PAGE.
+static struct bucket*
+bucket_of(uint dev, uint blockno)
+{
+  uint64 key = ((uint64)dev << 32) | blockno;
+  key *= 0x9e3779b97f4a7c15;
+  return &bcache.buckets[(key >> 32) % NBUFHASH];
+}
 
-    // Found correct entry
-    if (targetKey < (midEntry->searchKey + midEntry->size) && targetKey >= midEntry->searchKey) {
+// Caller must hold bk->lock.
+static BigBuf*
+bucket_lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  for (BigBuf *b = bk->head; b; b = b->hnext)
+    if (b->device == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
 
-      return mid;
-    } else if (targetKey < midEntry->searchKey) {
-      end = mid;
-      continue;
-    } else if(targetKey > midEntry->searchKey) {
-      if (start == mid) {
-        //pr_debug("oh no\n");
-        return -1;
-      }
-      start = mid;
-      continue;
-    }
+// Caller must hold bcache.lrulock.
+static void
+lru_unlink(BigBuf *b)
+{
+  if (b->lprev)
+    b->lprev->lnext = b->lnext;
+  else
+    bcache.lruhead = b->lnext;
+  if (b->lnext)
+    b->lnext->lprev = b->lprev;
+  else
+    bcache.lrutail = b->lprev;
+  b->onlru = 0;
+}
+
+// Caller must hold bcache.lrulock.
+static void
+lru_push(BigBuf *b)
+{
+  b->lprev = 0;
+  b->lnext = bcache.lruhead;
+  if (bcache.lruhead)
+    bcache.lruhead->lprev = b;
+  else
+    bcache.lrutail = b;
+  bcache.lruhead = b;
+  b->onlru = 1;
+}
+
+// Take a reference to b.
+// Caller must hold the lock of b's bucket.
+static void
+bhold(BigBuf *b)
+{
+  if (b->refcount++ == 0) {
+    acquire(&bcache.lrulock);
+    lru_unlink(b);
+    release(&bcache.lrulock);
   }
-  // Haven't found fit
-  return -1;
 }
 
-/**
- * Assumption: List is sorted except for element at index index
- * Sorts entry at index index into its correct location
- * Return the new location
-*/
-int binary_insert(int index) 
+// Drop a reference to b, the last one puts it on the LRU list.
+// Caller must hold the lock of b's bucket.
+static void
+bdrop(BigBuf *b)
 {
-  // Bufferpointer we need the new location of
-  BigBuf* searchBuf = bcache.sortedBuffers[index];
-  
-  int newLoc = NBUF; 
-  // if our new location is NBUF - 1, we fall through the loop below without changes to newLoc
-  // In this case, we are in index < newLoc case, meaning newLoc is decremented by one -> real new index is NBUf -1
-  for (int i = 0; i < NBUF; i++) { // To look for new location
-    BigBuf* curBuf = bcache.sortedBuffers[i];
-    if (index == i) {
-      continue;
-    }
-    if (searchBuf->searchKey == curBuf->searchKey) {
-      panic("buffer: binary_insert element already present");
-    }
-    if (searchBuf->searchKey < curBuf->searchKey) {
-      newLoc = i;
-      break;
-    }
+  if (b->refcount == 0)
+    panic("brelse: refcount");
+  if (--b->refcount == 0) {
+    acquire(&bcache.lrulock);
+    lru_push(b);
+    release(&bcache.lrulock);
   }
-/* 
-  pr_debug("newLoc: %d, old:%d\n", newLoc, index);
-  pr_debug("BFORE:REORDER: ");
-  debug_buffer(); */
-  
-  // We need to move things to the left 
-  if (index < newLoc) {
-    newLoc = newLoc - 1;
-    for (int i = index; i < newLoc  && i < (NBUF - 1); i++) { 
-      BigBuf* copy = bcache.sortedBuffers[i];
-      bcache.sortedBuffers[i] = bcache.sortedBuffers[i + 1];
-      bcache.sortedBuffers[i + 1] = copy;
+}
+
+// Take the least recently used unreferenced buffer out of
+// the LRU list and its hash chain.
+// Caller must hold bcache.evictlock, so the blockno and device
+// of buffers don't change under us.
+// Returns 0 if every buffer is in use.
+static BigBuf*
+bevict(void)
+{
+  BigBuf *b;
+  struct bucket *bk;
+
+  for (;;) {
+    acquire(&bcache.lrulock);
+    b = bcache.lrutail;
+    if (b != 0 && !b->hashed) {
+      // Nobody else can find an unhashed buffer
+      lru_unlink(b);
+      release(&bcache.lrulock);
+      return b;
     }
-  } else { // We need to move everything to the right 
-    for (int i = index; i > newLoc && i > 0; i--) { 
-      BigBuf* copy = bcache.sortedBuffers[i];
-      bcache.sortedBuffers[i] = bcache.sortedBuffers[i - 1];
-      bcache.sortedBuffers[i - 1] = copy;
+    release(&bcache.lrulock);
+    if (b == 0)
+      return 0;
+
+    bk = bucket_of(b->device, b->blockno);
+    acquire(&bk->lock);
+    // A lookup might have taken it since we looked at the tail
+    if (b->refcount == 0) {
+      acquire(&bcache.lrulock);
+      lru_unlink(b);
+      release(&bcache.lrulock);
+      BigBuf **pp;
+      for (pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+        ;
+      *pp = b->hnext;
+      b->hashed = 0;
+      release(&bk->lock);
+      bcache.evictions++;
+      return b;
     }
+    release(&bk->lock);
   }
-  return newLoc;
-/*   pr_debug("END:  ");
-  debug_buffer(); */
 }
 
-void updateSize(BigBuf* updated, uint64 nextKey) {
-    uint64 newSize = ((nextKey - updated->searchKey));
-    if(newSize == 0) {
-      panic("buffer: Limited size to 0"); 
-    } else if (newSize < BLOCKS_PER_PAGE) {
-      updated->size = newSize;
-    } else {
-      updated->size = BLOCKS_PER_PAGE;
-    }
+// Free up to n unused buffers, as long as more than min are left.
+// Caller must hold bcache.evictlock.
+// Returns the number of buffers freed.
+static int
+bshrink(int n, int min)
+{
+  BigBuf *b;
+  int freed = 0;
+
+  while (freed < n && bcache.nbuf > min && (b = bevict()) != 0) {
+    buffree(b);
+    bcache.nbuf--;
+    freed++;
+  }
+  return freed;
 }
 
 // Look through buffer cache for block on device dev.
@@ -161,68 +261,59 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   BigBuf *big;
-
-  acquire(&bcache.lock);
-
-  int searchResult = binary_search(0, NBUF, ((uint64) dev << 32) + blockno);
-
-  // Entry is cached
-  if (searchResult != -1) {
-    big = bcache.sortedBuffers[searchResult];
-    big->refcount++;
-    int index = blockno - big->blockno;
-    
-    // Increment generation and set bigs generation to the incremented value
-    big->generation = ++bcache.generation;
-    release(&bcache.lock);
-    reuses++;
-    struct buf* b = big->smallBuf + index;
-    return b;
+  uint base = blockno - blockno % BLOCKS_PER_PAGE;
+  struct bucket *bk = bucket_of(dev, base);
+
+  acquire(&bk->lock);
+  if ((big = bucket_lookup(bk, dev, base)) != 0) {
+    bhold(big);
+    bk->hits++;
+    release(&bk->lock);
+    return big->smallBuf + (blockno - base);
   }
-
-  int lru_index = - 1;
-  uint64 lowest_gen = -1;
-
-  // Entry is not cached
-  // Find LRU O(n) unused buffer, 
-  // this should only be called ~300 times in the entirety of usertests, performance isn't too important here
-  for (int i = NBUF - 1; i >= 0; i--) {
-    BigBuf* currentBuf = bcache.sortedBuffers[i];
-    if (currentBuf->refcount == 0 && currentBuf->generation < lowest_gen) {
-      lru_index = i;
-      lowest_gen = currentBuf->generation;
-    }
+  release(&bk->lock);
+
+  acquire(&bcache.evictlock);
+  // Somebody else might have cached the block in the meantime
+  acquire(&bk->lock);
+  if ((big = bucket_lookup(bk, dev, base)) != 0) {
+    bhold(big);
+    bk->hits++;
+    release(&bk->lock);
+    release(&bcache.evictlock);
+    return big->smallBuf + (blockno - base);
   }
-
-  // Found an empty buffer
-  if (lru_index > -1 && (big = bcache.sortedBuffers[lru_index])->refcount == 0) {
-    newBufs++;
-    big->device = dev;
-    big->blockno = blockno;
-    big->refcount++;
-
-    int newPos = binary_insert(lru_index);
-    big = bcache.sortedBuffers[newPos];
-    if (newPos < NBUF-1) {
-      updateSize(big, bcache.sortedBuffers[newPos + 1]->searchKey);
-    } else {
-      updateSize(big, -1);
-    }
-      
-    struct buf* b = &(big->smallBuf[0]);
-    for (int i = 0; i < BLOCKS_PER_PAGE; i++) {
-      (b + i)->valid = 0;
-      (b + i)->blockno = blockno + i;
-      (b + i)->data = big->page + (i * BSIZE);
-      (b + i)->parent = big;
-    }
-      // Increment generation and set bigs generation to the incremented value
-    big->generation = ++bcache.generation;
-    release(&bcache.lock);
-    return b;
+  release(&bk->lock);
+
+  // Grow while memory is plentiful, recycle a buffer otherwise
+  big = 0;
+  if (bcache.nbuf < bcache.target && kalloc_nfree() > BCACHE_HIWAT
+      && (big = bufalloc()) != 0)
+    bcache.nbuf++;
+  if (big == 0 && (big = bevict()) == 0)
+    panic("bget: no buffers");
+  // Memory runs low, give back one more buffer for every miss
+  if (kalloc_nfree() < BCACHE_LOWAT)
+    bshrink(1, bcache.minbuf);
+  bcache.misses++;
+  big->device = dev;
+  big->blockno = base;
+  big->refcount = 1;
+  big->hashed = 1;
+  for (int i = 0; i < BLOCKS_PER_PAGE; i++) {
+    struct buf *b = big->smallBuf + i;
+    b->valid = 0;
+    b->blockno = base + i;
+    b->data = big->page + (i * BSIZE);
+    b->parent = big;
   }
 
-  panic("bget: no buffers");
+  acquire(&bk->lock);
+  big->hnext = bk->head;
+  bk->head = big;
+  release(&bk->lock);
+  release(&bcache.evictlock);
+  return big->smallBuf + (blockno - base);
 }
 
 // Return a buf with the contents of the indicated block.
@@ -242,40 +333,222 @@ bread(uint dev, uint blockno)
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Completion of a read queued by bprefetch().
+// Called from the disk interrupt.
+static void
+bprefetch_done(struct buf *b)
+{
+  b->iodone = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+  brelse(b);
+}
+
+// Queue one disk request for the n locked buffers in bs.
+// The buffers hold consecutive blocks, at most DISK_MAXSEG.
+static void
+bsubmit(struct buf **bs, int n, int write)
+{
+  if (n > 0)
+    virtio_disk_submitv(bs, n, write);
+}
+
+// Queue reads of the n consecutive blocks starting at blockno
+// into the cache, for readahead. Blocks that are cached or being
+// read are skipped, the rest is read with as few requests as possible.
+// Doesn't wait for the disk, bread() of a block waits for the
+// buffer lock until the data is there. Call bstart() afterwards.
 void
-bwrite(struct buf *b)
+bprefetch(uint dev, uint blockno, int n)
 {
-  acquiresleep(&b->lock);
-  virtio_disk_rw(b, 1);
+  struct buf *b, *run[DISK_MAXSEG];
+  int nrun = 0;
+
+  for (int i = 0; i < n; i++) {
+    b = bget(dev, blockno + i);
+    // Cached already or being read. Never sleep for the lock,
+    // the buffers in run are locked until they are submitted.
+    if (b->valid || !tryacquiresleep(&b->lock)) {
+      brelse(b);
+      bsubmit(run, nrun, 0);
+      nrun = 0;
+      continue;
+    }
+    if (b->valid) {
+      releasesleep(&b->lock);
+      brelse(b);
+      bsubmit(run, nrun, 0);
+      nrun = 0;
+      continue;
+    }
+    // The lock and the reference are dropped by bprefetch_done()
+    b->iodone = bprefetch_done;
+    run[nrun++] = b;
+    if (nrun == DISK_MAXSEG) {
+      bsubmit(run, nrun, 0);
+      nrun = 0;
+    }
+  }
+  bsubmit(run, nrun, 0);
+}
+
+// Let the disk start on the requests queued by bprefetch().
+void
+bstart(void)
+{
+  virtio_disk_kick();
+}
+
+// Start writing the contents of the n buffers in bs to disk.
+// Runs of consecutive blocks go to the disk in one request.
+// Finish with bwait() on every buffer before touching its data again.
+void
+bwrite_startv(struct buf **bs, int n)
+{
+  int start = 0;
+
+  for (int i = 0; i < n; i++)
+    acquiresleep(&bs[i]->lock);
+  for (int i = 1; i <= n; i++) {
+    if (i == n || i - start == DISK_MAXSEG
+        || bs[i]->blockno != bs[i - 1]->blockno + 1) {
+      bsubmit(bs + start, i - start, 1);
+      start = i;
+    }
+  }
+}
+
+// Start writing b's contents to disk.
+// Finish with bwait() before touching b->data again.
+void
+bwrite_start(struct buf *b)
+{
+  bwrite_startv(&b, 1);
+}
+
+// Wait for a write started by bwrite_start().
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
   releasesleep(&b->lock);
 }
 
-// Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Write b's contents to disk.
 void
-brelse(struct buf *b)
+bwrite(struct buf *b)
 {
+  bwrite_start(b);
+  bwait(b);
+}
 
+// Release a buffer.
+// The last release moves it to the head of the LRU list.
+void
+brelse(struct buf *b)
+{
   BigBuf* parent = b->parent;
-  acquire(&bcache.lock);
-  parent->refcount--;
-  
-  release(&bcache.lock);
+  struct bucket *bk = bucket_of(parent->device, parent->blockno);
+
+  acquire(&bk->lock);
+  bdrop(parent);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  ((BigBuf*)b->parent)->refcount++;
-  release(&bcache.lock);
+  BigBuf* parent = b->parent;
+  struct bucket *bk = bucket_of(parent->device, parent->blockno);
+
+  acquire(&bk->lock);
+  parent->refcount++;
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  ((BigBuf*)b->parent)->refcount--;
-  release(&bcache.lock);
+  BigBuf* parent = b->parent;
+  struct bucket *bk = bucket_of(parent->device, parent->blockno);
+
+  acquire(&bk->lock);
+  bdrop(parent);
+  release(&bk->lock);
+}
+
+// Out of memory, free up to n unused buffers, but keep bcache.minbuf.
+// Must not be called with a spinlock held.
+// Returns the number of buffers freed.
+int
+bcache_reclaim(int n)
+{
+  acquire(&bcache.evictlock);
+  int freed = bshrink(n, bcache.minbuf);
+  release(&bcache.evictlock);
+  return freed;
+}
+
+// Let the cache grow up to target buffers,
+// and shrink it right away if it is larger.
+// Returns -1 if target is below the floor of the cache.
+int
+bcache_settarget(int target)
+{
+  acquire(&bcache.evictlock);
+  if (target < bcache.minbuf) {
+    release(&bcache.evictlock);
+    return -1;
+  }
+  bcache.target = target;
+  bshrink(bcache.nbuf - target, target);
+  release(&bcache.evictlock);
+  return 0;
 }
 
+// Never shrink the cache below min buffers, and grow it to min now.
+// The log pins the blocks of up to two transactions, initlog() calls
+// this once the size of the log is known.
+void
+bcache_setmin(int min)
+{
+  BigBuf *b;
+
+  acquire(&bcache.evictlock);
+  if (min > bcache.minbuf)
+    bcache.minbuf = min;
+  if (bcache.target < bcache.minbuf)
+    bcache.target = bcache.minbuf;
+  while (bcache.nbuf < bcache.minbuf) {
+    if ((b = bufalloc()) == 0)
+      panic("bcache_setmin: kalloc buffer alloc fail");
+    lru_push(b);
+    bcache.nbuf++;
+  }
+  release(&bcache.evictlock);
+}
+
+// Fill in the size and counters of the cache.
+// Reads without locks, the result is only a snapshot.
+void
+bcache_stats(struct bcache_info *info)
+{
+  info->nbuf = bcache.nbuf;
+  info->target = bcache.target;
+  info->minbuf = bcache.minbuf;
+  info->hits = 0;
+  for (int i = 0; i < NBUFHASH; i++)
+    info->hits += bcache.buckets[i].hits;
+  info->misses = bcache.misses;
+  info->evictions = bcache.evictions;
+}
 
+// Print the buffer cache statistics.
+// No locks, like procdump.
+void
+bcache_dump(void)
+{
+  struct bcache_info info;
+
+  bcache_stats(&info);
+  pr_info("bcache buffers %d target %d hits %d misses %d evictions %d\n", (int)info.nbuf,
+    (int)info.target, (int)info.hits, (int)info.misses, (int)info.evictions);
+}
@@ -12,31 +12,28 @@ extern "C" {
 #include "kernel/sleeplock.h"
 #include "kernel/fs.h"
 
-#define BLOCKS_PER_PAGE 4096 / BSIZE
+#define BLOCKS_PER_PAGE (4096 / BSIZE)
 
 struct buf {
   uint blockno;   // blockno
   uint valid; // is this buf valid? (read from disk)
+  int disk;   // does disk "own" buf? (request queued and not completed)
+  void (*iodone)(struct buf*); // called from the disk interrupt when a request completes, if set
   struct sleeplock lock; // lock for disk r/w
   void* parent; // BigBuf parent of this buffer
   uchar* data; // 
 };
 
 typedef struct __BigBuf {
-  int disk;       // does disk "own" buffer
-
-  // Union for searchKey (used for sorting for binary search)
-  union {
-    uint64 searchKey;
-    struct {
-      uint blockno;   // starting blockno, aligned to BUFFER_SIZE
-      uint device;    // device the data is from
-    };
-  };
-
-  uint32 refcount;    // num of references to PageBuffer 
-  uint32 size;       // (1-BLOCKS_PER_PAGE) Size of the bigbuf, how many smallBufs should be used?
-  uint64 generation; // Generation this BigBuf belongs to
+  uint blockno;   // starting blockno, aligned to BLOCKS_PER_PAGE
+  uint device;    // device the data is from
+  int hashed;     // 1 if blockno and device are valid and the buffer is in a hash chain
+
+  uint32 refcount;    // num of references to PageBuffer, protected by the lock of its hash bucket
+  struct __BigBuf* hnext; // next buffer in the same hash bucket
+  struct __BigBuf* lnext; // LRU list of unreferenced buffers, towards the least recently used
+  struct __BigBuf* lprev;
+  int onlru;      // 1 while in the LRU list
   struct buf smallBuf[BLOCKS_PER_PAGE];
   uchar* page;    // page where data for smallBufs is stored
 
@@ -16,6 +16,9 @@ extern "C" {
 #include "kernel/stat.h"
 #include "kernel/printk.h"
 #include "kernel/mmap.h"
+#include "kernel/slab.h"
+#include "uk-shared/bcache_defs.h"
+#include "uk-shared/upcall_defs.h"
 
 // start.c
 void            timerhalt(void);
@@ -25,8 +28,18 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bprefetch(uint, uint, int);
+void            bstart(void);
+void            bwrite_start(struct buf*);
+void            bwrite_startv(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcache_reclaim(int);
+int             bcache_settarget(int);
+void            bcache_setmin(int);
+void            bcache_stats(struct bcache_info*);
+void            bcache_dump(void);
 
 // console.c
 void            consoleinit(void);
@@ -35,6 +48,18 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             exec_load(struct proc*, char*, char**);
+int             exec_fault(struct proc*, uint64, int);
+
+// pagecache.c
+void            pagecacheinit(void);
+void*           pagecache_get(struct inode*, uint);
+int             pagecache_cached(uint, uint, uint);
+void            pagecache_write(struct inode*, uint, char*, uint);
+void            pagecache_forget(uint, uint, uint);
+void            pagecache_truncate(struct inode*);
+int             pagecache_reclaim(int);
+void            pagecache_dump(void);
 
 // file.c
 struct file*    filealloc(void);
@@ -51,6 +76,7 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct inode*   iget(uint, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -61,6 +87,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            readahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -76,14 +103,38 @@ void*           kalloc(void);
 void*           kalloc_zero(void);
 void            kfree(void *);
 void            kinit(void);
+void            kalloc_dump(void);
+int             kalloc_nfree(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            kpage_dup(void *);
+int             kpage_refs(void *);
+void            kpage_setcow(void *, int);
+int             kpage_iscow(void *);
+int             kalloc_prezero(void);
+
+// slab.c
+void            slabinit(void);
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void*           kmalloc(uint);
+void*           kmalloc_zero(uint);
+void            kmfree(void*);
+void            kmem_cache_dump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
+void            begin_opn(int);
 void            end_op(void);
+void            end_opn(int);
+int             log_opmax(void);
+void            log_sync(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -93,12 +144,19 @@ int             pipewrite(struct pipe*, uint64, int);
 // proc.c
 int             cpuid(void);
 void            exit(int);
+void            thread_exit(int) __attribute__((noreturn));
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             spawn(char*, char**, int*, int);
+int             clone(uint64, uint64, uint64);
+int             thread_join(int, uint64);
+int             growproc(int, uint64*);
+int             group_lockvm(struct proc*);
+void            group_unlockvm(struct proc*, int);
+void            group_shootdown(struct proc*);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+void            proc_freepagetable(pagetable_t, uint64, struct execseg*, int);
 int             kill(int);
+int             setpriority(int, int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
@@ -108,6 +166,7 @@ void            procinit(void);
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+void            kthread_create(void (*)(void), char*);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -118,6 +177,8 @@ void            procdump(void);
 // scheduler.c
 void            schedulerinit(void);
 void            schedule_proc(struct proc*);
+void            scheduler_dump(void);
+int             scheduler_tick(struct proc*);
 void            scheduler(void) __attribute__((noreturn));
 
 // swtch.S
@@ -126,6 +187,7 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingany(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -133,6 +195,7 @@ void            pop_off(void);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -161,6 +224,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+uint64          upcall_return(uint64);
 
 // uart.c
 void            uartinit(void);
@@ -172,23 +236,29 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            tlb_shootdown(uint64);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
-uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
-void            uvmfree(pagetable_t, uint64);
+uint64          uvmdealloc(pagetable_t, uint64, uint64, struct execseg*, int);
+uint64          uvmshrink(struct proc*, uint64, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, struct execseg*, int);
+void            uvmfree(pagetable_t, uint64, struct execseg*, int);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+void            uvmunmap_lazy(pagetable_t, uint64, uint64, int, struct execseg*, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkmega(pagetable_t, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+void            uvmprefault(uint64, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 uint64          print_pt(); // prints contents of a processes pagetable
-void            uvmfreelevels(pagetable_t);
+void*           uvmfreelevels(pagetable_t);
 
 // plic.c
 void            plicinit(void);
@@ -199,6 +269,10 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
 // virtio_net.c
@@ -210,8 +284,11 @@ void            virtio_net_intr(void);
 void          futex_control_init();
 uint64          __futex_init(uint64* futex);
 void            __futex_deinit(void* phys_page_addr);
-uint64          __futex_wait(uint64* futex, int val); 
-uint64          __futex_wake(uint64* futex, int num_wake);
+uint64          __futex_wait(uint64* futex, uint64 val, int timeout);
+uint64          __futex_wake(uint64* futex, int num_wake, int flags);
+uint64          __futex_requeue(uint64* futex, int num_wake, uint64* futex2, int num_requeue, uint64 val);
+uint64          __futex_wake_op(uint64* futex, int num_wake, uint64* futex2, int num_wake2, int op);
+void            futex_tick(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,6 +3,85 @@
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
+// Map the page at va of the program p runs, if va lies in
+// one of its lazily loaded segments and isn't mapped yet.
+// Read-only pages map the page cache's page itself, so all
+// processes running the program share them. Writable pages and
+// pages that need zeroes after the file data are private copies.
+// If cansleep is 0 only pages that need no disk read are loaded.
+// Returns 0 on success, -1 otherwise.
+int
+exec_fault(struct proc *p, uint64 va, int cansleep)
+{
+  struct execseg *seg;
+  pte_t *pte;
+  uint64 segoff;
+  uint n, fileoff;
+  void *pa;
+  int locked;
+  struct proc *g = p->group;
+
+  va = PGROUNDDOWN(va);
+  if(g->exec_ip == 0 || va >= g->sz)
+    return -1;
+  for(seg = g->exec_segs; seg < g->exec_segs + g->exec_nsegs; seg++)
+    if(va >= seg->vaddr && va < seg->vaddr + seg->memsz)
+      break;
+  if(seg == g->exec_segs + g->exec_nsegs)
+    return -1;
+
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return -1;
+
+  segoff = va - seg->vaddr;
+  n = 0;
+  if(segoff < seg->filesz)
+    n = seg->filesz - segoff < PGSIZE ? seg->filesz - segoff : PGSIZE;
+
+  if(n == 0){
+    if((pa = kalloc_zero()) == 0)
+      return -1;
+  } else if(!cansleep){
+    return -1;
+  } else {
+    fileoff = seg->off + segoff;
+    // A write to the program file might hold its lock while
+    // copying from a page of the same program.
+    locked = holdingsleep(&g->exec_ip->lock);
+    // Locking the program while holding another inode could deadlock
+    // with a process that copies from our program into that inode.
+    // Such copies prefault first, see fileread() and filewrite().
+    if(!locked && p->ilocks > 0)
+      return -1;
+    if(!locked)
+      ilock(g->exec_ip);
+    if(!(seg->perm & PTE_W) && fileoff % PGSIZE == 0 && (n == PGSIZE || seg->filesz == seg->memsz)){
+      pa = pagecache_get(g->exec_ip, fileoff);
+    } else if((pa = kalloc_zero()) != 0 && readi(g->exec_ip, 0, (uint64)pa, fileoff, n) != n){
+      kfree(pa);
+      pa = 0;
+    }
+    if(!locked)
+      iunlock(g->exec_ip);
+    if(pa == 0)
+      return -1;
+  }
+
+  // Another thread of the group may have loaded the page meanwhile
+  locked = group_lockvm(g);
+  if((pte = walk(p->pagetable, va, 1)) == 0){
+    group_unlockvm(g, locked);
+    kfree(pa);
+    return -1;
+  }
+  if(*pte & PTE_V)
+    kfree(pa);
+  else
+    *pte = PA2PTE(pa) | seg->perm | PTE_R | PTE_U | PTE_V;
+  group_unlockvm(g, locked);
+  return 0;
+}
+
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -15,15 +94,31 @@ int flags2perm(int flags)
 
 int
 exec(char *path, char **argv)
+{
+  struct proc *p = myproc();
+
+  // The other threads would lose their memory
+  if(p->group != p || p->threads != 0)
+    return -1;
+  return exec_load(p, path, argv);
+}
+
+// Replace the user image of p with the program at path.
+// p is either the caller or a new child of the caller that
+// hasn't run yet and isn't visible to the scheduler.
+// p has no threads.
+// Returns argc, or -1 with p's old image left intact.
+int
+exec_load(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nsegs = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *execip = 0, *oldip;
   struct proghdr ph;
+  struct execseg segs[NEXECSEG];
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -55,18 +150,42 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz)
       goto bad;
+    if(nsegs == NEXECSEG){
+      // No room to remember the segment, load it right away
+      uint64 sz1;
+      if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+        goto bad;
+      if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+        goto bad;
+    } else {
+      // Pages between segments are mapped like before, only
+      // the segments themselves may have missing pages
+      if(PGROUNDUP(sz) < ph.vaddr && uvmalloc(pagetable, sz, ph.vaddr, 0) == 0)
+        goto bad;
+      // Pages are read on first touch, see exec_fault()
+      segs[nsegs].vaddr = ph.vaddr;
+      segs[nsegs].memsz = ph.memsz;
+      segs[nsegs].off = ph.off;
+      segs[nsegs].filesz = ph.filesz;
+      segs[nsegs].perm = flags2perm(ph.flags);
+      nsegs++;
+    }
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // The segments keep the program file referenced
+  iunlock(ip);
   end_op();
+  if(nsegs > 0)
+    execip = ip;
+  else {
+    begin_op();
+    iput(ip);
+    end_op();
+  }
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -122,17 +241,33 @@ exec(char *path, char **argv)
   p->last_mmap = MMAP_MIN_ADDR;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  p->upcall = 0;
+  p->upcall_active = 0;
+  oldip = p->exec_ip;
+  p->exec_ip = execip;
+  proc_freepagetable(oldpagetable, oldsz, p->exec_segs, p->exec_nsegs);
+  memmove(p->exec_segs, segs, sizeof(segs));
+  p->exec_nsegs = nsegs;
+  if(oldip){
+    begin_op();
+    iput(oldip);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
-    proc_freepagetable(pagetable, sz);
+    proc_freepagetable(pagetable, sz, segs, nsegs);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(execip){
+    begin_op();
+    iput(execip);
+    end_op();
+  }
   return -1;
 }
 
@@ -5,15 +5,20 @@
 #include "defs.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache, at most NFILE at a time.
+// ftable.lock protects the reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache cache;
+  int nfile;                // file structures currently allocated
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -23,15 +28,16 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE || (f = kmem_cache_alloc(&ftable.cache)) == 0){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -62,7 +68,9 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -92,6 +100,31 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Read ahead of a reader that just moved f->off.
+// The window doubles with every sequential read up to RA_MAXBLOCKS,
+// the next window is started once the reader is half way into the last one.
+// A random read stops readahead until reads are sequential again.
+// Caller must hold f->ip->lock.
+static void
+filereadahead(struct file *f, int sequential)
+{
+  if(!sequential){
+    f->ra_window = 0;
+    f->ra_end = f->off;
+    return;
+  }
+  if(f->ra_window == 0)
+    f->ra_window = RA_MINBLOCKS;
+  if(f->off + f->ra_window * BSIZE / 2 < f->ra_end)
+    return;
+
+  uint start = f->ra_end > f->off ? f->ra_end : f->off;
+  readahead(f->ip, start, f->ra_window * BSIZE);
+  f->ra_end = start + f->ra_window * BSIZE;
+  if(f->ra_window < RA_MAXBLOCKS)
+    f->ra_window *= 2;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -109,9 +142,15 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // Program pages can't be loaded while we hold the inode lock
+    uvmprefault(addr, n);
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    int sequential = f->off == f->ra_next;
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
       f->off += r;
+      filereadahead(f, sequential);
+    }
+    f->ra_next = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -138,24 +177,29 @@ filewrite(struct file *f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the log space one op may reserve, including
+    // i-node, up to three (double) indirect blocks,
+    // allocation blocks, and 2 blocks of slop for
+    // non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((log_opmax()-1-3-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      // reserve what this chunk can write, not the largest op
+      int nblocks = 2 * ((n1 + BSIZE - 1) / BSIZE) + 1 + 3 + 2;
 
-      begin_op();
+      // Program pages can't be loaded while we hold the inode lock
+      uvmprefault(addr + i, n1);
+      begin_opn(nblocks);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opn(nblocks);
 
       if(r != n1){
         // error from writei
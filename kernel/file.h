@@ -21,6 +21,9 @@ struct file {
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
   short major;       // FD_DEVICE
+  uint ra_next;      // FD_INODE, offset at which the next read is sequential
+  uint ra_end;       // FD_INODE, blocks up to this offset were read ahead
+  uint ra_window;    // FD_INODE, blocks to read ahead, 0 after a random read
 };
 
 #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -40,7 +43,7 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
 };
 
 // map major device number to device functions.
@@ -180,7 +180,6 @@ iinit()
   }
 }
 
-static struct inode* iget(uint dev, uint inum);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -234,7 +233,7 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
-static struct inode*
+struct inode*
 iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
@@ -290,6 +289,8 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  if(myproc())
+    myproc()->ilocks++;
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -314,6 +315,8 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  if(myproc())
+    myproc()->ilocks--;
   releasesleep(&ip->lock);
 }
 
@@ -365,7 +368,31 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT].  The double indirect
+// block ip->addrs[NDIRECT+1] lists NINDIRECT indirect blocks,
+// which list the last NDINDIRECT blocks.
+
+// Return the address in slot i of the indirect block addr,
+// allocating a block for the slot if it is empty.
+// returns 0 if out of disk space.
+static uint
+indirect_slot(struct inode *ip, uint addr, uint i)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    addr = balloc(ip->dev);
+    if(addr){
+      a[i] = addr;
+      log_write(bp);
+    }
+  }
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -373,8 +400,7 @@ iunlockput(struct inode *ip)
 uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
@@ -395,30 +421,57 @@ bmap(struct inode *ip, uint bn)
         return 0;
       ip->addrs[NDIRECT] = addr;
     }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
+    return indirect_slot(ip, addr, bn);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load double indirect block, then the indirect block below it.
+    if((addr = ip->addrs[NDIRECT+1]) == 0){
       addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
+      if(addr == 0)
+        return 0;
+      ip->addrs[NDIRECT+1] = addr;
     }
-    brelse(bp);
-    return addr;
+    if((addr = indirect_slot(ip, addr, bn / NINDIRECT)) == 0)
+      return 0;
+    return indirect_slot(ip, addr, bn % NINDIRECT);
   }
 
   panic("bmap: out of range");
 }
 
+// Free the indirect block addr and the blocks it lists.
+// depth 1 frees an indirect block, depth 2 a double indirect one.
+static void
+indirect_free(struct inode *ip, uint addr, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 1)
+      indirect_free(ip, a[j], depth - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, addr);
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  pagecache_truncate(ip);
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -428,17 +481,15 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    indirect_free(ip, ip->addrs[NDIRECT], 1);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    indirect_free(ip, ip->addrs[NDIRECT+1], 2);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
   iupdate(ip);
 }
@@ -455,7 +506,7 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
+// Read data from inode through the page cache.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
@@ -463,7 +514,7 @@ int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  char *page;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -471,21 +522,50 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
+    if((page = pagecache_get(ip, PGROUNDDOWN(off))) == 0)
       break;
-    bp = bread(ip->dev, addr);
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if(either_copyout(user_dst, dst, page + (off % PGSIZE), m) == -1) {
+      kfree(page);
       tot = -1;
       break;
     }
-    brelse(bp);
+    kfree(page);
   }
   return tot;
 }
 
+// Queue reads of the blocks of ip in [off, off+n) into the buffer cache,
+// skipping pages the page cache holds already.
+// Caller must hold ip->lock.
+void
+readahead(struct inode *ip, uint off, uint n)
+{
+  uint addr, start = 0;
+  int len = 0;
+
+  if(off >= ip->size)
+    return;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  // Blocks next to each other on the disk are read by one request
+  for(uint end = off + n, bn = off / BSIZE; bn * BSIZE < end; bn++){
+    if(pagecache_cached(ip->dev, ip->inum, PGROUNDDOWN(bn * BSIZE)))
+      addr = 0;
+    else
+      addr = bmap(ip, bn);
+    if(len > 0 && (addr == 0 || addr != start + len)){
+      bprefetch(ip->dev, start, len);
+      len = 0;
+    }
+    if(addr != 0 && len++ == 0)
+      start = addr;
+  }
+  if(len > 0)
+    bprefetch(ip->dev, start, len);
+  bstart();
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -515,6 +595,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       break;
     }
     log_write(bp);
+    // Keep a cached copy of the page up to date
+    pagecache_write(ip, off, (char*)bp->data + (off % BSIZE), m);
     brelse(bp);
   }
 
@@ -643,11 +725,17 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  struct proc *g;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    // Another thread might change directory
+    g = myproc()->group;
+    acquire(&g->grouplock);
+    ip = idup(g->cwd);
+    release(&g->grouplock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -1,145 +1,417 @@
 #include "kernel/defs.h"
+#include "kernel/proc.h"
 #include "kernel/printk.h"
 #include "kernel/futex.h"
 #include "kernel/process_queue.h"
 
-static struct futex_control* futex_control_list;
-static struct futex_queue_map futex_queue_map;
+static struct futex_bucket futex_table[FUTEX_HASH_BUCKETS];
+static struct kmem_cache futex_queue_cache;
+
+// Pending timeouts, sorted by deadline. Taken before bucket locks.
+static struct {
+    struct spinlock lock;
+    struct futex_timeout* head;
+} futex_timeouts;
 
 void futex_control_init() {
+    for (int i = 0; i < FUTEX_HASH_BUCKETS; i++) {
+        initlock(&futex_table[i].lock, "futex-bucket");
+        futex_table[i].head = NULL;
+    }
+    kmem_cache_init(&futex_queue_cache, "futex-queue", sizeof(struct futex_queue));
+    initlock(&futex_timeouts.lock, "futex-timeouts");
+    futex_timeouts.head = NULL;
+}
+
+/**
+ * Returns the bucket of the futex at physical address key
+*/
+static struct futex_bucket* futex_bucket(uint64 key) {
+    uint64 hash = (key >> 3) * 0x9e3779b97f4a7c15;
+    return &futex_table[(hash >> 32) % FUTEX_HASH_BUCKETS];
+}
 
-    struct futex_control* next = NULL;
-    for (int i = 0; i < FUTEX_CONTROL_PAGES; i++) {
-        struct futex_control* prev = kalloc_zero();
-        if (prev == NULL)
-            panic("futex_control_init kalloc");
-        prev->next = next;
-        next = prev;
+/**
+ * Locks the buckets of two futexes, in address order so two callers can't deadlock.
+ * Both may be the same bucket, it is only locked once then.
+*/
+static void futex_lock_pair(struct futex_bucket* a, struct futex_bucket* b) {
+    if (a > b) {
+        struct futex_bucket* tmp = a;
+        a = b;
+        b = tmp;
     }
-    futex_control_list = next;
-    for (int i = 0 ; i < FUTEX_MAX_LOCKS; i++) {
-        futex_queue_map.entries[i].key = NULL;
+    acquire(&a->lock);
+    if (b != a)
+        acquire(&b->lock);
+}
+
+static void futex_unlock_pair(struct futex_bucket* a, struct futex_bucket* b) {
+    if (b != a)
+        release(&b->lock);
+    release(&a->lock);
+}
+
+/**
+ * Assumes held bucket lock.
+ * Returns the queue of key, creates one if create is set and there is none.
+ * Returns NULL if there is no queue or no memory for one.
+*/
+static struct futex_queue* futex_queue_get(struct futex_bucket* bucket, uint64 key, int create) {
+    for (struct futex_queue* queue = bucket->head; queue != NULL; queue = queue->next) {
+        if (queue->key == key)
+            return queue;
     }
-    initlock(&futex_queue_map.map_lock, "futex-map-lock");
+    if (!create)
+        return NULL;
+
+    struct futex_queue* queue = kmem_cache_alloc(&futex_queue_cache);
+    if (queue == NULL)
+        return NULL;
+    queue->key = key;
+    init_queue(&queue->waiters, "futex", QLINK_WAIT);
+    queue->next = bucket->head;
+    bucket->head = queue;
+    return queue;
 }
 
 /**
- * Return pointer to unused queue
- * else return NULL
+ * Assumes held bucket lock.
+ * Frees queue once nobody waits on it anymore.
 */
-ProcessQueue* futex_control_find_free() {
-    struct futex_control* current = futex_control_list;
-    for (int i = 0; i < FUTEX_MAX_LOCKS; i++)
-    {
-        // If we've reached the end of a page, go to next
-        if (i > 0 && (i % FUTEX_QUEUES_PER_PAGE == 0)) {
-            current = current->next;
-        }
+static void futex_queue_put(struct futex_bucket* bucket, struct futex_queue* queue) {
+    if (queue->waiters.length > 0)
+        return;
+    struct futex_queue** link = &bucket->head;
+    while (*link != queue)
+        link = &(*link)->next;
+    *link = queue->next;
+    kmem_cache_free(&futex_queue_cache, queue);
+}
 
-        ProcessQueue* current_queue = &current->futex_queues[i % FUTEX_QUEUES_PER_PAGE];
-        if (current_queue->valid != 1) {
-            return current_queue;
-        }
+/**
+ * Assumes held bucket lock.
+ * Wakes up to num_wake waiters of the queue of key.
+ * Returns the number of waiters woken.
+*/
+static int futex_wake_queue(struct futex_bucket* bucket, uint64 key, int num_wake) {
+    struct futex_queue* queue = futex_queue_get(bucket, key, 0);
+    // Nobody waits, nothing to wake
+    if (queue == NULL)
+        return 0;
+    int woken = 0;
+    for (; woken < num_wake; woken++) {
+        struct proc* proc = pop_queue(&queue->waiters);
+        if (proc == NULL)
+            break;
+        proc->futex_bucket = NULL;
+        wakeup(proc);
     }
-    return NULL;
+    futex_queue_put(bucket, queue);
+    return woken;
 }
 
 /**
- * Inits queue list for a specific lock (if necessary)
- * Returns pointer to queue list
+ * Locks the bucket proc waits in. Requeues may move proc between buckets,
+ * so the bucket is checked again once it is locked.
+ * held is a bucket the caller locked already, or NULL.
+ * Returns the locked bucket, or NULL with nothing locked if proc doesn't wait.
 */
-void futex_map_init(uint64* addr, ProcessQueue* queue) {
-    acquire(&futex_queue_map.map_lock);
-    for (int i = 0; i < FUTEX_MAX_LOCKS; i++) {
-        if (futex_queue_map.entries[i].key == NULL) {
-            futex_queue_map.entries[i].key = addr;
-            futex_queue_map.entries[i].value = queue;
-            release(&futex_queue_map.map_lock);
-            return;
-        }
+static struct futex_bucket* futex_lock_waiter(struct proc* proc, struct futex_bucket* held) {
+    if (held != NULL) {
+        if (proc->futex_bucket == held)
+            return held;
+        release(&held->lock);
+    }
+    for (;;) {
+        struct futex_bucket* bucket = __atomic_load_n(&proc->futex_bucket, __ATOMIC_SEQ_CST);
+        if (bucket == NULL)
+            return NULL;
+        acquire(&bucket->lock);
+        if (proc->futex_bucket == bucket)
+            return bucket;
+        release(&bucket->lock);
     }
-    release(&futex_queue_map.map_lock);
-    return;
 }
 
 /**
- * Gets pointer to queue list entry from map, inits queue list if necessary
+ * Arms a timeout that wakes proc at tick deadline
 */
-ProcessQueue* futex_map_get(uint64* addr) {
-    acquire(&futex_queue_map.map_lock);
-    for (int i = 0; i < FUTEX_MAX_LOCKS; i++) {
-        struct futex_queue_map_entry* entry = &futex_queue_map.entries[i];
-        if (entry->key == addr) {
-            release(&futex_queue_map.map_lock);
-            return entry->value;
+static void futex_timeout_add(struct futex_timeout* timeout, struct proc* proc, uint deadline) {
+    timeout->proc = proc;
+    timeout->deadline = deadline;
+    timeout->expired = 0;
+    acquire(&futex_timeouts.lock);
+    struct futex_timeout** link = &futex_timeouts.head;
+    while (*link != NULL && (int)((*link)->deadline - deadline) <= 0)
+        link = &(*link)->next;
+    timeout->next = *link;
+    *link = timeout;
+    release(&futex_timeouts.lock);
+}
+
+/**
+ * Disarms timeout, if it didn't expire yet
+*/
+static void futex_timeout_remove(struct futex_timeout* timeout) {
+    acquire(&futex_timeouts.lock);
+    for (struct futex_timeout** link = &futex_timeouts.head; *link != NULL; link = &(*link)->next) {
+        if (*link == timeout) {
+            *link = timeout->next;
+            break;
         }
     }
-    release(&futex_queue_map.map_lock);
-    return NULL;
+    release(&futex_timeouts.lock);
 }
 
+/**
+ * Called on every timer interrupt.
+ * Wakes the waiters whose timeout expired. The waiter's bucket is locked
+ * while waking, so a waiter that saw no expiry is asleep by then.
+ * expired is stored before futex_bucket is loaded, and the waiter stores
+ * futex_bucket before it loads expired. Both pairs are sequentially
+ * consistent, so at least one side sees the other's store.
+*/
+void futex_tick(void) {
+    // Racy read, most ticks nobody waits with a timeout
+    if (futex_timeouts.head == NULL)
+        return;
+    acquire(&futex_timeouts.lock);
+    struct futex_timeout* timeout;
+    while ((timeout = futex_timeouts.head) != NULL && (int)(ticks - timeout->deadline) >= 0) {
+        futex_timeouts.head = timeout->next;
+        __atomic_store_n(&timeout->expired, 1, __ATOMIC_SEQ_CST);
+        struct futex_bucket* bucket = futex_lock_waiter(timeout->proc, NULL);
+        if (bucket != NULL) {
+            wakeup(timeout->proc);
+            release(&bucket->lock);
+        }
+    }
+    release(&futex_timeouts.lock);
+}
 
-uint64 __futex_init(uint64* futex) {
-    // Get physical address of futex
-    uint64* futex_phys_addr = (uint64*) walkaddr(myproc()->pagetable, (uint64)futex);
-
-    // Find first free queue
-    ProcessQueue* free_queue = futex_control_find_free();
-    if (free_queue == NULL) {
-        return ENOMEM;
+/**
+ * Translates the user address of a futex into the physical address
+ * of its word. Faults the page in if it was never touched.
+ * Copy-on-write pages are copied first, the word would move on the next write.
+ * With write set, the kernel is about to change the word, so it must be writable.
+ * Returns 0 if futex isn't a valid, aligned user address.
+*/
+static uint64 futex_key(uint64* futex, int write) {
+    pagetable_t pagetable = myproc()->pagetable;
+    uint64 va = (uint64)futex;
+    if (va % sizeof(uint64) != 0)
+        return 0;
+    uvmprefault(va, sizeof(*futex));
+    uint64 page = walkaddr(pagetable, va);
+    if (page != 0 && kpage_iscow((void*)page)) {
+        if (uvmcow(pagetable, PGROUNDDOWN(va)) != 0)
+            return 0;
+        page = walkaddr(pagetable, va);
+    }
+    if (page == 0)
+        return 0;
+    if (write) {
+        pte_t* pte = walk(pagetable, PGROUNDDOWN(va), 0);
+        if (pte == NULL)
+            pte = walkmega(pagetable, va, 0);
+        if ((*pte & PTE_W) == 0)
+            return 0;
     }
-    // Init queue
-    init_queue(free_queue, "futex");
-    
-    // Init queue pointer for lock
-    futex_map_init(futex_phys_addr, free_queue);
+    // walkaddr returns the page, the word lies at the page offset of va
+    return page + (va % PGSIZE);
+}
 
-    return 0;
+/**
+ * Futexes need no registration anymore, wait queues are created on demand.
+ * Only checks that futex can be waited on.
+*/
+uint64 __futex_init(uint64* futex) {
+    return futex_key(futex, 0) == 0 ? EINVAL : 0;
 }
 
+/**
+ * Wakes all waiters on futexes on the physical page, because it is freed.
+*/
 void __futex_deinit(void* physical_page_addr) {
-    acquire(&futex_queue_map.map_lock);
-    for (int i = 0; i < FUTEX_MAX_LOCKS; i++) {
-        struct futex_queue_map_entry* entry = &futex_queue_map.entries[i];
-        // Check if it's on the same page
-        if (((uint64)entry->key >> PGSHIFT) == ((uint64)physical_page_addr >> PGSHIFT)) {
-            entry->key = NULL;
-            entry->value->valid = 0;
-            entry->value = NULL;
+    for (int i = 0; i < FUTEX_HASH_BUCKETS; i++) {
+        struct futex_bucket* bucket = &futex_table[i];
+        acquire(&bucket->lock);
+        struct futex_queue* next;
+        for (struct futex_queue* queue = bucket->head; queue != NULL; queue = next) {
+            next = queue->next;
+            if (PGROUNDDOWN(queue->key) == (uint64)physical_page_addr)
+                futex_wake_queue(bucket, queue->key, queue->waiters.length);
         }
+        release(&bucket->lock);
     }
-    release(&futex_queue_map.map_lock);
 }
 
-uint64 __futex_wait(uint64* futex, int val) {
-    uint64* futex_phys_addr = (uint64*) walkaddr(myproc()->pagetable, (uint64)futex);
-    ProcessQueue* queue = futex_map_get(futex_phys_addr);
-    if (queue == NULL) {
+/**
+ * Sleeps until the futex is woken, if it still holds val.
+ * Gives up after timeout ticks, unless timeout is 0.
+ * Returns 0 once woken or if the word changed, ETIMEDOUT if the timeout expired.
+*/
+uint64 __futex_wait(uint64* futex, uint64 val, int timeout) {
+    uint64 key = futex_key(futex, 0);
+    if (key == 0)
         return EINVAL;
-    }
-    acquire(&queue->queue_lock);
+    struct proc* my_proc = myproc();
+    struct futex_timeout my_timeout = { .expired = 0 };
+    // Armed before any bucket lock is taken, see futex_tick()
+    if (timeout > 0)
+        futex_timeout_add(&my_timeout, my_proc, ticks + timeout);
 
-    if (*futex_phys_addr == val) {
-        struct proc* my_proc = myproc();
-        append_queue(queue, my_proc);
-        sleep(my_proc, &queue->queue_lock);
+    uint64 result = 0;
+    struct futex_bucket* bucket = futex_bucket(key);
+    acquire(&bucket->lock);
+
+    // Wakers take the bucket lock after changing the word, no wakeup gets lost
+    if (*(volatile uint64*)key != val) {
+        release(&bucket->lock);
+    } else {
+        struct futex_queue* queue = futex_queue_get(bucket, key, 1);
+        if (queue == NULL) {
+            release(&bucket->lock);
+            result = ENOMEM;
+        } else {
+            append_queue(&queue->waiters, my_proc);
+            // Published before expired is read, see futex_tick()
+            __atomic_store_n(&my_proc->futex_bucket, bucket, __ATOMIC_SEQ_CST);
+            my_proc->futex_key = key;
+            // Other wakeups on our channel don't pop us, sleep until a waker did.
+            // A requeue may have moved us to another bucket in the meantime.
+            while (bucket != NULL) {
+                int expired = __atomic_load_n(&my_timeout.expired, __ATOMIC_SEQ_CST);
+                if (killed(my_proc) || expired) {
+                    // Leave the queue ourselves, don't leave a dangling link
+                    queue = futex_queue_get(bucket, my_proc->futex_key, 0);
+                    remove_queue(&queue->waiters, my_proc);
+                    futex_queue_put(bucket, queue);
+                    my_proc->futex_bucket = NULL;
+                    if (expired)
+                        result = ETIMEDOUT;
+                    release(&bucket->lock);
+                    break;
+                }
+                sleep(my_proc, &bucket->lock);
+                bucket = futex_lock_waiter(my_proc, bucket);
+            }
+        }
     }
-    release(&queue->queue_lock);
+
+    if (timeout > 0)
+        futex_timeout_remove(&my_timeout);
+    return result;
+}
+
+/**
+ * Wakes up to num_wake waiters of the futex.
+ * With FUTEX_YIELD the caller gives up the cpu if anybody was woken,
+ * so a woken waiter may take a lock before the caller takes it again.
+*/
+uint64 __futex_wake(uint64* futex, int num_wake, int flags) {
+    uint64 key = futex_key(futex, 0);
+    if (key == 0)
+        return EINVAL;
+    struct futex_bucket* bucket = futex_bucket(key);
+    acquire(&bucket->lock);
+    int woken = futex_wake_queue(bucket, key, num_wake);
+    release(&bucket->lock);
+    if ((flags & FUTEX_YIELD) && woken > 0)
+        yield();
     return 0;
 }
 
-uint64 __futex_wake(uint64* futex, int num_wake) {
-    uint64* futex_phys_addr = (uint64*) walkaddr(myproc()->pagetable, (uint64)futex);
-    ProcessQueue* queue = futex_map_get(futex_phys_addr);
-    if (queue == NULL) {
+/**
+ * Wakes up to num_wake waiters of futex and moves up to num_requeue
+ * of the remaining ones to futex2, without waking them.
+ * Returns EAGAIN if futex doesn't hold val anymore.
+*/
+uint64 __futex_requeue(uint64* futex, int num_wake, uint64* futex2, int num_requeue, uint64 val) {
+    uint64 key = futex_key(futex, 0);
+    uint64 key2 = futex_key(futex2, 0);
+    if (key == 0 || key2 == 0)
         return EINVAL;
+    struct futex_bucket* bucket = futex_bucket(key);
+    struct futex_bucket* bucket2 = futex_bucket(key2);
+    futex_lock_pair(bucket, bucket2);
+
+    uint64 result = 0;
+    if (*(volatile uint64*)key != val) {
+        result = EAGAIN;
+    } else if (key != key2) {
+        futex_wake_queue(bucket, key, num_wake);
+        struct futex_queue* queue = futex_queue_get(bucket, key, 0);
+        struct futex_queue* queue2 = NULL;
+        for (int i = 0; queue != NULL && i < num_requeue && queue->waiters.length > 0; i++) {
+            if (queue2 == NULL && (queue2 = futex_queue_get(bucket2, key2, 1)) == NULL) {
+                result = ENOMEM;
+                break;
+            }
+            // Both buckets are locked, the waiter finds its new bucket after waking
+            struct proc* proc = pop_queue(&queue->waiters);
+            append_queue(&queue2->waiters, proc);
+            proc->futex_key = key2;
+            __atomic_store_n(&proc->futex_bucket, bucket2, __ATOMIC_SEQ_CST);
+        }
+        if (queue != NULL)
+            futex_queue_put(bucket, queue);
+    } else {
+        // Requeueing onto the same futex leaves the waiters where they are
+        futex_wake_queue(bucket, key, num_wake);
     }
-    acquire(&queue->queue_lock);
-    for (int i = 0; i < num_wake; i++) {
-        struct proc* proc = pop_queue(queue);
-        wakeup(proc);
+
+    futex_unlock_pair(bucket, bucket2);
+    return result;
+}
+
+/**
+ * Applies the operation encoded by FUTEX_OP() to the word of futex2,
+ * wakes up to num_wake waiters of futex and, if the old word of futex2
+ * passes the comparison, up to num_wake2 waiters of futex2.
+*/
+uint64 __futex_wake_op(uint64* futex, int num_wake, uint64* futex2, int num_wake2, int op) {
+    uint64 key = futex_key(futex, 0);
+    uint64 key2 = futex_key(futex2, 1);
+    if (key == 0 || key2 == 0)
+        return EINVAL;
+
+    int oparg = (op << 8) >> 20;   // sign extend the 12 bit fields
+    int cmparg = (op << 20) >> 20;
+    uint64* word = (uint64*)key2;
+    uint64 old;
+
+    struct futex_bucket* bucket = futex_bucket(key);
+    struct futex_bucket* bucket2 = futex_bucket(key2);
+    futex_lock_pair(bucket, bucket2);
+
+    switch ((op >> 28) & 0xf) {
+    case FUTEX_OP_SET:  old = __atomic_exchange_n(word, (uint64)oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_ADD:  old = __atomic_fetch_add(word, (uint64)oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_OR:   old = __atomic_fetch_or(word, (uint64)oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_ANDN: old = __atomic_fetch_and(word, ~(uint64)oparg, __ATOMIC_SEQ_CST); break;
+    case FUTEX_OP_XOR:  old = __atomic_fetch_xor(word, (uint64)oparg, __ATOMIC_SEQ_CST); break;
+    default:
+        futex_unlock_pair(bucket, bucket2);
+        return EINVAL;
     }
-    release(&queue->queue_lock);
-    yield(); // Yield to allow other procs to get lock
+
+    int64 sold = (int64)old;
+    int cmp;
+    switch ((op >> 24) & 0xf) {
+    case FUTEX_OP_CMP_EQ: cmp = sold == cmparg; break;
+    case FUTEX_OP_CMP_NE: cmp = sold != cmparg; break;
+    case FUTEX_OP_CMP_LT: cmp = sold < cmparg; break;
+    case FUTEX_OP_CMP_LE: cmp = sold <= cmparg; break;
+    case FUTEX_OP_CMP_GT: cmp = sold > cmparg; break;
+    case FUTEX_OP_CMP_GE: cmp = sold >= cmparg; break;
+    default: cmp = 0; break;
+    }
+
+    futex_wake_queue(bucket, key, num_wake);
+    if (cmp)
+        futex_wake_queue(bucket2, key2, num_wake2);
+    futex_unlock_pair(bucket, bucket2);
     return 0;
-}
\ No newline at end of file
+}
@@ -8,29 +8,45 @@ extern "C" {
 #include "kernel/process_queue.h"
 #include "kernel/defs.h"
 #include "uk-shared/error_codes.h"
-
-#define FUTEX_MAX_LOCKS     49      // only multiples of queues_per_page
-#define FUTEX_QUEUES_PER_PAGE     (PGSIZE / sizeof(ProcessQueue))
-#define FUTEX_CONTROL_PAGES (FUTEX_MAX_LOCKS / FUTEX_QUEUES_PER_PAGE)
-
-struct futex_control {
-    ProcessQueue futex_queues[FUTEX_QUEUES_PER_PAGE];
-    struct futex_control* next;
+#include "uk-shared/futex_defs.h"
+
+// Number of hash buckets of the futex table
+#define FUTEX_HASH_BUCKETS 64
+
+/**
+ * Wait queue of one futex.
+ * Created by the first waiter and freed once the last waiter left,
+ * so only futexes somebody waits on cost memory.
+*/
+struct futex_queue {
+    uint64 key;                 // Physical address of the futex word
+    ProcessQueue waiters;       // Procs sleeping on the futex
+    struct futex_queue* next;   // Next queue in the same bucket
 };
 
-struct futex_queue_map_entry {
-    void* key;
-    ProcessQueue* value;
+/**
+ * Pending timeout of a futex wait, lives on the waiter's stack.
+ * Kept in a list sorted by deadline, futex_tick() wakes expired waiters.
+*/
+struct futex_timeout {
+    struct proc* proc;          // Waiter
+    uint deadline;              // Tick at which the wait times out
+    int expired;                // Set once the deadline passed, accessed atomically
+    struct futex_timeout* next;
 };
 
-struct futex_queue_map {
-    struct futex_queue_map_entry entries[FUTEX_MAX_LOCKS];
-    struct spinlock map_lock;
+/**
+ * Bucket of the futex table.
+ * The lock protects the chain and the waiters of all its queues,
+ * waiters sleep on it.
+*/
+struct futex_bucket {
+    struct spinlock lock;
+    struct futex_queue* head;
 };
 
-
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
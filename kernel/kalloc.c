@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
 
 #include "memlayout.h"
 #include "defs.h"
@@ -12,27 +13,86 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;   // only used on the buddy free lists
 };
 
+// Buddy allocator. Free memory is kept in blocks of 2^order pages,
+// aligned to their size relative to KERNBASE, one free list per order.
+// A freed block is merged with its buddy as long as the buddy is free
+// too, so large blocks form again as memory is given back.
+#define NPHYSPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PAGEINDEX(pa) (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+#define PAGEADDR(i) ((struct run*)(KERNBASE + ((uint64)(i) << PGSHIFT)))
+
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run *freelist[MAXORDER + 1];
+  int nfree[MAXORDER + 1];      // blocks on each free list
+  uchar order[NPHYSPAGES];      // order + 1 of the free block starting at a page, 0 if none
 } kmem;
 
+// Reference counts of pages handed out by kalloc(), so pages can be
+// shared copy-on-write. kalloc() sets the count to 1, kpage_dup() adds
+// a reference and kfree() only frees the page once the last one is gone.
+// cow marks pages whose mappings were writable before they got shared.
+struct {
+  int ref[NPHYSPAGES];
+  uchar cow[NPHYSPAGES];
+} kpages;
+
+// Pages cached per hart, so most kalloc()/kfree() calls never touch
+// kmem.lock. A magazine is refilled from / drained to the buddy
+// allocator KMAG_BATCH pages at a time.
+// Each hart only uses its own magazine, under m->lock. The lock is
+// only contended when kalloc_pages() drains all magazines.
+// Pages cached on other harts are not visible to kalloc(), so up to
+// NCPU*KMAG_SIZE pages may sit unused when memory runs out.
+#define KMAG_SIZE  64
+#define KMAG_BATCH 32
+
+struct kmag {
+  struct spinlock lock;
+  struct run *pages;
+  int count;
+  uint64 hits;      // kalloc()s served from the magazine
+  uint64 refills;   // batches taken from the buddy allocator
+  uint64 drains;    // batches given back to the buddy allocator
+} kmags[NCPU];
+
+// Pages zeroed ahead of time by idle harts, see kalloc_prezero().
+// kalloc_zero() takes from here first so it usually skips the memset.
+#define KZERO_TARGET 64
+#define KZERO_BATCH  8
+
+struct {
+  struct spinlock lock;
+  struct run *pages;
+  int count;
+  uint64 hits;      // kalloc_zero()s served from the pool
+  uint64 misses;    // kalloc_zero()s that had to zero a page
+} kzero;
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmags[i].lock, "kmag");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void buddy_free(struct run *r, int order);
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddy_free((struct run*)p, 0);
+  release(&kmem.lock);
 }
 
 /**
@@ -46,6 +106,112 @@ fast_page_memset(uint64* start, uint64 content)
   }
 }
 
+// Unlink a free block from the free list of its order.
+// Caller must hold kmem.lock.
+static void
+buddy_unlink(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  kmem.order[PAGEINDEX(r)] = 0;
+  kmem.nfree[order]--;
+}
+
+// Put a free block on the free list of its order.
+// Caller must hold kmem.lock.
+static void
+buddy_link(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = kmem.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  kmem.freelist[order] = r;
+  kmem.order[PAGEINDEX(r)] = order + 1;
+  kmem.nfree[order]++;
+}
+
+// Take a block of 2^order pages, splitting a larger one if needed.
+// Caller must hold kmem.lock. Returns 0 if no block is large enough.
+static struct run*
+buddy_alloc(int order)
+{
+  struct run *r;
+  int o;
+
+  for(o = order; o <= MAXORDER && kmem.freelist[o] == 0; o++)
+    ;
+  if(o > MAXORDER)
+    return 0;
+
+  r = kmem.freelist[o];
+  buddy_unlink(r, o);
+  // Give the upper halves back until the block has the right size.
+  while(o > order){
+    o--;
+    buddy_link(PAGEADDR(PAGEINDEX(r) + (1 << o)), o);
+  }
+  return r;
+}
+
+// Free a block of 2^order pages, merging it with free buddies.
+// Caller must hold kmem.lock.
+static void
+buddy_free(struct run *r, int order)
+{
+  uint64 i = PAGEINDEX(r);
+
+  while(order < MAXORDER){
+    uint64 buddy = i ^ (1 << order);
+    if(buddy >= NPHYSPAGES || kmem.order[buddy] != order + 1)
+      break;
+    buddy_unlink(PAGEADDR(buddy), order);
+    i &= ~(uint64)(1 << order);
+    order++;
+  }
+  buddy_link(PAGEADDR(i), order);
+}
+
+// Move up to KMAG_BATCH pages from the buddy allocator into m.
+// Caller must hold m->lock.
+static void
+kmag_refill(struct kmag *m)
+{
+  struct run *r;
+  int n;
+
+  acquire(&kmem.lock);
+  for(n = 0; n < KMAG_BATCH && (r = buddy_alloc(0)) != 0; n++){
+    r->next = m->pages;
+    m->pages = r;
+  }
+  release(&kmem.lock);
+  m->count += n;
+  if(n)
+    m->refills++;
+}
+
+// Move KMAG_BATCH pages from m back to the buddy allocator.
+// Caller must hold m->lock.
+static void
+kmag_drain(struct kmag *m)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(int n = 0; n < KMAG_BATCH; n++){
+    r = m->pages;
+    m->pages = r->next;
+    buddy_free(r, 0);
+  }
+  release(&kmem.lock);
+  m->count -= KMAG_BATCH;
+  m->drains++;
+}
 
 // Free the page of physical memory pointed at by pa,
 // which normally should have been returned by a
@@ -55,19 +221,131 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmag *m;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // Somebody else still maps the page.
+  int ref = __sync_sub_and_fetch(&kpages.ref[PAGEINDEX(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: not allocated");
+  kpages.cow[PAGEINDEX(pa)] = 0;
+
+#ifdef DEBUG_KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   fast_page_memset((uint64*)pa, 0x0101010101010101);
+#endif
 
   r = (struct run*)pa;
 
+  push_off();
+  m = &kmags[cpuid()];
+  acquire(&m->lock);
+  if(m->count >= KMAG_SIZE)
+    kmag_drain(m);
+  r->next = m->pages;
+  m->pages = r;
+  m->count++;
+  release(&m->lock);
+  pop_off();
+}
+
+// Take a page from this hart's magazine, refilling it if empty.
+// Returns 0 if the memory cannot be allocated.
+static struct run*
+kalloc_page(void)
+{
+  struct run *r;
+  struct kmag *m;
+
+  push_off();
+  m = &kmags[cpuid()];
+  acquire(&m->lock);
+  if(m->count == 0)
+    kmag_refill(m);
+  else
+    m->hits++;
+  r = m->pages;
+  if(r){
+    m->pages = r->next;
+    m->count--;
+  }
+  release(&m->lock);
+  pop_off();
+  return r;
+}
+
+// Take a page from the pre-zeroed pool, 0 if it is empty.
+// count is non-zero for kalloc_zero(), which keeps the statistics.
+static struct run*
+kzero_pop(int count)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.pages;
+  if(r){
+    kzero.pages = r->next;
+    kzero.count--;
+  }
+  if(count){
+    if(r)
+      kzero.hits++;
+    else
+      kzero.misses++;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// Out of memory, drop unmapped file pages from the page cache,
+// then unused buffers from the buffer cache.
+// Only done if the caller holds no spinlock, the caches
+// take their own locks and the caller might hold one they depend on.
+// Returns non-zero if pages were freed.
+static int
+kalloc_reclaim(void)
+{
+  if(holdingany())
+    return 0;
+  return pagecache_reclaim(KMAG_BATCH) > 0 || bcache_reclaim(KMAG_BATCH) > 0;
+}
+
+// Give the pages cached in every magazine and in the pre-zeroed
+// pool back to the buddy allocator, so they can merge into blocks.
+static void
+kalloc_drain(void)
+{
+  struct run *r;
+  struct kmag *m;
+
+  for(m = kmags; m < &kmags[NCPU]; m++){
+    acquire(&m->lock);
+    if(m->count){
+      acquire(&kmem.lock);
+      while((r = m->pages) != 0){
+        m->pages = r->next;
+        buddy_free(r, 0);
+      }
+      release(&kmem.lock);
+      m->count = 0;
+      m->drains++;
+    }
+    release(&m->lock);
+  }
+
+  acquire(&kzero.lock);
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  while((r = kzero.pages) != 0){
+    kzero.pages = r->next;
+    buddy_free(r, 0);
+  }
+  kzero.count = 0;
   release(&kmem.lock);
+  release(&kzero.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -76,31 +354,183 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct run *r = kalloc_page();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  // Out of dirty pages, zeroed ones will do as well.
+  if(r == 0)
+    r = kzero_pop(0);
+  if(r == 0 && kalloc_reclaim())
+    r = kalloc_page();
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    kpages.ref[PAGEINDEX(r)] = 1;
 
+#ifdef DEBUG_KALLOC_JUNK
   if(r)
    fast_page_memset((uint64*)r, 0x0505050505050505); // fill with junk
+#endif
   return (void*)r;
 }
 
+// Allocate one zeroed page, preferably one zeroed by an idle hart.
 void*
 kalloc_zero(void)
+{
+  struct run *r = kzero_pop(1);
+
+  if(r){
+    r->next = 0; // the link was the only non-zero word
+    kpages.ref[PAGEINDEX(r)] = 1;
+    return (void*)r;
+  }
+
+  r = kalloc_page();
+  if(r == 0 && kalloc_reclaim())
+    r = kalloc_page();
+  if(r){
+    fast_page_memset((uint64*) r, 0); //zero the page
+    kpages.ref[PAGEINDEX(r)] = 1;
+  }
+  return (void*)r;
+}
+
+// Number of free pages, including those cached by harts.
+// Reads without locks, the result is only a hint.
+int
+kalloc_nfree(void)
+{
+  int n = kzero.count;
+
+  for(int o = 0; o <= MAXORDER; o++)
+    n += kmem.nfree[o] << o;
+  for(int i = 0; i < NCPU; i++)
+    n += kmags[i].count;
+  return n;
+}
+
+// Add a reference to a page returned by kalloc().
+void
+kpage_dup(void *pa)
+{
+  __sync_fetch_and_add(&kpages.ref[PAGEINDEX(pa)], 1);
+}
+
+// Number of references to a page returned by kalloc().
+int
+kpage_refs(void *pa)
+{
+  return __atomic_load_n(&kpages.ref[PAGEINDEX(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Mark or unmark pa as shared copy-on-write.
+void
+kpage_setcow(void *pa, int cow)
+{
+  kpages.cow[PAGEINDEX(pa)] = cow;
+}
+
+// Returns 1 if pa is shared copy-on-write.
+int
+kpage_iscow(void *pa)
+{
+  return kpages.cow[PAGEINDEX(pa)];
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Order 0 takes the kalloc() fast path.
+// Returns 0 if order is out of range or no block is large enough.
+void*
+kalloc_pages(int order)
 {
   struct run *r;
 
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  r = buddy_alloc(order);
   release(&kmem.lock);
 
-  if(r)
-    fast_page_memset((uint64*) r, 0); //zero the page
+  // Out of blocks, but free pages may sit unmerged in the magazines
+  // and the caches may give some back, the way kalloc() retries.
+  if(r == 0){
+    kalloc_reclaim();
+    kalloc_drain();
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+  }
+
+#ifdef DEBUG_KALLOC_JUNK
+  if(r){
+    for(int i = 0; i < (1 << order); i++)
+      fast_page_memset((uint64*)((char*)r + i * PGSIZE), 0x0505050505050505);
+  }
+#endif
   return (void*)r;
-}
\ No newline at end of file
+}
+
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || (PAGEINDEX(pa) & ((1 << order) - 1)) != 0
+     || (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+
+#ifdef DEBUG_KALLOC_JUNK
+  for(int i = 0; i < (1 << order); i++)
+    fast_page_memset((uint64*)((char*)pa + i * PGSIZE), 0x0101010101010101);
+#endif
+
+  acquire(&kmem.lock);
+  buddy_free((struct run*)pa, order);
+  release(&kmem.lock);
+}
+
+// Zero up to KZERO_BATCH pages into the pre-zeroed pool.
+// Called by the scheduler of an idle hart, with interrupts on.
+// Returns the number of pages zeroed, 0 if the pool is full
+// or there is no free memory.
+int
+kalloc_prezero(void)
+{
+  struct run *r;
+  int n;
+
+  // Racy read, at worst we zero a batch too many.
+  for(n = 0; n < KZERO_BATCH && kzero.count < KZERO_TARGET; n++){
+    if((r = kalloc_page()) == 0)
+      break;
+    fast_page_memset((uint64*)r, 0);
+    acquire(&kzero.lock);
+    r->next = kzero.pages;
+    kzero.pages = r;
+    kzero.count++;
+    release(&kzero.lock);
+  }
+  return n;
+}
+
+// Print magazine counters of every hart. For debugging.
+// No locks, like procdump.
+void
+kalloc_dump(void)
+{
+  pr_info("cpu cached hits refills drains\n");
+  for(int i = 0; i < NCPU; i++){
+    struct kmag *m = &kmags[i];
+    if(m->hits == 0 && m->refills == 0 && m->drains == 0)
+      continue;
+    pr_info("%d %d %d %d %d\n", i, m->count, (int)m->hits, (int)m->refills, (int)m->drains);
+  }
+  pr_info("zeroed %d hits %d misses %d\n", kzero.count, (int)kzero.hits, (int)kzero.misses);
+  pr_info("order free\n");
+  for(int o = 0; o <= MAXORDER; o++)
+    pr_info("%d %d\n", o, kmem.nfree[o]);
+}
@@ -10,10 +10,21 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves MAXOPBLOCKS blocks
+// of log space, system calls that know how many blocks they
+// write reserve that many with begin_opn()/end_opn() instead.
+// If the reservation doesn't fit next to the blocks logged and
+// reserved so far, begin_op() sleeps until the log writer
+// has committed.
+//
+// mkfs sets the size of the log, up to MAXLOG blocks.
+//
+// Commits are done by the log writer kernel thread. It seals
+// the open transaction once it has been open for LOG_COMMIT_TICKS,
+// the log runs out of space, or log_sync() asks for it. Sealing
+// waits for the active FS system calls to end and copies the blocks
+// of the transaction, then new system calls go on with the next
+// transaction while the copies are written to disk.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -22,13 +33,12 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOG];
 };
 
 struct log {
@@ -36,14 +46,26 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by the executing FS sys calls.
+  int sealing;     // waiting for FS sys calls to end to seal the open transaction.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // open transaction
+  struct logheader clh; // sealed transaction, written by the log writer
+  uint64 seq;       // number of the open transaction
+  uint64 committed; // number of the last transaction on disk
+  int syncreq;      // log_sync() waits for the open transaction
+  int spacewait;    // begin_op() waits for log space
+  uint opened;      // tick at which the open transaction logged its first block
+  void *wchan;      // channel the log writer sleeps on
+  char *copy[MAXLOG];   // contents of the sealed transaction's blocks
+  struct buf *shadow;   // disk requests for the copies, one per log block
+  int shadoworder;      // shadow is 2^shadoworder pages
+  struct buf *bs[MAXLOG]; // requests handed to bwrite_startv()
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void log_writer(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -55,24 +77,51 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.seq = 1;
+  log.committed = 0;
+  log.wchan = &log.wchan;
+  if (log.size < 2 || log.size - 1 > MAXLOG || log_opmax() < MAXOPBLOCKS)
+    panic("initlog: bad log size");
+  // Two transactions stay pinned in the cache, like NBUF for LOGSIZE
+  bcache_setmin(log.size * 2 + MAXOPBLOCKS * 4);
+
+  int n = log.size - 1;
+  for (log.shadoworder = 0; (PGSIZE << log.shadoworder) < n * sizeof(struct buf); log.shadoworder++)
+    ;
+  if ((log.shadow = kalloc_pages(log.shadoworder)) == 0)
+    panic("initlog: kalloc");
+  memset(log.shadow, 0, n * sizeof(struct buf));
+  for (int i = 0; i < n; i++) {
+    if ((log.copy[i] = kalloc()) == 0)
+      panic("initlog: kalloc");
+    initsleeplock(&log.shadow[i].lock, "logshadow");
+    log.shadow[i].data = (uchar*)log.copy[i];
+  }
   recover_from_log();
+  kthread_create(log_writer, "logwriter");
 }
 
 // Copy committed blocks from log to their home location
+// Only used for recovery, the log writer installs its copies
 static void
-install_trans(int recovering)
+install_trans(void)
 {
-  int tail;
+  int tail, i;
+  struct buf *dbuf[DISK_MAXSEG];
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  // A few blocks at a time, the log may be larger than the buffer cache
+  for (tail = 0; tail < log.lh.n; tail += i) {
+    for (i = 0; i < DISK_MAXSEG && tail + i < log.lh.n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bwrite_startv(dbuf, i);  // write dst to disk
+    for (int j = 0; j < i; j++) {
+      bwait(dbuf[j]);
+      brelse(dbuf[j]);
+    }
   }
 }
 
@@ -90,18 +139,18 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write a log header for the n blocks in block to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
-write_head(void)
+write_head(int n, int *block)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = n;
+  for (i = 0; i < n; i++) {
+    hb->block[i] = block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -111,94 +160,200 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
+  install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
-  write_head(); // clear the log
+  write_head(0, 0); // clear the log
 }
 
-// called at the start of each FS system call.
+// Most log blocks one FS system call may reserve.
+// Half the log, so two large ops can share a transaction.
+int
+log_opmax(void)
+{
+  return (log.size - 1) / 2;
+}
+
+// called at the start of an FS system call that
+// writes at most nblocks blocks.
 void
-begin_op(void)
+begin_opn(int nblocks)
 {
+  if(nblocks < 1 || nblocks > log_opmax())
+    panic("begin_op: reservation");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.sealing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + nblocks > log.size - 1){
       // this op might exhaust log space; wait for commit.
+      log.spacewait = 1;
+      wakeup(log.wchan);
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += nblocks;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the end of an FS system call
+// started with begin_opn(nblocks).
+void
+end_opn(int nblocks)
+{
+  acquire(&log.lock);
+  log.outstanding -= 1;
+  log.reserved -= nblocks;
+  if(log.outstanding < 0 || log.reserved < 0)
+    panic("end_op");
+  // the log writer may be waiting for the last op to end,
+  // and begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  end_opn(MAXOPBLOCKS);
+}
 
+// Wait until the updates of all FS system calls that
+// ended so far are on disk.
+void
+log_sync(void)
+{
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  // The sealed transaction is number seq-1
+  uint64 target = log.lh.n > 0 ? log.seq : log.seq - 1;
+  while(log.committed < target){
+    log.syncreq = 1;
+    wakeup(log.wchan);
+    sleep(&log.committed, &log.lock);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Write the copies of the sealed transaction to the log.
+static void
+write_log(void)
+{
+  struct buf **bs = log.bs;
+
+  // The log blocks are consecutive, a few requests write all of them
+  for (int tail = 0; tail < log.clh.n; tail++) {
+    log.shadow[tail].blockno = log.start+tail+1;
+    bs[tail] = &log.shadow[tail];
   }
+  bwrite_startv(bs, log.clh.n);
+  for (int tail = 0; tail < log.clh.n; tail++)
+    bwait(bs[tail]);
 }
 
-// Copy modified blocks from cache to log.
+// Write the copies of the sealed transaction to their home locations.
+// The cached blocks may hold updates of the open transaction already,
+// so they stay pinned and untouched.
 static void
-write_log(void)
+install_copies(void)
 {
+  struct buf **bs = log.bs;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < log.clh.n; tail++) {
+    log.shadow[tail].blockno = log.clh.block[tail];
+    bs[tail] = &log.shadow[tail];
+  }
+  // Sorted, blocks next to each other are written by one request
+  for (tail = 1; tail < log.clh.n; tail++) {
+    struct buf *b = bs[tail];
+    int i;
+    for (i = tail; i > 0 && bs[i-1]->blockno > b->blockno; i--)
+      bs[i] = bs[i-1];
+    bs[i] = b;
+  }
+  bwrite_startv(bs, log.clh.n);
+  for (tail = 0; tail < log.clh.n; tail++)
+    bwait(bs[tail]);
+
+  // The blocks are on disk, the cache may drop them now
+  for (tail = 0; tail < log.clh.n; tail++) {
+    struct buf *b = bread(log.dev, log.clh.block[tail]);
+    bunpin(b);
+    brelse(b);
   }
 }
 
 static void
-commit()
+commit(void)
+{
+  write_log();           // Write the copies to the log
+  write_head(log.clh.n, log.clh.block); // Write header to disk -- the real commit
+  install_copies();      // Now install writes to home locations
+  write_head(0, 0);      // Erase the transaction from the log
+}
+
+// Body of the log writer kernel thread.
+// Seals the open transaction when somebody needs it on disk or
+// it has been open long enough, and commits it.
+static void
+log_writer(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  acquire(&log.lock);
+  for(;;){
+    while(log.lh.n == 0 || !(log.syncreq || log.spacewait
+                             || ticks - log.opened >= LOG_COMMIT_TICKS)){
+      // With blocks logged, look at the clock on every tick
+      log.wchan = log.lh.n > 0 ? (void*)&ticks : (void*)&log.wchan;
+      sleep(log.wchan, &log.lock);
+    }
+
+    // Let the active ops finish, but don't start new ones
+    log.sealing = 1;
+    while(log.outstanding > 0)
+      sleep(&log, &log.lock);
+    log.clh = log.lh;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.syncreq = 0;
+    log.spacewait = 0;
+    uint64 seq = log.seq++;
+    release(&log.lock);
+
+    // Nobody changes the blocks while we copy them
+    for (int i = 0; i < log.clh.n; i++) {
+      struct buf *b = bread(log.dev, log.clh.block[i]);
+      memmove(log.copy[i], b->data, BSIZE);
+      brelse(b);
+    }
+
+    acquire(&log.lock);
+    log.sealing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit();
+
+    acquire(&log.lock);
+    log.committed = seq;
+    wakeup(&log.committed);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log writer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -211,7 +366,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size - 1)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -222,9 +377,10 @@ log_write(struct buf *b)
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    if (log.lh.n == 0)
+      log.opened = ticks;
     bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
-
@@ -13,6 +13,7 @@ main()
     pr_info("xv6 kernel is booting\n");
     pr_info("\n");
     kinit();         // physical page allocator
+    slabinit();      // small object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     schedulerinit(); // creates structures required for scheduler
@@ -24,6 +25,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    pagecacheinit(); // file page cache
     virtio_disk_init(); // emulated hard disk
     virtio_net_init();  // emulated net card
     futex_control_init(); // futex structures
@@ -41,6 +41,7 @@ extern "C" {
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -76,10 +77,18 @@ extern "C" {
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   trapframes of the threads started by clone()
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
 
+// Threads share the page table, each maps its trapframe
+// in its own slot beneath TRAPFRAME, slot 0 is TRAPFRAME.
+#define THREADFRAME(slot) (TRAPFRAME - (uint64)(slot)*PGSIZE)
+
+// mmap() places mappings beneath the trapframes.
+#define MMAP_MAX_ADDR THREADFRAME(NTHREAD - 1)
+
 
 
 #ifdef __cplusplus
@@ -1,7 +1,8 @@
 #include "kernel/defs.h"
 #include "kernel/memlayout.h"
 #include "kernel/printk.h"
-#include "kernel/buf.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
 // There are important things in riscv.h
 
 //#define DEBUG_ERRORS
@@ -16,7 +17,7 @@ struct {
 void init_mmap() {
     initlock(&shared_mappings_table.tableLock, "mmap");
     for (int i = 0; i < SHARED_MAPPING_ENTRIES_NUM; i++) {
-        shared_mappings_table.entries[i] = (MapSharedEntry){.physicalAddr=NULL, .refCount=0,.underlying_buf=NULL};
+        shared_mappings_table.entries[i] = (MapSharedEntry){.physicalAddr=NULL, .refCount=0};
     }
 }
 
@@ -37,7 +38,7 @@ uint64 hash_function(uint64 key) {
 void debug_shared_mappings_table() {
     pr_debug("Printing Map-Shared-Table\n");
     for (int i = 0; i < SHARED_MAPPING_ENTRIES_NUM; i++) {
-        pr_debug("%d: k:%d,  pA:%p, uB:%p, refs:%d\n", i, hash_function((uint64)shared_mappings_table.entries[i].physicalAddr),shared_mappings_table.entries[i].physicalAddr, shared_mappings_table.entries[i].underlying_buf, shared_mappings_table.entries[i].refCount);
+        pr_debug("%d: k:%d,  pA:%p, file:%d, refs:%d\n", i, hash_function((uint64)shared_mappings_table.entries[i].physicalAddr),shared_mappings_table.entries[i].physicalAddr, shared_mappings_table.entries[i].fileBacked, shared_mappings_table.entries[i].refCount);
     }
 }
 
@@ -62,9 +63,11 @@ int64 table_lookup(uint64 key, void* targetKey) {
 
 /**
  * Inserts an entry into the hash table
+ * ip is the file whose page cache page at offset is physicalAddr, NULL if anonymous
+ * *inserted is set to 1 if the entry is new, inserted may be NULL
  * return -1 on error, index on success
 */
-int64 acquire_or_insert_table(struct buf* underlying_buf,  void* physicalAddr) {
+int64 acquire_or_insert_table(struct inode* ip, uint64 offset, void* physicalAddr, int* inserted) {
     acquire(&shared_mappings_table.tableLock);
     int64 pos = table_lookup((uint64)physicalAddr, physicalAddr);
 
@@ -78,9 +81,16 @@ int64 acquire_or_insert_table(struct buf* underlying_buf,  void* physicalAddr) {
     }
 
     MapSharedEntry* myEntry = shared_mappings_table.entries + pos;
+    if (inserted != NULL)
+        *inserted = myEntry->refCount == 0;
     if (myEntry->refCount == 0) {
         myEntry->physicalAddr = physicalAddr;
-        myEntry->underlying_buf = underlying_buf;
+        myEntry->fileBacked = ip != NULL;
+        if (ip != NULL) {
+            myEntry->dev = ip->dev;
+            myEntry->inum = ip->inum;
+            myEntry->offset = offset;
+        }
     }
     myEntry->refCount++;
 
@@ -88,8 +98,26 @@ int64 acquire_or_insert_table(struct buf* underlying_buf,  void* physicalAddr) {
     return pos;
 }
 
+/**
+ * Writes the page of a file backed shared mapping back to its file.
+ * The page is the file's page cache page, writei() only copies it to the disk blocks.
+*/
+static void mmap_write_back(MapSharedEntry* entry) {
+    struct inode* ip = iget(entry->dev, entry->inum);
+    begin_op();
+    ilock(ip);
+    // The file might have been truncated in the meantime
+    if (ip->size > entry->offset) {
+        uint n = ip->size - entry->offset;
+        writei(ip, 0, (uint64)entry->physicalAddr, entry->offset, n < PGSIZE ? n : PGSIZE);
+    }
+    iunlockput(ip);
+    end_op();
+}
+
 /**
  * Returns 0 if memory should not be freed
+ * The table holds one reference to every page, the caller drops it when 1 is returned
 */
 int64 munmap_shared(uint64 physicalAddr, uint32 doWriteBack) {
     acquire(&shared_mappings_table.tableLock);
@@ -114,7 +142,6 @@ int64 munmap_shared(uint64 physicalAddr, uint32 doWriteBack) {
         __futex_deinit(currentEntry->physicalAddr);
         // Set physical address to NULL
         currentEntry->physicalAddr = NULL;
-        struct buf* entryBuf = currentEntry->underlying_buf;
         // Loop through all successive entries until there's an empty one, and move the entries to their new position
         // There is always an empty entry, so (theoretically) no infinite loop here
         // uint64 so distance is not negative => wraparound case works. Might still be bugged in unknown ways
@@ -129,7 +156,7 @@ int64 munmap_shared(uint64 physicalAddr, uint32 doWriteBack) {
             if (distance >= holeDistance) {
                 shared_mappings_table.entries[holeIndex] = shared_mappings_table.entries[curIndex];
                 // Actually NULL our entry so our break condition works
-                shared_mappings_table.entries[curIndex] = (MapSharedEntry){.physicalAddr=NULL,.refCount=0,.underlying_buf=NULL};
+                shared_mappings_table.entries[curIndex] = (MapSharedEntry){.physicalAddr=NULL,.refCount=0};
                 holeIndex = curIndex;
                 holeDistance = 1;
             } else {
@@ -139,18 +166,19 @@ int64 munmap_shared(uint64 physicalAddr, uint32 doWriteBack) {
             curIndex = (curIndex + 1) % SHARED_MAPPING_ENTRIES_NUM;
         }
 
-        shared_mappings_table.entries[holeIndex] = (MapSharedEntry){.physicalAddr=NULL, .refCount=0, .underlying_buf=NULL};
+        shared_mappings_table.entries[holeIndex] = (MapSharedEntry){.physicalAddr=NULL, .refCount=0};
 
         release(&shared_mappings_table.tableLock);
-        if (entryBuf != NULL) {
+        if (copy.fileBacked) {
             // doWriteBack is true if called from munmap and false if called from zombie cleanup (wait)
             if (doWriteBack) {
-                bwrite(entryBuf);
+                mmap_write_back(&copy);
+            } else {
+                // Don't let unwritten changes stay visible through read()
+                pagecache_forget(copy.dev, copy.inum, copy.offset);
             }
-            brelse(entryBuf);
         }
-        // Never free a buffer! 
-        return copy.underlying_buf == NULL;
+        return 1;
     }
     release(&shared_mappings_table.tableLock);
     return 0;
@@ -189,6 +217,15 @@ uint64 mmap_find_free_area(pagetable_t table, uint64 required_pages, uint64 base
                     returnAddr =  CONSTRUCT_VIRT_FROM_PT_INDICES(u,m,0);
                 continue;
             }
+            // Megapages can't be partially replaced, treat them as 512 kernel pages
+            if (PTE_LEAF(mid)) {
+                if (fixed) {
+                    return EEXIST;
+                }
+                contig_pages = 0;
+                returnAddr = 0;
+                continue;
+            }
 
             for (uint64 l = (u == upBase && m == midBase) ? lowBase : 0; l < 512 && contig_pages < required_pages; l++) {
                 pte_t low = ((pagetable_t)PTE2PA(mid))[l];
@@ -213,7 +250,52 @@ uint64 mmap_find_free_area(pagetable_t table, uint64 required_pages, uint64 base
         }
     }
 
-    if (contig_pages >= required_pages) {
+    // The trapframe slots of threads lie above MMAP_MAX_ADDR
+    if (contig_pages >= required_pages && returnAddr + required_pages * PGSIZE <= MMAP_MAX_ADDR) {
+        return returnAddr;
+    }
+
+    return ENOMEM;
+}
+
+/**
+ * Like mmap_find_free_area, but looks for required_megapages free level-1 entries.
+ * An entry is free if it neither is a megapage nor points to a level-0 table.
+ * baseAddr must be megapage aligned.
+*/
+uint64 mmap_find_free_huge(pagetable_t table, uint64 required_megapages, uint64 baseAddr, int fixed) {
+
+    uint64 contig = 0;
+    uint64 upBase = PX(2, baseAddr);
+    uint64 midBase = PX(1, baseAddr);
+    uint64 returnAddr = baseAddr;
+
+    for (uint64 u = upBase; u < 256 && contig < required_megapages; u++) {
+        pte_t upper = table[u];
+        if (!(upper & PTE_V)) {
+            contig += 512;
+            if (returnAddr == 0)
+                returnAddr = CONSTRUCT_VIRT_FROM_PT_INDICES(u, 0, 0);
+            continue;
+        }
+
+        for (uint64 m = (u == upBase) ? midBase : 0; m < 512 && contig < required_megapages; m++) {
+            pte_t mid = ((pagetable_t)PTE2PA(upper))[m];
+            if (mid != 0) {
+                if (fixed) {
+                    return EEXIST;
+                }
+                contig = 0;
+                returnAddr = 0;
+                continue;
+            }
+            contig++;
+            if (returnAddr == 0)
+                returnAddr = CONSTRUCT_VIRT_FROM_PT_INDICES(u, m, 0);
+        }
+    }
+
+    if (contig >= required_megapages && returnAddr + required_megapages * MEGAPGSIZE <= MMAP_MAX_ADDR) {
         return returnAddr;
     }
 
@@ -225,107 +307,256 @@ uint64 mmap_find_free_area(pagetable_t table, uint64 required_pages, uint64 base
 */
 uint64 is_valid_addr(uint64 addr) {
     #ifdef DEBUG_PRECON
-    pr_debug("%d && (%d || (%d && %d)\n", (addr % PGSIZE == 0), (void*)addr == NULL, (addr >= (uint64)MMAP_MIN_ADDR), (addr < MAXVA));
+    pr_debug("%d && (%d || (%d && %d)\n", (addr % PGSIZE == 0), (void*)addr == NULL, (addr >= (uint64)MMAP_MIN_ADDR), (addr < MMAP_MAX_ADDR));
     #endif
-    return (addr % PGSIZE == 0) && ((void*)addr == NULL || ((addr >= (uint64)MMAP_MIN_ADDR) && (addr < MAXVA)));
+    return (addr % PGSIZE == 0) && ((void*)addr == NULL || ((addr >= (uint64)MMAP_MIN_ADDR) && (addr < MMAP_MAX_ADDR)));
 }
 
-struct buf* get_nth_buffer_from_file(uint64 n, struct file* f) {
+/**
+ * Returns a referenced page cache page with the n-th page of f, NULL on failure
+*/
+void* get_nth_page_from_file(uint64 n, struct file* f) {
     ilock(f->ip);
-    uint addr = bmap(f->ip, n);
-    if(addr == 0)
-      panic("mmap should not allocate new disk blocks (and should not fail)");
-    struct buf* bp = bread(f->ip->dev, addr);
+    void* page = pagecache_get(f->ip, n * PGSIZE);
     iunlock(f->ip);
-    return bp;
+    return page;
 }
 
 // Returns 0 on success, != 0 on fail
 int populate_mmap_page(uint64 addr) {
-    if (addr % 4096 != 0 || addr < (uint64)MMAP_MIN_ADDR || addr >= MAXVA)
+    if (addr % 4096 != 0 || addr < (uint64)MMAP_MIN_ADDR || addr >= MMAP_MAX_ADDR)
         return 2;
 
+    // Threads of the group fault on the same page table
+    struct proc* proc = myproc();
+    int locked = group_lockvm(proc->group);
+    int ret = 1;
+
     // Validates mapping
-    pte_t* entry = walk(myproc()->pagetable, addr, 1);
+    pte_t* entry = walk(proc->pagetable, addr, 1);
+    // No memory for a table or addr lies in a megapage, which is never demand paged
     // If entry is MM and not already valid
-    if (*entry & PTE_MM && !(*entry & PTE_V)) {
-        // Bits other than permission should be 0, are now address
-        *entry |= PA2PTE(kalloc_zero());
-        // Mark entry as valid
-        *entry |= PTE_V;
-        return 0;
-    } else {
-        return 1;
+    if (entry != 0 && *entry & PTE_MM && !(*entry & PTE_V)) {
+        void* page = kalloc_zero();
+        if (page != NULL) {
+            // Bits other than permission should be 0, are now address
+            *entry |= PA2PTE(page);
+            // Mark entry as valid
+            *entry |= PTE_V;
+            ret = 0;
+        }
     }
+    group_unlockvm(proc->group, locked);
+    return ret;
 
 }
 
 /**
- * Internal version of mmap, called by system call
+ * Serializes mmap and munmap of the threads of group leader g, which
+ * may sleep reading and writing back file pages between the page table
+ * changes they make under group_lockvm(). Returns whether it was locked.
 */
-uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file *f, uint64 offset) 
-{
-    // Check preconditions:
-    if ( !is_valid_addr((uint64)addr)
-        || length == 0 || !(length % PGSIZE == 0)
-        || !(offset % PGSIZE == 0)
-        || !((flags & MAP_PRIVATE) | (flags & MAP_SHARED) )) {
-        #ifdef DEBUG_ERRORS
-        pr_debug("INTERN-MMAP-EINVAL");
-        #endif
-        return EINVAL;
+static int mmap_lock(struct proc* g) {
+    if (g->threads == 0)
+        return 0;
+    acquire(&g->grouplock);
+    while (g->mmapping)
+        sleep(&g->mmapping, &g->grouplock);
+    g->mmapping = 1;
+    release(&g->grouplock);
+    return 1;
+}
+
+static void mmap_unlock(struct proc* g, int locked) {
+    if (!locked)
+        return;
+    acquire(&g->grouplock);
+    g->mmapping = 0;
+    wakeup(&g->mmapping);
+    release(&g->grouplock);
+}
+
+// Mapping removed from the page table, its memory isn't freed yet
+typedef struct {
+    pte_t entry;
+    int huge;
+} Unmapped;
+
+/**
+ * Frees the memory of n removed mappings and the chain of unlinked page
+ * table pages, once the harts running threads of g can't use them anymore.
+*/
+static void mmap_free_unmapped(struct proc* g, Unmapped* unmapped, int n, void* tables, uint32 doWriteBack) {
+    group_shootdown(g);
+    for (int i = 0; i < n; i++) {
+        uint64 pa = PTE2PA(unmapped[i].entry);
+        if (unmapped[i].huge) {
+            kfree_pages((void*) pa, MEGAPAGE_ORDER);
+        } else if (!(unmapped[i].entry & PTE_SH) || munmap_shared(pa, doWriteBack)) {
+            kfree((void*) pa);
+        }
     }
+    while (tables != NULL) {
+        void* next = *(void**) tables;
+        kfree(tables);
+        tables = next;
+    }
+}
 
-    // Check if file perm are valid
-    if (!(flags & MAP_ANONYMOUS)) {
-        if (!(f->readable)) {
-            return EPERM;
-        } 
-        if (!(f->writable) && prot & PROT_WRITE) {
-            return EACCESS;
+/**
+ * Removes the mappings of the npages pages at addr. A megapage must lie
+ * inside the range as a whole, else EINVAL is returned and the mappings
+ * before it stay removed. munmap writes back shared file pages and frees
+ * the emptied page table pages, mmap replacing old mappings doesn't.
+*/
+static uint64 mmap_unmap_range(struct proc* g, uint64 addr, uint64 npages, int munmap) {
+    pagetable_t curTable = g->pagetable;
+    Unmapped unmapped[32];
+    int n = 0;
+    uint64 ret = 0;
+    void* tables = NULL;
+
+    int locked = group_lockvm(g);
+    // Every single page in this range will be unmapped
+    // munmap docs: It is not an error if the indicated range does not contain any mapped pages.
+    for (uint64 i = 0; i < npages; i++) {
+        uint64 curAddr = addr + (i * PGSIZE);
+
+        // Free a full batch, writing back may sleep
+        if (n == NELEM(unmapped)) {
+            group_unlockvm(g, locked);
+            mmap_free_unmapped(g, unmapped, n, NULL, munmap);
+            n = 0;
+            locked = group_lockvm(g);
         }
-        if (f->type != FD_INODE) {
-            return EACCESS;
+
+        // Megapages go as a whole or not at all
+        pte_t* hugeEntry = walkmega(curTable, curAddr, 0);
+        if (hugeEntry != 0 && (*hugeEntry & PTE_V) && PTE_LEAF(*hugeEntry) && (*hugeEntry & PTE_MM)) {
+            if (curAddr % MEGAPGSIZE != 0 || npages - i < MEGAPGSIZE / PGSIZE) {
+                ret = EINVAL;
+                break;
+            }
+            unmapped[n++] = (Unmapped){.entry=*hugeEntry, .huge=1};
+            *hugeEntry = 0;
+            i += MEGAPGSIZE / PGSIZE - 1;
+            continue;
         }
-        if (f->ip->valid == 0) {
-            return EBADF;
+
+        pte_t* tableEntry = walk(curTable, curAddr, 0);
+        // Entry does not exist or is already 0. Cool, continue;
+        if (tableEntry == 0 || *tableEntry == 0) {
+            continue;
         }
-        if (length + offset > f->ip->size) {
-            return EINVAL;
+        uint64 flags = PTE_FLAGS(*tableEntry);
+        // Entry is valid and mmaped
+        if(flags & PTE_MM && flags & PTE_U) {
+            if (flags & PTE_V) {
+                unmapped[n++] = (Unmapped){.entry=*tableEntry, .huge=0};
+            }
+            // Invalidate mapping, the memory is freed after the shootdown
+            *tableEntry = 0;
         }
     }
+    // Sometimes we need to free levels. Let's do so here and quite frequently at first (sloooow)
+    // Iterate over entire pagetable and check from bottom to top if entire thing empty
+    if (munmap)
+        tables = uvmfreelevels(curTable);
+    group_unlockvm(g, locked);
 
-    // Only used by user
-    // Holds flags for mapping
-    int entryProt = PTE_U | PTE_MM;
-    if (prot & PROT_READ)
-        entryProt |= PTE_R;
-    if (prot & PROT_WRITE)
-        // PROT_WRITE implies PROT_READ
-        entryProt |= PTE_W | PTE_R;
-    if (prot & PROT_EXEC)
-        entryProt |= PTE_X;
-    
-    // An unset MAP_ANON also implies MAP_POPULATE
-    if (!(flags & MAP_ANON)) {
-        flags |= MAP_POPULATE;
+    mmap_free_unmapped(g, unmapped, n, tables, munmap);
+    return ret;
+}
+
+/**
+ * MAP_HUGETLB part of mmap. Maps length bytes of zeroed megapages,
+ * backed by 2 MiB physically contiguous blocks from kalloc_pages.
+ * Only private anonymous mappings are supported, they are always populated
+ * and can only be unmapped as a whole megapage.
+*/
+static uint64 mmap_huge(void *addr, uint64 length, int entryProt, int flags)
+{
+    uint64 hugeShift = (flags >> HUGETLB_FLAG_ENCODE_SHIFT) & 0x3f;
+    if (!(flags & MAP_ANONYMOUS) || (flags & MAP_SHARED)
+        || (hugeShift != 0 && hugeShift != MEGAPGSHIFT)
+        || length % MEGAPGSIZE != 0 || (uint64)addr % MEGAPGSIZE != 0) {
+        return EINVAL;
     }
 
-    // MAP_SHARED sets PTE_SH page bit & IMPLIES MAP_POPULATE
-    if (flags & MAP_SHARED) {
-        flags |= MAP_POPULATE;
-        entryProt |= PTE_SH;
+    struct proc* g = myproc()->group;
+    int fixed = flags & MAP_FIXED || flags & MAP_FIXED_NOREPLACE;
+    uint64 required_megapages = length / MEGAPGSIZE;
+
+    if (addr < MMAP_MIN_ADDR) {
+        addr = (void*) MEGAPGROUNDUP((uint64) g->last_mmap);
+        if (addr < MMAP_MIN_ADDR)
+            addr = MMAP_MIN_ADDR;
     }
 
-    struct proc* proc = myproc();
+    int locked = group_lockvm(g);
+    uint64 base = mmap_find_free_huge(g->pagetable, required_megapages, (uint64) addr, fixed);
+    if (base == ENOMEM && !fixed) {
+        base = mmap_find_free_huge(g->pagetable, required_megapages, (uint64) MMAP_MIN_ADDR, 0);
+    }
+    group_unlockvm(g, locked);
+    if (base < (uint64)MMAP_MIN_ADDR) {
+        return base;
+    }
+
+    // Everything is allocated before the first megapage is mapped,
+    // undoing mappings would need a TLB shootdown.
+    // The pages are chained through their first word until then.
+    void* pages = NULL;
+    for (uint64 i = 0; i < required_megapages; i++) {
+        void* curAlloc = kalloc_pages(MEGAPAGE_ORDER);
+        if (curAlloc == NULL)
+            goto nomem;
+        memset(curAlloc, 0, MEGAPGSIZE);
+        *(void**) curAlloc = pages;
+        pages = curAlloc;
+    }
+
+    locked = group_lockvm(g);
+    for (uint64 i = 0; i < required_megapages; i++) {
+        if (walkmega(g->pagetable, base + i * MEGAPGSIZE, 1) == 0) {
+            group_unlockvm(g, locked);
+            goto nomem;
+        }
+    }
+    for (uint64 i = 0; i < required_megapages; i++) {
+        uint64 curVA = base + i * MEGAPGSIZE;
+        void* curAlloc = pages;
+        pages = *(void**) curAlloc;
+        *(void**) curAlloc = NULL;
+        *walkmega(g->pagetable, curVA, 0) = PA2PTE(curAlloc) | entryProt | PTE_V;
+        g->last_mmap = (void*) curVA;
+    }
+    group_unlockvm(g, locked);
+    return base;
+
+nomem:
+    while (pages != NULL) {
+        void* next = *(void**) pages;
+        kfree_pages(pages, MEGAPAGE_ORDER);
+        pages = next;
+    }
+    return ENOMEM;
+}
+
+/**
+ * Maps length bytes of 4 KiB pages, the part of mmap for all other mappings
+*/
+static uint64 mmap_pages(void *addr, uint64 length, int entryProt, int flags, struct file *f, uint64 offset)
+{
+    struct proc* g = myproc()->group;
 
     if (addr < MMAP_MIN_ADDR) {
-        addr = proc->last_mmap;
+        addr = g->last_mmap;
     }
 
     // Here begins actual mapping
 
-    pagetable_t curTable = proc->pagetable;
+    pagetable_t curTable = g->pagetable;
 
     #ifdef DEBUG_PT
     pr_debug("Start: ");
@@ -336,6 +567,7 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
     uint64 required_pages = length / PGSIZE;
 
     // We find contig pages of the required length
+    int locked = group_lockvm(g);
     uint64 base = mmap_find_free_area(curTable, required_pages, (uint64) addr, flags & MAP_FIXED || flags & MAP_FIXED_NOREPLACE, flags & MAP_FIXED_NOREPLACE);
 
     // Happens when various errors are returned
@@ -344,9 +576,15 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
         if (base == ENOMEM && !(flags & MAP_FIXED || flags & MAP_FIXED_NOREPLACE)) {
             base = mmap_find_free_area(curTable, required_pages, (uint64) MMAP_MIN_ADDR, 0, 0);
         }
-        if (base < (uint64)MMAP_MIN_ADDR) {
-            return base;
-        }
+    }
+    group_unlockvm(g, locked);
+    if (base < (uint64)MMAP_MIN_ADDR) {
+        return base;
+    }
+
+    // MAP_FIXED replaces the old mappings in the range
+    if (flags & MAP_FIXED) {
+        mmap_unmap_range(g, base, required_pages, 0);
     }
 
     // go through the pages and map them
@@ -354,12 +592,18 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
     for (int i = 0; i < required_pages; i++) {
         
         void* curAlloc;
-        struct buf* curBuf = NULL;
+        void* curPage = NULL;
 
         // We need to populate the page and it's not anonymous
         if (flags & MAP_POPULATE && !(flags & MAP_ANON)) {
             // Get file backed mapping
-            curBuf = get_nth_buffer_from_file(i + (offset / PGSIZE), f);
+            curPage = get_nth_page_from_file(i + (offset / PGSIZE), f);
+            if (curPage == NULL) {
+                #ifdef DEBUG_ERRORS
+                pr_debug("INTERN-MMAP-ENOMEM: Page cache read failed\n");
+                #endif
+                return ENOMEM;
+            }
             // private file backed mappings are simple copies that aren't reflected on the actual file
             if (flags & MAP_PRIVATE) {
                 curAlloc = kalloc();
@@ -369,14 +613,15 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
                     #ifdef DEBUG_ERRORS
                     pr_debug("INTERN-MMAP-ENOMEM: Kernel alloc failed\n");
                     #endif
+                    kfree(curPage);
                     return ENOMEM;
                 }
-                memmove(curAlloc, curBuf->data, PGSIZE);
-                // Private case, release buffer
-                brelse(curBuf);
+                memmove(curAlloc, curPage, PGSIZE);
+                // Private case, drop the page cache reference
+                kfree(curPage);
 
-            } else { // Shared case
-                curAlloc = curBuf->data;
+            } else { // Shared case, map the page cache page itself
+                curAlloc = curPage;
             }
         } else if (flags & MAP_POPULATE && flags & MAP_ANON){ // page is anon and populated
             curAlloc = kalloc_zero();
@@ -388,8 +633,8 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
 
         // Insert into shared map
         if (flags & MAP_SHARED) {    
-            // curBuf->data is never null
-            if(acquire_or_insert_table(curBuf, curAlloc) == -1) {
+            int inserted;
+            if(acquire_or_insert_table(curPage ? f->ip : NULL, offset + i * PGSIZE, curAlloc, &inserted) == -1) {
                 #ifdef DEBUG_ERRORS
                 pr_notice("Table insert failed for %p with key %d\n", curAlloc, hash_function((uint64) curAlloc));
                 #if defined(DEBUG_SHARED_TABLE) || defined(DEBUG_ERRORS)
@@ -398,41 +643,33 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
                 #endif
                 return ENOMEM;
             }
+            // Another process mapped this page already, the table holds a reference
+            if (!inserted && curPage != NULL)
+                kfree(curPage);
         }
         
         // VA of our current page
         uint64 curVA = base + (i * PGSIZE);
 
-
-        // Gets an old entry at this location and frees & invalidates it
+        // The range is free, nobody else maps into it until mmap_unlock()
+        locked = group_lockvm(g);
         pte_t* entry = walk(curTable, curVA, 1);
         if (entry == 0) {
+            group_unlockvm(g, locked);
             #ifdef DEBUG_ERRORS
             pr_debug("INTERN-MMAP-ENOMEM: Walk kalloc failed");
             #endif
             return ENOMEM;
         }
-        
-        if (*entry != 0) {
-            // Shared entry -> check and unmap
-            if (*entry & PTE_SH) {
-                int should_free = munmap_shared(PTE2PA(*entry), 0);
-                uvmunmap(curTable, curVA, 1, should_free);
-            } else if (*entry & PTE_V) { // Private valid entry
-                // Free private entry
-                kfree((void*) PTE2PA(*entry));
-            }
-            // Now that we've freed. Set entry to 0
-            *entry = 0;
-        }
 
         // entry is now a pte we want. Set its flags (and address if MAP_POPULATE is set)
-        *entry |= entryProt;
+        *entry = entryProt;
         if (flags & MAP_POPULATE) {
             if (curAlloc != NULL) {
                 *entry |= PTE_V;
                 *entry |= PA2PTE(curAlloc);
             } else {
+                group_unlockvm(g, locked);
                 // Failure. manpage explicitely states we should not fail in this case but that won't stop us cuz we can't read 
                 #ifdef DEBUG_ERRORS
                 pr_debug("INTERN-MMAP-ENOMEM: POPULATE kalloc failed");
@@ -440,7 +677,8 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
                 return ENOMEM;
             }
         }
-        proc->last_mmap = (void*) curVA;
+        g->last_mmap = (void*) curVA;
+        group_unlockvm(g, locked);
     }
 
     #ifdef DEBUG_PT
@@ -450,6 +688,75 @@ uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file
     return (uint64)base;
 }
 
+/**
+ * Internal version of mmap, called by system call
+*/
+uint64 __intern_mmap(void *addr, uint64 length, int prot, int flags, struct file *f, uint64 offset) 
+{
+    // Check preconditions:
+    if ( !is_valid_addr((uint64)addr)
+        || length == 0 || !(length % PGSIZE == 0)
+        || !(offset % PGSIZE == 0)
+        || !((flags & MAP_PRIVATE) | (flags & MAP_SHARED) )) {
+        #ifdef DEBUG_ERRORS
+        pr_debug("INTERN-MMAP-EINVAL");
+        #endif
+        return EINVAL;
+    }
+
+    // Check if file perm are valid
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (!(f->readable)) {
+            return EPERM;
+        } 
+        if (!(f->writable) && prot & PROT_WRITE) {
+            return EACCESS;
+        }
+        if (f->type != FD_INODE) {
+            return EACCESS;
+        }
+        if (f->ip->valid == 0) {
+            return EBADF;
+        }
+        if (length + offset > f->ip->size) {
+            return EINVAL;
+        }
+    }
+
+    // Only used by user
+    // Holds flags for mapping
+    int entryProt = PTE_U | PTE_MM;
+    if (prot & PROT_READ)
+        entryProt |= PTE_R;
+    if (prot & PROT_WRITE)
+        // PROT_WRITE implies PROT_READ
+        entryProt |= PTE_W | PTE_R;
+    if (prot & PROT_EXEC)
+        entryProt |= PTE_X;
+
+    // An unset MAP_ANON also implies MAP_POPULATE
+    if (!(flags & MAP_ANON)) {
+        flags |= MAP_POPULATE;
+    }
+
+    // MAP_SHARED sets PTE_SH page bit & IMPLIES MAP_POPULATE
+    if (flags & MAP_SHARED) {
+        flags |= MAP_POPULATE;
+        entryProt |= PTE_SH;
+    }
+
+    struct proc* g = myproc()->group;
+    int locked = mmap_lock(g);
+    uint64 ret;
+    if (flags & MAP_HUGETLB) {
+        ret = mmap_huge(addr, length, entryProt, flags);
+    } else {
+        ret = mmap_pages(addr, length, entryProt, flags, f, offset);
+    }
+    mmap_unlock(g, locked);
+    return ret;
+}
+
 uint64 __intern_munmap(void* addr, uint64 length) {
     if ((uint64)addr % PGSIZE != 0) {
         return EINVAL;
@@ -459,42 +766,14 @@ uint64 __intern_munmap(void* addr, uint64 length) {
         return 0;
     }
 
-    // >= or >? Who knows, won't be relevant as highest pages are reserved by kernel
-    if (((uint64)addr + length) >= MAXVA) {
+    // The trapframes above MMAP_MAX_ADDR are reserved by the kernel
+    if (((uint64)addr + length) > MMAP_MAX_ADDR) {
         return EINVAL;
     }
 
-    pagetable_t curTable = myproc()->pagetable;
-
-    // Every single page in this range will be unmapped
-    // munmap docs: It is not an error if the indicated range does not contain any mapped pages.
-    for (int i = 0; i < PGROUNDUP(length) / PGSIZE; i++) {
-        uint64 curAddr = (uint64)addr + (i * PGSIZE);
-        pte_t* tableEntry = walk(curTable, curAddr, 0);
-        uint64 flags = PTE_FLAGS(*tableEntry);
-        // Entry does not exist or is already 0. Cool, continue;
-        if (tableEntry == 0 || *tableEntry == 0) {
-            continue;
-        }
-        // Entry is valid and mmaped
-        if(flags & PTE_MM && flags & PTE_U) {
-            if (flags & PTE_V) {
-                if (flags & PTE_SH) {
-                    int should_free = munmap_shared(PTE2PA(*tableEntry), 1);
-                    uvmunmap(curTable, curAddr, 1, should_free);
-                } else {
-                    // Invalidate mapping, and free memory
-                    uvmunmap(curTable, curAddr, 1, 1);
-                }
-            } else {
-                // Just set flags to 0 if it's not valid
-                *tableEntry = 0;
-            }
-        }
-    }
-    // Sometimes we need to free levels. Let's do so here and quite frequently at first (sloooow)
-    // Iterate over entire pagetable and check from bottom to top if entire thing empty
-    uvmfreelevels(curTable);
-
-    return 0;
-}
\ No newline at end of file
+    struct proc* g = myproc()->group;
+    int locked = mmap_lock(g);
+    uint64 ret = mmap_unmap_range(g, (uint64) addr, PGROUNDUP(length) / PGSIZE, 1);
+    mmap_unlock(g, locked);
+    return ret;
+}
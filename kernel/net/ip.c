@@ -29,7 +29,7 @@ void send_ipv4_packet(uint8 destination[IP_ADDR_SIZE], uint8 ip_protocol, void *
     return;
   }
 
-  void *buf = kalloc_zero();
+  void *buf = kmalloc_zero(sizeof(struct ipv4_header) + data_length);
   if (!buf) panic("send ip kalloc");
 
   struct ipv4_header *header = (struct ipv4_header *)buf;
@@ -93,7 +93,7 @@ void send_ipv4_packet(uint8 destination[IP_ADDR_SIZE], uint8 ip_protocol, void *
   get_mac_for_ip(mac_dest, header->dst);
   send_ethernet_packet(mac_dest, ETHERNET_TYPE_IPv4, header, (sizeof(struct ipv4_header)) + data_length);
   // Don't forget to free temp buffer at the end
-  kfree(buf);
+  kmfree(buf);
 }
 
 // From https://web.archive.org/web/20120430075019/http://web.eecs.utk.edu/~cs594np/unp/checksum.html
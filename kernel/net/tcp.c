@@ -146,7 +146,7 @@ uint8 accept_tcp_connection(struct tcp_header *tcp_packet, uint8 connection_inde
 */
 void send_tcp_ack(uint8 connection_id, uint32 sequence_num, uint32 len) {
   tcp_connection *connection = &tcp_connection_table[connection_id];
-  void *send_buf             = kalloc_zero();
+  void *send_buf             = kmalloc_zero(sizeof(struct tcp_header));
   struct tcp_header *header  = (struct tcp_header *)send_buf;
   header->src                = connection->in_port;
   header->dst                = connection->partner_port;
@@ -173,6 +173,7 @@ void send_tcp_ack(uint8 connection_id, uint32 sequence_num, uint32 len) {
   // Actually send this ack.
   // Don't expect a response.
   send_ipv4_packet(connection->partner_ip_addr, IP_PROT_TCP, header, sizeof(struct tcp_header));
+  kmfree(send_buf);
 }
 
 /**
@@ -183,7 +184,7 @@ void send_tcp_ack(uint8 connection_id, uint32 sequence_num, uint32 len) {
 int32 send_tcp_packet_wait_for_ack(
   uint8 connection_id, void *data, uint16 data_length, uint16 flags, void *connection_entry_buffer) {
   tcp_connection *connection = &tcp_connection_table[connection_id];
-  void *send_buf             = kalloc_zero();
+  void *send_buf             = kmalloc_zero(sizeof(struct tcp_header) + data_length);
   void *rec_buf              = connection_entry_buffer;
   struct tcp_header *header  = (struct tcp_header *)send_buf;
 
@@ -240,7 +241,7 @@ int32 send_tcp_packet_wait_for_ack(
   // Send packet
   send_ipv4_packet(connection->partner_ip_addr, IP_PROT_TCP, header, sizeof(struct tcp_header) + data_length);
   uint32 resp_len = wait_for_response(id, (connection_entry_buffer == NULL));
-  kfree(send_buf);
+  kmfree(send_buf);
 
   // We now have a response in rec_buf
   struct tcp_header *response = (struct tcp_header *)rec_buf;
@@ -358,7 +359,7 @@ int tcp_send_receive(int index, void *data, int data_len, void *rec_buf, int rec
 // Just for testing, need to adapt for general use (add connection idx as a parameter or something?)
 void send_tcp_packet(uint8 dest_address[IP_ADDR_SIZE], uint16 source_port, uint16 dest_port,
   void *data, uint16 data_length) {
-  void *buf               = kalloc_zero();
+  void *buf               = kmalloc_zero(sizeof(struct tcp_header) + data_length);
   struct tcp_header *head = (struct tcp_header *)buf;
   head->src               = source_port;
   memreverse(&head->src, sizeof(head->src));
@@ -378,6 +379,7 @@ void send_tcp_packet(uint8 dest_address[IP_ADDR_SIZE], uint16 source_port, uint1
   head->urgent_pointer = 0;
   memmove(head->options_data, data, data_length);
   send_ipv4_packet(dest_address, IP_PROT_TCP, head, sizeof(struct tcp_header) + data_length);
+  kmfree(buf);
 }
 
 
@@ -29,7 +29,7 @@ void send_udp_packet(uint8 dest_address[IP_ADDR_SIZE], uint16 source_port, uint1
     return;
   }
 
-  void *buf = kalloc_zero();
+  void *buf = kmalloc_zero(sizeof(struct udp_header) + data_length);
   if (!buf) panic("send udp kalloc");
 
   struct udp_header *header = (struct udp_header *)buf;
@@ -53,5 +53,5 @@ void send_udp_packet(uint8 dest_address[IP_ADDR_SIZE], uint16 source_port, uint1
     calculate_udp_checksum(my_ip, dest_address, data_length + sizeof(struct udp_header), (uint8 *)buf);
 
   send_ipv4_packet(dest_address, IP_PROT_UDP, header, data_length + sizeof(struct udp_header));
-  kfree(buf);
+  kmfree(buf);
 }
\ No newline at end of file
@@ -0,0 +1,273 @@
+// Page cache.
+//
+// Whole pages of file data, keyed by device, inode number and
+// page aligned file offset. readi() and writei() go through it,
+// exec and mmap map its pages into processes directly.
+//
+// Every cached page holds one kalloc() reference. pagecache_get()
+// hands out another one, which the caller drops with kfree() or
+// keeps for a mapping, so a page never goes away while it is used.
+//
+// Pages are filled and updated with the inode locked, pcache.lock
+// only protects the hash chains and the LRU list. Pages nobody else
+// references are evicted in LRU order once free memory runs low,
+// see pagecache_reclaim().
+
+#include "defs.h"
+#include "buf.h"
+
+struct cpage {
+  uint dev;
+  uint inum;
+  uint off;                 // page aligned file offset
+  char *data;
+  struct cpage *hnext;      // next page in the same hash bucket
+  struct cpage *lnext;      // LRU list, most recently used after pcache.lru
+  struct cpage *lprev;
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache;  // struct cpage descriptors
+  struct cpage *buckets[NPCACHEHASH];
+  struct cpage lru;         // list head, lru.lnext is the most recently used page
+  int npages;
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
+} pcache;
+
+void
+pagecacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  kmem_cache_init(&pcache.cache, "cpage", sizeof(struct cpage));
+  pcache.lru.lnext = &pcache.lru;
+  pcache.lru.lprev = &pcache.lru;
+}
+
+static struct cpage**
+pcache_bucket(uint dev, uint inum, uint off)
+{
+  uint64 key = ((uint64)dev << 32 | inum) ^ ((uint64)off << 20);
+  key *= 0x9e3779b97f4a7c15;
+  return &pcache.buckets[(key >> 32) % NPCACHEHASH];
+}
+
+// Caller must hold pcache.lock.
+static struct cpage*
+pcache_lookup(uint dev, uint inum, uint off)
+{
+  struct cpage *cp;
+
+  for(cp = *pcache_bucket(dev, inum, off); cp; cp = cp->hnext)
+    if(cp->dev == dev && cp->inum == inum && cp->off == off)
+      return cp;
+  return 0;
+}
+
+// Caller must hold pcache.lock.
+static void
+lru_unlink(struct cpage *cp)
+{
+  cp->lprev->lnext = cp->lnext;
+  cp->lnext->lprev = cp->lprev;
+}
+
+// Caller must hold pcache.lock.
+static void
+lru_push(struct cpage *cp)
+{
+  cp->lnext = pcache.lru.lnext;
+  cp->lprev = &pcache.lru;
+  pcache.lru.lnext->lprev = cp;
+  pcache.lru.lnext = cp;
+}
+
+// Take cp out of the hash and the LRU list.
+// Caller must hold pcache.lock, then free cp and drop
+// the cache's reference to cp->data after releasing it.
+static void
+pcache_remove(struct cpage *cp)
+{
+  struct cpage **pp;
+
+  for(pp = pcache_bucket(cp->dev, cp->inum, cp->off); *pp != cp; pp = &(*pp)->hnext)
+    ;
+  *pp = cp->hnext;
+  lru_unlink(cp);
+  pcache.npages--;
+}
+
+// Return a referenced page with the contents of ip at off,
+// which must be page aligned. Bytes past the end of the file are zero.
+// Caller must hold ip->lock and drop the reference with kfree().
+// Returns 0 if off lies past the end of the file, the disk
+// can't be read or memory ran out.
+void*
+pagecache_get(struct inode *ip, uint off)
+{
+  struct cpage *cp;
+  struct buf *bp;
+  char *data;
+  uint a, addr;
+
+  if(off % PGSIZE != 0)
+    panic("pagecache_get: unaligned");
+  if(off >= ip->size)
+    return 0;
+
+  acquire(&pcache.lock);
+  if((cp = pcache_lookup(ip->dev, ip->inum, off)) != 0){
+    pcache.hits++;
+    lru_unlink(cp);
+    lru_push(cp);
+    kpage_dup(cp->data);
+    release(&pcache.lock);
+    return cp->data;
+  }
+  pcache.misses++;
+  release(&pcache.lock);
+
+  // Keep some memory for allocations that can't reclaim
+  if(kalloc_nfree() < PCACHE_MINFREE)
+    pagecache_reclaim(PCACHE_BATCH);
+
+  if((cp = kmem_cache_alloc(&pcache.cache)) == 0)
+    return 0;
+  if((data = kalloc_zero()) == 0){
+    kmem_cache_free(&pcache.cache, cp);
+    return 0;
+  }
+
+  // Nobody can fill or change this page, we hold ip->lock
+  for(a = 0; a < PGSIZE && off + a < ip->size; a += BSIZE){
+    if((addr = bmap(ip, (off + a) / BSIZE)) == 0){
+      kfree(data);
+      kmem_cache_free(&pcache.cache, cp);
+      return 0;
+    }
+    bp = bread(ip->dev, addr);
+    memmove(data + a, bp->data, BSIZE);
+    brelse(bp);
+  }
+  if(ip->size - off < PGSIZE)
+    memset(data + (ip->size - off), 0, PGSIZE - (ip->size - off));
+
+  cp->dev = ip->dev;
+  cp->inum = ip->inum;
+  cp->off = off;
+  cp->data = data;
+
+  acquire(&pcache.lock);
+  struct cpage **bucket = pcache_bucket(cp->dev, cp->inum, cp->off);
+  cp->hnext = *bucket;
+  *bucket = cp;
+  lru_push(cp);
+  pcache.npages++;
+  kpage_dup(data);
+  release(&pcache.lock);
+  return data;
+}
+
+// Returns 1 if the page of inode inum on dev at off is cached.
+// The answer is only a hint, the page might be evicted right away.
+int
+pagecache_cached(uint dev, uint inum, uint off)
+{
+  acquire(&pcache.lock);
+  int cached = pcache_lookup(dev, inum, off) != 0;
+  release(&pcache.lock);
+  return cached;
+}
+
+// Copy n bytes from src into the cached page of ip at file offset off,
+// if the page is cached. The bytes must not cross a page boundary.
+// Called by writei() after the same bytes went to the disk blocks.
+// Caller must hold ip->lock.
+void
+pagecache_write(struct inode *ip, uint off, char *src, uint n)
+{
+  struct cpage *cp;
+  char *data = 0;
+
+  acquire(&pcache.lock);
+  if((cp = pcache_lookup(ip->dev, ip->inum, PGROUNDDOWN(off))) != 0){
+    data = cp->data;
+    kpage_dup(data);
+  }
+  release(&pcache.lock);
+
+  if(data){
+    memmove(data + off % PGSIZE, src, n);
+    kfree(data);
+  }
+}
+
+// Forget the cached page of inode inum on dev at off, so it is
+// read from the disk again next time. Mappings keep their page.
+void
+pagecache_forget(uint dev, uint inum, uint off)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  if((cp = pcache_lookup(dev, inum, off)) != 0)
+    pcache_remove(cp);
+  release(&pcache.lock);
+
+  if(cp){
+    kfree(cp->data);
+    kmem_cache_free(&pcache.cache, cp);
+  }
+}
+
+// Forget all cached pages of ip, because its contents are discarded.
+// Caller must hold ip->lock.
+void
+pagecache_truncate(struct inode *ip)
+{
+  for(uint off = 0; off < ip->size; off += PGSIZE)
+    pagecache_forget(ip->dev, ip->inum, off);
+}
+
+// Evict up to n of the least recently used pages that
+// nobody but the cache references.
+// Must not be called with a spinlock held.
+// Returns the number of pages freed.
+int
+pagecache_reclaim(int n)
+{
+  struct cpage *cp, *prev, *victims = 0;
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  for(cp = pcache.lru.lprev; cp != &pcache.lru && freed < n; cp = prev){
+    prev = cp->lprev;
+    // Mapped or being copied, it can't be read again until it is unused
+    if(kpage_refs(cp->data) > 1)
+      continue;
+    pcache_remove(cp);
+    cp->hnext = victims;
+    victims = cp;
+    freed++;
+  }
+  pcache.evictions += freed;
+  release(&pcache.lock);
+
+  while((cp = victims) != 0){
+    victims = cp->hnext;
+    kfree(cp->data);
+    kmem_cache_free(&pcache.cache, cp);
+  }
+  return freed;
+}
+
+// Print the page cache statistics.
+// No locks, like procdump.
+void
+pagecache_dump(void)
+{
+  pr_info("pagecache pages %d hits %d misses %d evictions %d\n", pcache.npages,
+    (int)pcache.hits, (int)pcache.misses, (int)pcache.evictions);
+}
@@ -10,9 +10,14 @@ extern "C" {
 #endif
 
 
-#define NPROC 64                      // maximum number of processes
+#define NPROC 2048                    // maximum number of processes, structures are allocated on demand
+#define NPIDHASH 64                   // hash buckets for pid lookups
+#define MAXORDER 10                   // largest kalloc_pages() block is 2^MAXORDER pages
+#define NSLEEPBUCKET 64               // hash buckets for sleeping processes
 #define NCPU 8                        // maximum number of CPUs
+#define NPRIO 3                       // scheduling priority levels, 0 is the highest
 #define NOFILE 16                     // open files per process
+#define NTHREAD 32                    // threads per process, including the first, at most 64
 #define NFILE 100                     // open files per system
 #define NINODE 50                     // maximum number of active i-nodes
 #define NDEV 10                       // maximum major device number
@@ -22,11 +27,22 @@ extern "C" {
   128 // Chosen to make MAXARG 32 when I_USS = 4k, combination of stack aligned max string size(x) + pointer size (16 stack aligned), since this is all that's on the stack at execution start. x <= 112 in case of MAXARG args
 #define MAXARG                                                                                     \
   INITIAL_USTACKSIZE / MAXARG_CONSTANT // Completely arbitrary maximum amount of args. Was 32 for 4k Stack -> MAX_ARG_CONSTANT chosen accordingly
-#define MAXOPBLOCKS 10                 // max # of blocks any FS op writes
-#define LOGSIZE (MAXOPBLOCKS * 3)      // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 12)        // size of disk block cache
+#define MAXOPBLOCKS 10                 // max # of blocks an FS op writes unless it reserves more
+#define LOGSIZE 128                    // default size of the on-disk log, set by mkfs -l
+#define LOG_COMMIT_TICKS 1             // ticks a transaction stays open before it is committed
+#define NBUF (LOGSIZE * 2 + MAXOPBLOCKS * 4) // disk block cache at boot, initlog() raises it for a larger log
+#define BCACHE_HIWAT 1024              // free pages above which the disk block cache grows
+#define BCACHE_LOWAT 256               // free pages below which the disk block cache shrinks
+#define RA_MINBLOCKS 4                 // readahead window after the first sequential read
+#define RA_MAXBLOCKS 32                // largest readahead window
+#define DISK_MAXSEG 8                  // most blocks transferred by one disk request
+#define NBUFHASH 61                    // hash buckets of the disk block cache
 #define FSSIZE 2000                    // size of file system in blocks
 #define MAXPATH 128                    // maximum file path name
+#define NEXECSEG 4                     // loadable segments per program that are paged in lazily
+#define NPCACHEHASH 256                // hash buckets of the page cache
+#define PCACHE_MINFREE 128             // free pages below which the page cache evicts before growing
+#define PCACHE_BATCH 32                // pages evicted at once
 
 
 
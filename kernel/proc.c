@@ -3,7 +3,38 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process structures are carved out of whole pages on demand.
+// Freed structures go back to the free list and are reused,
+// pool pages are never handed back to kalloc, so a struct proc
+// pointer always points to some (possibly recycled) process.
+// Every structure owns a kernel stack slot, mapped when the
+// structure is carved out.
+#define PROCS_PER_PAGE ((PGSIZE - sizeof(struct procpage*)) / sizeof(struct proc))
+
+struct procpage {
+  struct procpage *next;
+  struct proc procs[PROCS_PER_PAGE];
+};
+
+struct {
+  struct spinlock lock;
+  struct procpage *pages;   // all pages carved into procs
+  struct proc *free;        // unused procs, linked through p->pool_next
+  int growing;              // somebody runs procpool_grow(), the others wait
+  // only changed by procpool_grow()
+  int nslots;               // number of procs carved out so far
+  int nstacks;              // kernel stack slots mapped, nslots or a few more
+} procpool;
+
+// Processes hashed by pid, linked through p->pid_next.
+// Lookups never hold pidtable.lock and a p->lock at the same time,
+// a found proc must be locked and its pid re-checked.
+struct {
+  struct spinlock lock;
+  struct proc *buckets[NPIDHASH];
+} pidtable;
+
+extern pagetable_t kernel_pagetable;
 
 struct proc *initproc;
 
@@ -15,41 +46,201 @@ static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// Sleeping processes, hashed by the channel they sleep on.
+// Each bucket is a doubly linked list through p->sleep_next/sleep_prev,
+// so wakeup() only looks at processes that might sleep on chan.
+// A bucket lock must be acquired before any p->lock.
+struct sleepbucket {
+  struct spinlock lock;
+  struct proc *head;
+} sleeptable[NSLEEPBUCKET];
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
+// Allocate a page for the kernel stack of slot.
 // Map it high in memory, followed by an invalid
 // guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// Returns 0 on success, -1 if out of memory.
+static int
+proc_mapstack(int slot)
+{
+  char *pa = kalloc();
+  if(pa == 0)
+    return -1;
+  if(mappages(kernel_pagetable, KSTACK(slot), PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0){
+    kfree(pa);
+    return -1;
+  }
+  return 0;
+}
+
+// Carve a new page into unused procs and put them on the free list.
+// Only one caller at a time, see procpool_get(). The page and the
+// stacks are allocated without procpool.lock, so that kalloc() may
+// reclaim cached pages under memory pressure.
+// Returns 0 on success, -1 if the pool reached NPROC or memory ran out.
+static int
+procpool_grow(void)
+{
+  struct procpage *page;
+  struct proc *p, *first = 0, *last = 0;
+  int n;
+
+  if(procpool.nslots + PROCS_PER_PAGE > NPROC)
+    return -1;
+  if((page = (struct procpage*)kalloc_zero()) == 0)
+    return -1;
+
+  // Stacks mapped by an earlier try that ran out of memory are reused
+  for(n = 0; n < PROCS_PER_PAGE; n++){
+    if(procpool.nslots + n == procpool.nstacks){
+      if(proc_mapstack(procpool.nstacks) != 0)
+        break;
+      procpool.nstacks++;
+    }
+  }
+  // Keep the procs that got a stack, drop the rest of the page.
+  if(n == 0){
+    kfree(page);
+    return -1;
+  }
+  // Other harts may have looked at the unmapped stack addresses
+  tlb_shootdown(-1);
+
+  for(p = page->procs; p < &page->procs[n]; p++){
+    initlock(&p->lock, "proc");
+    initlock(&p->grouplock, "group");
+    p->state = UNUSED;
+    p->kstack = KSTACK(procpool.nslots + (p - page->procs));
+    p->pool_next = first;
+    first = p;
+    if(last == 0)
+      last = p;
+  }
+
+  acquire(&procpool.lock);
+  last->pool_next = procpool.free;
+  procpool.free = first;
+  procpool.nslots += n;
+  page->next = procpool.pages;
+  procpool.pages = page;
+  release(&procpool.lock);
+  return 0;
+}
+
+// Take an unused proc from the pool, growing it if necessary.
+// Returns 0 if there are NPROC procs or memory ran out.
+static struct proc*
+procpool_get(void)
 {
   struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  int err;
+
+  acquire(&procpool.lock);
+  while(procpool.free == 0){
+    if(procpool.growing){
+      sleep(&procpool, &procpool.lock);
+      continue;
+    }
+    procpool.growing = 1;
+    release(&procpool.lock);
+    err = procpool_grow();
+    acquire(&procpool.lock);
+    procpool.growing = 0;
+    release(&procpool.lock);
+    wakeup(&procpool);
+    if(err)
+      return 0;
+    acquire(&procpool.lock);
   }
+  p = procpool.free;
+  procpool.free = p->pool_next;
+  p->pool_next = 0;
+  release(&procpool.lock);
+  return p;
+}
+
+// Return an UNUSED proc to the pool.
+static void
+procpool_put(struct proc *p)
+{
+  acquire(&procpool.lock);
+  p->pool_next = procpool.free;
+  procpool.free = p;
+  release(&procpool.lock);
+}
+
+static void
+pidtable_insert(struct proc *p)
+{
+  struct proc **bucket = &pidtable.buckets[p->pid % NPIDHASH];
+
+  acquire(&pidtable.lock);
+  p->pid_next = *bucket;
+  *bucket = p;
+  release(&pidtable.lock);
+}
+
+static void
+pidtable_remove(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pidtable.lock);
+  for(pp = &pidtable.buckets[p->pid % NPIDHASH]; *pp != 0; pp = &(*pp)->pid_next){
+    if(*pp == p){
+      *pp = p->pid_next;
+      break;
+    }
+  }
+  p->pid_next = 0;
+  release(&pidtable.lock);
+}
+
+// Find the process with the given pid.
+// Returns with p->lock held, or 0 if there is no such process.
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+
+  acquire(&pidtable.lock);
+  for(p = pidtable.buckets[pid % NPIDHASH]; p != 0; p = p->pid_next){
+    if(p->pid == pid)
+      break;
+  }
+  release(&pidtable.lock);
+
+  if(p == 0)
+    return 0;
+
+  // p may have been freed and reused since we dropped pidtable.lock.
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
 }
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+  initlock(&procpool.lock, "procpool");
+  initlock(&pidtable.lock, "pidtable");
+  for(int i = 0; i < NSLEEPBUCKET; i++) {
+      initlock(&sleeptable[i].lock, "sleepbucket");
+      sleeptable[i].head = 0;
   }
 }
 
@@ -97,28 +288,30 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the pool.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
+// If group is 0 the proc leads a group of its own and gets an
+// empty user page table. Otherwise it becomes a thread of group,
+// the caller maps its trapframe into group's page table.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *group)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  if((p = procpool_get()) == 0)
+    return 0;
 
-found:
+  acquire(&p->lock);
   p->pid = allocpid();
   p->state = USED;
+  pidtable_insert(p);
+  p->cpu = -1;
+  p->priority = 0;
+  p->base_priority = 0;
+  p->ticks_used = 0;
+  p->group = group ? group : p;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -127,12 +320,18 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(group){
+    p->pagetable = group->pagetable;
+  } else {
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->tfva = TRAPFRAME;
+    p->tfslots = 1;
   }
 
   // Set up new context to start executing at forkret,
@@ -145,26 +344,58 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// including user pages. A thread only gives back its
+// trapframe, the group leader owns the page table.
+// p->lock must be held, and wait_lock if p is a thread.
 static void
 freeproc(struct proc *p)
 {
+  struct proc *g = p->group;
+
+  if(g != 0 && g != p){
+    if(p->tfva){
+      int locked = group_lockvm(g);
+      uvmunmap(p->pagetable, p->tfva, 1, 0);
+      group_unlockvm(g, locked);
+      g->tfslots &= ~(1L << (TRAPFRAME - p->tfva) / PGSIZE);
+    }
+    p->pagetable = 0;
+  }
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
   if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_freepagetable(p->pagetable, p->sz, p->exec_segs, p->exec_nsegs);
   p->pagetable = 0;
+  p->tfva = 0;
+  p->group = 0;
+  p->upcall = 0;
+  p->upcall_active = 0;
   p->sz = 0;
   p->last_mmap=0;
+  if(p->pid)
+    pidtable_remove(p);
   p->pid = 0;
   p->parent = 0;
+  p->children = 0;
+  p->sibling = 0;
+  p->threads = 0;
+  p->thread_next = 0;
+  p->joining = 0;
+  p->tfslots = 0;
   p->name[0] = 0;
   p->chan = 0;
+  p->sleep_next = 0;
+  p->sleep_prev = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->group_exiting = 0;
+  p->group_xstate = 0;
+  p->exec_nsegs = 0;
+  p->kthread = 0;
+  p->cpu = -1;
   p->state = UNUSED;
+  procpool_put(p);
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -185,7 +416,7 @@ proc_pagetable(struct proc *p)
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
               (uint64)trampoline, PTE_R | PTE_X) < 0){
-    uvmfree(pagetable, 0);
+    uvmfree(pagetable, 0, 0, 0);
     return 0;
   }
 
@@ -194,7 +425,7 @@ proc_pagetable(struct proc *p)
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmfree(pagetable, 0);
+    uvmfree(pagetable, 0, 0, 0);
     return 0;
   }
 
@@ -202,13 +433,14 @@ proc_pagetable(struct proc *p)
 }
 
 // Free a process's page table, and free the
-// physical memory it refers to.
+// physical memory it refers to. The nsegs program
+// segments at segs may be partly unloaded.
 void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+proc_freepagetable(pagetable_t pagetable, uint64 sz, struct execseg *segs, int nsegs)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
-  uvmfree(pagetable, sz);
+  uvmfree(pagetable, sz, segs, nsegs);
 }
 
 // a user program that calls exec("/init")
@@ -230,7 +462,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -251,23 +483,93 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn, which must never return.
+// Kernel threads never enter user space and are nobody's children.
+void
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc(0)) == 0)
+    panic("kthread_create");
+  p->kthread = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  schedule_proc(p);
+
+  release(&p->lock);
+}
+
+// Lock the page table shared by the threads of group leader g,
+// returns whether it was locked. Without threads nobody else
+// touches the page table, the lock is skipped so that allocations
+// may still reclaim cached pages, see kalloc_reclaim().
+// The caller must belong to g: if it sees no threads it is
+// alone and nobody can start one behind its back.
+int
+group_lockvm(struct proc *g)
+{
+  if(g->threads == 0)
+    return 0;
+  acquire(&g->grouplock);
+  return 1;
+}
+
+void
+group_unlockvm(struct proc *g, int locked)
+{
+  if(locked)
+    release(&g->grouplock);
+}
+
+// Flush the TLBs of the harts that run threads of group leader g,
+// after PTEs of its page table lost permissions, changed or went away.
+// A hart that starts running a thread later flushes when it returns
+// to user space. Call before the old pages are freed.
+void
+group_shootdown(struct proc *g)
+{
+  __sync_synchronize();
+  tlb_shootdown(__atomic_load_n(&g->vmharts, __ATOMIC_SEQ_CST));
+}
+
 // Grow or shrink user memory by n bytes.
+// Sets *oldsz to the size before.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, uint64 *oldsz)
 {
   uint64 sz;
   struct proc *p = myproc();
+  struct proc *g = p->group;
+  int locked = group_lockvm(g);
 
-  sz = p->sz;
+  sz = *oldsz = g->sz;
   if(n > 0){
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+      group_unlockvm(g, locked);
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    sz = uvmshrink(g, sz, sz + n);
   }
-  p->sz = sz;
+  g->sz = sz;
+  group_unlockvm(g, locked);
   return 0;
 }
 
@@ -276,23 +578,30 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int i, pid, locked;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *g = p->group;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  locked = group_lockvm(g);
+  if(uvmcopy(p->pagetable, np->pagetable, g->sz, g->exec_segs, g->exec_nsegs) < 0){
+    group_shootdown(g);
+    group_unlockvm(g, locked);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
-  np->last_mmap = p->last_mmap;
+  np->sz = g->sz;
+  np->last_mmap = g->last_mmap;
+  // Our other threads must not keep writing to the now shared pages
+  group_shootdown(g);
+  group_unlockvm(g, locked);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -301,19 +610,104 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  acquire(&g->grouplock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    if(g->ofile[i])
+      np->ofile[i] = filedup(g->ofile[i]);
+  np->cwd = idup(g->cwd);
+  release(&g->grouplock);
+
+  // The child loads the program pages the parent didn't touch yet
+  if(g->exec_ip)
+    np->exec_ip = idup(g->exec_ip);
+  memmove(np->exec_segs, g->exec_segs, sizeof(g->exec_segs));
+  np->exec_nsegs = g->exec_nsegs;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // Children start with a fresh slice on the parent's base level.
+  np->base_priority = p->base_priority;
+  np->priority = p->base_priority;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  schedule_proc(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a new process running the program at path,
+// without copying the caller's address space first.
+// If fdmap is 0 the child inherits all open files.
+// Otherwise child fd i refers to the caller's fd fdmap[i]
+// for i < nfd, -1 leaves it closed, and all other fds
+// of the child are closed.
+// Returns the child's pid, or -1 if it can't be started.
+int
+spawn(char *path, char **argv, int *fdmap, int nfd)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  if(fdmap){
+    if(nfd < 0 || nfd > NOFILE)
+      return -1;
+    for(i = 0; i < nfd; i++)
+      if(fdmap[i] != -1 && (fdmap[i] < 0 || fdmap[i] >= NOFILE || g->ofile[fdmap[i]] == 0))
+        return -1;
+  }
+
+  if((np = allocproc(0)) == 0)
+    return -1;
+
+  // The child isn't in any queue or child list yet, so nobody
+  // but us touches it while exec_load() sleeps on the disk.
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  release(&np->lock);
+
+  if((argc = exec_load(np, path, argv)) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  // Another thread might have closed a mapped fd in the meantime,
+  // the child gets it closed
+  acquire(&g->grouplock);
+  for(i = 0; i < NOFILE; i++){
+    if(fdmap == 0){
+      if(g->ofile[i])
+        np->ofile[i] = filedup(g->ofile[i]);
+    } else if(i < nfd && fdmap[i] != -1 && g->ofile[fdmap[i]]){
+      np->ofile[i] = filedup(g->ofile[fdmap[i]]);
+    }
+  }
+  np->cwd = idup(g->cwd);
+  release(&g->grouplock);
+
+  np->base_priority = p->base_priority;
+  np->priority = p->base_priority;
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
@@ -323,53 +717,283 @@ fork(void)
   return pid;
 }
 
+// Start a thread in the group of the calling process.
+// It shares the page table, open files and current directory,
+// and gets a trapframe and kernel stack of its own.
+// The thread starts at fn with sp = stack and a0 = arg.
+// Returns the thread's pid, or -1 if it can't be started.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int slot, pid, locked;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  // Slot 0 is the group leader's TRAPFRAME
+  acquire(&wait_lock);
+  for(slot = 1; slot < NTHREAD; slot++)
+    if((g->tfslots & (1L << slot)) == 0)
+      break;
+  if(slot == NTHREAD){
+    release(&wait_lock);
+    return -1;
+  }
+  g->tfslots |= 1L << slot;
+  release(&wait_lock);
+
+  if((np = allocproc(g)) == 0){
+    acquire(&wait_lock);
+    g->tfslots &= ~(1L << slot);
+    release(&wait_lock);
+    return -1;
+  }
+  // The thread isn't in any queue or group list yet,
+  // so nobody but us touches it.
+  release(&np->lock);
+
+  locked = group_lockvm(g);
+  if(mappages(p->pagetable, THREADFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    group_unlockvm(g, locked);
+    acquire(&wait_lock);
+    acquire(&np->lock);
+    g->tfslots &= ~(1L << slot);
+    freeproc(np);
+    release(&np->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  group_unlockvm(g, locked);
+  np->tfva = THREADFRAME(slot);
+
+  // Keep gp and tp, start with a fresh stack at fn.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack;
+  np->trapframe->a0 = arg;
+  np->trapframe->ra = 0;
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->base_priority = p->base_priority;
+  np->priority = p->base_priority;
+
+  pid = np->pid;
+
+  // An exiting group leader kills its threads before it
+  // frees them, a killed thread must not leave another behind.
+  acquire(&wait_lock);
+  if(killed(p)){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  np->thread_next = g->threads;
+  g->threads = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  schedule_proc(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Wait for the thread tid of the caller's group to exit,
+// copy its exit status to addr and free it.
+// Returns 0, EINVAL if tid is no other thread of the group,
+// ENOJOIN if another thread already waits for it,
+// ECIRC if it waits for the caller, or -1 if the caller was killed.
+int
+thread_join(int tid, uint64 addr)
+{
+  struct proc *t, *q, **link;
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int));
+  acquire(&wait_lock);
+
+  for(;;){
+    p->joining = 0;
+    for(link = &g->threads; (t = *link) != 0; link = &t->thread_next)
+      if(t->pid == tid)
+        break;
+    if(t == 0 || t == p){
+      release(&wait_lock);
+      return EINVAL;
+    }
+    // Waiting for a thread that waits for us would never end
+    for(q = t; q != 0; q = q->joining){
+      if(q == p){
+        release(&wait_lock);
+        return ECIRC;
+      }
+    }
+    // Only one thread gets the exit status
+    for(q = g; q != 0; q = q == g ? g->threads : q->thread_next){
+      if(q->joining == t){
+        release(&wait_lock);
+        return ENOJOIN;
+      }
+    }
+
+    acquire(&t->lock);
+    if(t->state == ZOMBIE){
+      if(addr != 0 && copyout(p->pagetable, addr, (char *)&t->xstate,
+                              sizeof(t->xstate)) < 0){
+        release(&t->lock);
+        release(&wait_lock);
+        return -1;
+      }
+      *link = t->thread_next;
+      freeproc(t);
+      release(&t->lock);
+      release(&wait_lock);
+      return 0;
+    }
+    release(&t->lock);
+
+    if(killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+
+    // Exiting threads wake up their group
+    p->joining = t;
+    sleep(&g->threads, &wait_lock);
+  }
+}
+
+// Kill the threads of group leader p, wait until
+// all of them exited and free them.
+static void
+exit_threads(struct proc *p)
+{
+  struct proc *t;
+  int running;
+
+  acquire(&wait_lock);
+  for(;;){
+    running = 0;
+    for(t = p->threads; t != 0; t = t->thread_next){
+      acquire(&t->lock);
+      if(t->state != ZOMBIE){
+        running = 1;
+        t->killed = 1;
+        if(t->state == SLEEPING)
+          schedule_proc(t);
+      }
+      release(&t->lock);
+    }
+    if(!running)
+      break;
+    sleep(&p->threads, &wait_lock);
+  }
+
+  while((t = p->threads) != 0){
+    p->threads = t->thread_next;
+    acquire(&t->lock);
+    freeproc(t);
+    release(&t->lock);
+  }
+  release(&wait_lock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
+  struct proc *pp, *next;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+
+  for(pp = p->children; pp; pp = next){
+    next = pp->sibling;
+    pp->parent = initproc;
+    pp->sibling = initproc->children;
+    initproc->children = pp;
   }
+  p->children = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
+// exit() in a thread ends the whole group: it kills the group
+// leader, which exits with status once it notices.
 __attribute__((noreturn)) void
 exit(int status)
+{
+  struct proc *p = myproc();
+  struct proc *g = p->group;
+
+  // The first exit() of the group decides the status
+  acquire(&g->lock);
+  if(!g->group_exiting){
+    g->group_exiting = 1;
+    g->group_xstate = status;
+  }
+  status = g->group_xstate;
+  if(g != p){
+    g->killed = 1;
+    if(g->state == SLEEPING)
+      schedule_proc(g);
+  }
+  release(&g->lock);
+
+  thread_exit(status);
+}
+
+// Exit the calling thread only, it remains a zombie until it
+// is joined. The group leader ends all threads first.
+__attribute__((noreturn)) void
+thread_exit(int status)
 {
   struct proc *p = myproc();
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(p->group == p){
+    exit_threads(p);
+
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(p->ofile[fd]){
+        struct file *f = p->ofile[fd];
+        fileclose(f);
+        p->ofile[fd] = 0;
+      }
     }
-  }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+    begin_op();
+    iput(p->cwd);
+    if(p->exec_ip)
+      iput(p->exec_ip);
+    end_op();
+    p->cwd = 0;
+    p->exec_ip = 0;
+  }
 
   acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup(p->parent);
+  if(p->group == p){
+    // Parent might be sleeping in wait().
+    wakeup(p->parent);
+  } else {
+    // A joining thread or the exiting group leader might be sleeping.
+    wakeup(&p->group->threads);
+  }
   
   acquire(&p->lock);
 
@@ -388,37 +1012,38 @@ exit(int status)
 int
 wait(uint64 addr)
 {
-  struct proc *pp;
+  struct proc *pp, **link;
   int havekids, pid;
   struct proc *p = myproc();
 
+  if(addr != 0)
+    uvmprefault(addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the list of children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
+    for(link = &p->children; (pp = *link) != 0; link = &pp->sibling){
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      havekids = 1;
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
+                                sizeof(pp->xstate)) < 0) {
           release(&pp->lock);
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        *link = pp->sibling;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -492,30 +1117,74 @@ forkret(void)
   usertrapret();
 }
 
+// Bucket of the sleep table that holds sleepers on chan.
+static struct sleepbucket*
+sleepbucket(void *chan)
+{
+  uint64 key = (uint64)chan;
+  key ^= key >> 17;
+  key *= 0x9e3779b97f4a7c15;
+  return &sleeptable[(key >> 32) % NSLEEPBUCKET];
+}
+
+// Unlink p from bucket b.
+// Caller must hold b->lock and p->lock.
+static void
+sleepbucket_remove(struct sleepbucket *b, struct proc *p)
+{
+  if(p->sleep_prev)
+    p->sleep_prev->sleep_next = p->sleep_next;
+  else
+    b->head = p->sleep_next;
+  if(p->sleep_next)
+    p->sleep_next->sleep_prev = p->sleep_prev;
+  p->sleep_next = 0;
+  p->sleep_prev = 0;
+  p->chan = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
-  
+  struct sleepbucket *b = sleepbucket(chan);
+
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
+  // The bucket lock is taken before lk is
+  // released and wakeup() locks the bucket
+  // before p->lock, so once we are in the
+  // bucket we can't miss any wakeup and
+  // it's okay to release lk.
 
+  acquire(&b->lock);
   acquire(&p->lock);  //DOC: sleeplock1
+  p->chan = chan;
+  p->sleep_prev = 0;
+  p->sleep_next = b->head;
+  if(b->head)
+    b->head->sleep_prev = p;
+  b->head = p;
   release(lk);
+  release(&b->lock);
+
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
   // Tidy up.
-  p->chan = 0;
+  // wakeup() already unlinked us and cleared p->chan.
+  // If we were woken by something else (kill), unlink ourselves.
+  if(p->chan){
+    release(&p->lock);
+    acquire(&b->lock);
+    acquire(&p->lock);
+    sleepbucket_remove(b, p);
+    release(&b->lock);
+  }
 
   // Reacquire original lock.
   release(&p->lock);
@@ -524,20 +1193,27 @@ sleep(void *chan, struct spinlock *lk)
 
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
+// Only visits processes hashed to the same bucket as chan.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  struct sleepbucket *b = sleepbucket(chan);
+  struct proc *p, *next;
+
+  acquire(&b->lock);
+  for(p = b->head; p != 0; p = next) {
+    next = p->sleep_next;
+    if(p != myproc() && p->chan == chan){
+      // Waits until p has fully switched out in sleep().
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
+      if(p->state == SLEEPING) {
+        sleepbucket_remove(b, p);
         schedule_proc(p);
       }
       release(&p->lock);
     }
   }
+  release(&b->lock);
 }
 
 // Kill the process with the given pid.
@@ -548,20 +1224,39 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        schedule_proc(p);
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  if((p = findproc(pid)) == 0)
+    return -1;
+
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    schedule_proc(p);
   }
-  return -1;
+  release(&p->lock);
+  return 0;
+}
+
+// Set the base scheduling priority of the process with the given pid,
+// or of the calling process if pid is 0.
+// Takes effect the next time the process is queued.
+int
+setpriority(int pid, int priority)
+{
+  struct proc *p;
+
+  if(priority < 0 || priority >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+
+  if((p = findproc(pid)) == 0)
+    return -1;
+
+  p->base_priority = priority;
+  p->priority = priority;
+  p->ticks_used = 0;
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -627,18 +1322,26 @@ procdump(void)
   [RUNNING]   "run   ",
   [ZOMBIE]    "zombie"
   };
+  struct procpage *page;
   struct proc *p;
   char *state;
 
   pr_info("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    pr_info("%d %s %s", p->pid, state, p->name);
-    pr_info("\n");
+  for(page = procpool.pages; page; page = page->next){
+    for(p = page->procs; p < &page->procs[PROCS_PER_PAGE]; p++){
+      if(p->state == UNUSED)
+        continue;
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      pr_info("%d %s %s", p->pid, state, p->name);
+      pr_info("\n");
+    }
   }
+  scheduler_dump();
+  kalloc_dump();
+  kmem_cache_dump();
+  bcache_dump();
+  pagecache_dump();
 }
@@ -97,6 +97,21 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Links a process can be queued on at the same time, see process_queue.h
+#define QLINK_RUN  0                 // run queues of the scheduler
+#define QLINK_WAIT 1                 // futex wait queues
+#define NQLINK     2
+
+// A loadable segment of the program a process runs.
+// Its pages are read from the program file on first touch, see exec_fault().
+struct execseg {
+  uint64 vaddr;                // Page aligned start
+  uint64 memsz;                // Bytes in memory, everything after filesz is zero
+  uint off;                    // Offset of the segment in the program file
+  uint filesz;                 // Bytes backed by the file
+  int perm;                    // PTE permissions of the pages
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -104,27 +119,70 @@ struct proc {
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   void *chan;                  // If non-zero, sleeping on chan
+
+  // bucket lock of chan and p->lock must be held when changing these:
+  struct proc *sleep_next;     // Next process sleeping in the same bucket
+  struct proc *sleep_prev;     // Previous process sleeping in the same bucket
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
+  int group_exiting;           // Group leader: exit() was called, see exit()
+  int group_xstate;            // Group leader: status of the first exit()
   int pid;                     // Process ID
+  int cpu;                     // Cpu whose run queue holds this process, -1 if never scheduled
+  int priority;                // Current scheduling level, 0 is the highest
+  int base_priority;           // Level set by setpriority(), boosts return here
+  int ticks_used;              // Ticks used up on the current level
+
+  // the lock of the queue the process is on must be held when using this:
+  struct proc *queue_next[NQLINK]; // Next process in a ProcessQueue, one link per queue kind
 
-  // wait_lock must be held when using this:
+  // the lock of futex_bucket must be held when changing these:
+  struct futex_bucket *futex_bucket; // Bucket of the futex queue the process waits in, 0 if none
+  uint64 futex_key;            // Physical address of the futex word waited on
+
+  // procpool.lock / pidtable.lock must be held when using these:
+  struct proc *pool_next;      // Next unused process in the pool
+  struct proc *pid_next;       // Next process in the same pid bucket
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // First child process
+  struct proc *sibling;        // Next child of the parent
+  struct proc *threads;        // Group leader: first thread started by clone()
+  struct proc *thread_next;    // Next thread of the same group
+  struct proc *joining;        // Thread waited for in thread_join(), 0 if none
+  uint64 tfslots;              // Group leader: trapframe slots in use, see THREADFRAME()
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  void* last_mmap;
-  pagetable_t pagetable;       // User page table
+  struct proc *group;          // Group leader, whose memory, files and cwd are shared; p itself unless p is a thread
+  pagetable_t pagetable;       // User page table, the group leader's
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // User address trapframe is mapped at
+  uint64 upcall;               // User handler entered every upcall_ticks ticks, 0 if none
+  int upcall_ticks;
+  int upcall_left;             // Ticks in user mode until the next upcall
+  int upcall_active;           // In the handler, until upcall_return()
+  int ilocks;                  // Inode locks held, see exec_fault()
   struct context context;      // swtch() here to run process
+  void (*kthread)(void);       // Entry of a kernel thread, 0 for user processes
+  char name[16];               // Process name (debugging)
+
+  // shared by the threads of a group, only used in the group leader.
+  // grouplock must be held when changing ofile and cwd, and while
+  // the page table is changed, see group_lockvm().
+  struct spinlock grouplock;
+  uint64 sz;                   // Size of process memory (bytes)
+  uint64 vmharts;              // Harts running a thread of the group, see group_shootdown()
+  void* last_mmap;
+  int mmapping;                // A thread is in mmap() or munmap(), see mmap_lock()
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
-  char name[16];               // Process name (debugging)
+  struct inode *exec_ip;       // Program file, 0 if nothing is loaded lazily
+  struct execseg exec_segs[NEXECSEG]; // Segments of exec_ip not loaded yet
+  int exec_nsegs;
 };
 
-extern struct proc proc[NPROC];
-
 #ifdef __cplusplus
 }
 #endif
@@ -1,60 +1,78 @@
+#include "kernel/proc.h"
 #include "kernel/process_queue.h"
 
-ProcessQueueEntry*
-next_queue_entry(ProcessQueue* queue, ProcessQueueEntry* entry) 
-{
-    if (entry ==  &queue->entries_buffer[NPROC -1]) {
-        return &queue->entries_buffer[0];
-    }
-    return entry + 1;
-}
-
 void debug_queue(ProcessQueue* queue, char* startMess)
 {
     pr_debug("Queue Debug: %s\n", startMess);
-    ProcessQueueEntry* entry = queue->start;
-    ProcessQueueEntry* first = entry;
-    do
-    {
-        pr_debug("pid: %d, state:%d\n", entry->proc->pid, entry->proc->state);
-    } while ((entry = next_queue_entry(queue, entry)) != first);
+    for (struct proc* p = queue->head; p != NULL; p = p->queue_next[queue->link]) {
+        pr_debug("pid: %d, state:%d\n", p->pid, p->state);
+    }
     pr_debug("End\n");
 }
 
 void
 append_queue(ProcessQueue* queue, struct proc* proc)
-{  
-    ProcessQueueEntry* new_end = next_queue_entry(queue, queue->end);
-
-    // If end == start, the queue was full.
-    // Note that this should never happen because the queue has NPROC
-    // entries, but better safe than sorry.
-    if (queue->start == new_end) {
-        panic("Process queue full, WTF?");
+{
+    proc->queue_next[queue->link] = NULL;
+    if (queue->tail == NULL) {
+        queue->head = proc;
+    } else {
+        queue->tail->queue_next[queue->link] = proc;
     }
-    queue->end->proc = proc;
-    queue->end = new_end;
+    queue->tail = proc;
+    queue->length++;
 }
 
 struct proc*
 pop_queue(ProcessQueue* queue)
 {
-    if (queue->start == queue->end) {
+    if (queue->head == NULL) {
         // Queue is empty, can't pop element :/
         return NULL;
     }
 
-    struct proc* popped_proc = queue->start->proc;
-    queue->start->proc = NULL;
-    queue->start = next_queue_entry(queue, queue->start);
+    struct proc* popped_proc = queue->head;
+    queue->head = popped_proc->queue_next[queue->link];
+    if (queue->head == NULL)
+        queue->tail = NULL;
+    popped_proc->queue_next[queue->link] = NULL;
+    queue->length--;
     return popped_proc;
 }
 
+/**
+ * Unlinks proc from anywhere in queue. Linear in the queue length,
+ * only meant for procs leaving a queue early, e.g. killed futex waiters.
+ * Returns 1 if proc was queued, 0 otherwise.
+*/
+int
+remove_queue(ProcessQueue* queue, struct proc* proc)
+{
+    struct proc* prev = NULL;
+    for (struct proc* p = queue->head; p != NULL; prev = p, p = p->queue_next[queue->link]) {
+        if (p != proc)
+            continue;
+        if (prev == NULL) {
+            queue->head = p->queue_next[queue->link];
+        } else {
+            prev->queue_next[queue->link] = p->queue_next[queue->link];
+        }
+        if (queue->tail == p)
+            queue->tail = prev;
+        p->queue_next[queue->link] = NULL;
+        queue->length--;
+        return 1;
+    }
+    return 0;
+}
+
 void 
-init_queue(ProcessQueue* queue, char* lock_name)
+init_queue(ProcessQueue* queue, char* lock_name, int link)
 {
-    queue->start = &queue->entries_buffer[0];
-    queue->end = &queue->entries_buffer[0];
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->length = 0;
+    queue->link = link;
     queue->valid = 1;
     initlock(&queue->queue_lock, lock_name);
 }
@@ -11,27 +11,27 @@ extern "C" {
 
 #include "kernel/defs.h"
 
-typedef struct __queue_entry {
-  struct proc* proc;
-} ProcessQueueEntry;
-
 /**
- * Queue struct for scheduler queues
+ * Queue struct for scheduler and futex queues
+ * Intrusive singly linked list through proc->queue_next[link],
+ * so a queue costs a few words no matter how many procs exist.
+ * A proc may be on one queue per link at a time.
 */
 typedef struct __queue {
-  // Ringbuffer containing entries
-  ProcessQueueEntry entries_buffer[NPROC];    // Array containing procs, acts as ring buffer queue
-  ProcessQueueEntry* start;                   // Start of current queue
-  ProcessQueueEntry* end;                     // End of current queue
+  struct proc* head;                          // First proc, popped next
+  struct proc* tail;                          // Last proc, appended after
   struct spinlock queue_lock;                 // Lock for this queue
+  int length;                                 // Number of procs currently queued
+  int link;                                   // Index into proc->queue_next, one of QLINK_*
   int valid;                                  // 1 when initialized queue, else undefined
 } ProcessQueue;
 
 
 void debug_queue(ProcessQueue* queue, char* startMess);
-void init_queue(ProcessQueue* queue, char* lock_name);
+void init_queue(ProcessQueue* queue, char* lock_name, int link);
 void append_queue(ProcessQueue* queue, struct proc* proc);
 struct proc* pop_queue(ProcessQueue* queue);
+int remove_queue(ProcessQueue* queue, struct proc* proc);
 
 #ifdef __cplusplus
 }
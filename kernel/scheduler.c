@@ -1,27 +1,212 @@
 #include "kernel/proc.h"
 #include "kernel/scheduler.h"
 
+struct runqueue runqueues[NCPU];
+
 void
 schedulerinit()
 {
-    init_queue(&runnable_queue, "Runnable Queue");
-    init_queue(&wait_queue, "Wait Queue");
+    for (int i = 0; i < NCPU; i++) {
+        for (int level = 0; level < NPRIO; level++) {
+            init_queue(&runqueues[i].levels[level], "Runnable Queue", QLINK_RUN);
+        }
+        runqueues[i].online = 0;
+        runqueues[i].next_boost = MLFQ_BOOST_TICKS;
+        runqueues[i].dispatched = 0;
+        runqueues[i].steals = 0;
+        runqueues[i].stolen = 0;
+        runqueues[i].demotions = 0;
+        runqueues[i].boosts = 0;
+    }
 }
 
+/**
+ * Number of runnable procs on all levels of rq.
+ * Reads without locks, the result is only a hint.
+*/
+static int
+runqueue_length(struct runqueue* rq)
+{
+    int length = 0;
+    for (int level = 0; level < NPRIO; level++) {
+        length += rq->levels[level].length;
+    }
+    return length;
+}
+
+/**
+ * Pops the first proc of the highest non-empty level of rq.
+ * Returns NULL if all levels are empty.
+*/
+static struct proc*
+pop_runqueue(struct runqueue* rq)
+{
+    for (int level = 0; level < NPRIO; level++) {
+        ProcessQueue* queue = &rq->levels[level];
+        // Skip empty levels without touching their lock
+        if (queue->length == 0)
+            continue;
+        acquire(&queue->queue_lock);
+        struct proc* p = pop_queue(queue);
+        release(&queue->queue_lock);
+        if (p != NULL)
+            return p;
+    }
+    return NULL;
+}
+
+/**
+ * Returns the id of the online cpu with the shortest run queue.
+ * Lengths are read without locks, the result is only a placement hint.
+ * Falls back to the current cpu if no cpu has entered the scheduler yet.
+*/
+static int
+least_loaded_cpu()
+{
+    int best = -1;
+    int best_length = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (!runqueues[i].online)
+            continue;
+        int length = runqueue_length(&runqueues[i]);
+        if (best == -1 || length < best_length) {
+            best = i;
+            best_length = length;
+        }
+    }
+    return best == -1 ? cpuid() : best;
+}
 
 /**
  * Assumes held proc lock. Fails otherwise
+ * Appends proc to the queue for its priority on the cpu it last ran on.
+ * Procs that never ran are placed on the least loaded cpu.
 */
 void
 schedule_proc(struct proc* proc)
 {
     if (!holding(&proc->lock))
         panic("schedule-proc: lock not held");
-    
+
+    if (proc->cpu < 0)
+        proc->cpu = least_loaded_cpu();
+
     proc->state = RUNNABLE;
-    acquire(&runnable_queue.queue_lock);
-    append_queue(&runnable_queue,  proc);
-    release(&runnable_queue.queue_lock);
+    ProcessQueue* queue = &runqueues[proc->cpu].levels[proc->priority];
+    acquire(&queue->queue_lock);
+    append_queue(queue, proc);
+    release(&queue->queue_lock);
+}
+
+/**
+ * Called on every timer interrupt for the running process p.
+ * Charges the tick to p and demotes it once its slice on the current
+ * level is used up.
+ * Returns 1 if p should yield, either because its slice ran out
+ * or because a proc with higher priority is waiting on this cpu.
+*/
+int
+scheduler_tick(struct proc* p)
+{
+    int should_yield = 0;
+
+    acquire(&p->lock);
+    struct runqueue* rq = &runqueues[p->cpu];
+
+    if (++p->ticks_used >= MLFQ_SLICE(p->priority)) {
+        if (p->priority < NPRIO - 1) {
+            p->priority++;
+            rq->demotions++;
+        }
+        p->ticks_used = 0;
+        should_yield = 1;
+    }
+
+    for (int level = 0; level < p->priority && !should_yield; level++) {
+        if (rq->levels[level].length > 0)
+            should_yield = 1;
+    }
+    release(&p->lock);
+
+    return should_yield;
+}
+
+/**
+ * Moves all procs queued below their base priority back to it.
+ * Only queued procs are boosted, running and sleeping procs keep
+ * their level until they are boosted while waiting in a queue.
+*/
+static void
+boost_runqueue(struct runqueue* rq)
+{
+    for (int level = 1; level < NPRIO; level++) {
+        ProcessQueue* queue = &rq->levels[level];
+        // Procs re-appended to this level must not be visited twice
+        int count = queue->length;
+        for (int i = 0; i < count; i++) {
+            acquire(&queue->queue_lock);
+            struct proc* p = pop_queue(queue);
+            release(&queue->queue_lock);
+            if (p == NULL)
+                break;
+
+            // p is RUNNABLE but in no queue, nobody else touches it now
+            acquire(&p->lock);
+            if (p->priority != p->base_priority)
+                rq->boosts++;
+            p->priority = p->base_priority;
+            p->ticks_used = 0;
+            schedule_proc(p);
+            release(&p->lock);
+        }
+    }
+}
+
+/**
+ * Takes one process from the longest run queue of another cpu.
+ * Returns NULL if every other queue is empty.
+*/
+static struct proc*
+steal_proc(int self)
+{
+    struct runqueue* busiest = NULL;
+    int max_length = 0;
+
+    // Racy reads, a queue might have been emptied by the time we lock it
+    for (int i = 0; i < NCPU; i++) {
+        int length = runqueue_length(&runqueues[i]);
+        if (i != self && length > max_length) {
+            busiest = &runqueues[i];
+            max_length = length;
+        }
+    }
+
+    if (busiest == NULL)
+        return NULL;
+
+    struct proc* p = pop_runqueue(busiest);
+    if (p != NULL) {
+        busiest->stolen++;
+        runqueues[self].steals++;
+    }
+    return p;
+}
+
+/**
+ * Print run queue lengths and scheduling counters of every online cpu.
+ * No locks, like procdump.
+*/
+void
+scheduler_dump(void)
+{
+    pr_info("cpu queued dispatched steals stolen demotions boosts\n");
+    for (int i = 0; i < NCPU; i++) {
+        struct runqueue* rq = &runqueues[i];
+        if (!rq->online)
+            continue;
+        pr_info("%d %d %d %d %d %d %d\n", i, runqueue_length(rq), (int)rq->dispatched,
+            (int)rq->steals, (int)rq->stolen, (int)rq->demotions, (int)rq->boosts);
+    }
 }
 
 
@@ -35,11 +220,15 @@ schedule_proc(struct proc* proc)
 void
 scheduler(void)
 {
-  
+
   struct cpu *c = mycpu();
-  
+  // The scheduler thread never migrates, so the id stays valid
+  int id = cpuid();
+  struct runqueue* rq = &runqueues[id];
+
   // Sets current cpu process to None
   c->proc = 0;
+  rq->online = 1;
 
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
@@ -47,22 +236,34 @@ scheduler(void)
 
     struct proc *p = NULL;
 
-    // Get first entry of ready queue
-    acquire(&runnable_queue.queue_lock);
-    p = pop_queue(&runnable_queue);
-    release(&runnable_queue.queue_lock);
-    
-    // Queue is empty, wait for interrupt
+    // Racy read of ticks is fine, boosts don't need to be exact
+    if (ticks >= rq->next_boost) {
+        rq->next_boost = ticks + MLFQ_BOOST_TICKS;
+        boost_runqueue(rq);
+    }
+
+    // Get first entry of this cpu's highest non-empty level
+    p = pop_runqueue(rq);
+
+    // Own queue is empty, help out the busiest cpu
+    if (p == NULL)
+        p = steal_proc(id);
+
+    // All queues are empty, wait for interrupt
     if (p == NULL) {
         // Ensure that interrupts are actually on
         intr_on();
+        // Use the idle time to zero pages for kalloc_zero(),
+        // then look at the queues again before going to sleep
+        if (kalloc_prezero() > 0)
+            continue;
         wait_intr();
         // Restart loop on interrupt
         continue;
     }
-    
+
     acquire(&p->lock);
-    // If any process is not runnable, runnable_queue broke -> panic.
+    // If any process is not runnable, a run queue broke -> panic.
     if(p->state != RUNNABLE)
         panic("scheduler: Not runnable");
 
@@ -70,14 +271,20 @@ scheduler(void)
     // to release its lock and then reacquire it
     // before jumping back to us.
     p->state = RUNNING;
+    p->cpu = id;
     c->proc = p;
+    rq->dispatched++;
+    // Procs are never freed, g stays valid even if the group ends
+    struct proc* g = p->group;
+    __atomic_fetch_or(&g->vmharts, 1L << id, __ATOMIC_SEQ_CST);
 
     swtch(&c->context, &p->context);
     // Switch returns here after done with execution
     // Process is done running for now.
     // It should have changed its p->state before coming back.
+    __atomic_fetch_and(&g->vmharts, ~(1L << id), __ATOMIC_SEQ_CST);
     c->proc = 0;
     release(&p->lock);
 
   }
-}
\ No newline at end of file
+}
@@ -12,8 +12,34 @@ extern "C" {
 #include "kernel/defs.h"
 #include "kernel/process_queue.h"
 
-ProcessQueue runnable_queue;
-ProcessQueue wait_queue;
+// Ticks a process may run on a level before it is demoted.
+// Doubles with every level, so level 0 gets MLFQ_BASE_SLICE ticks.
+#define MLFQ_BASE_SLICE 1
+#define MLFQ_SLICE(level) (MLFQ_BASE_SLICE << (level))
+
+// Ticks between two priority boosts of queued processes.
+// Keeps cpu bound processes on low levels from starving.
+#define MLFQ_BOOST_TICKS 50
+
+/**
+ * Per-CPU run queue.
+ * Processes are appended to the queue of the cpu they last ran on,
+ * idle cpus steal from the busiest queue.
+ * Every priority level has its own queue, lower levels only run
+ * when all higher levels are empty.
+*/
+struct runqueue {
+  ProcessQueue levels[NPRIO]; // Runnable processes with affinity for this cpu, one queue per priority
+  int online;                 // 1 once the cpu entered scheduler()
+  uint next_boost;            // Tick at which queued processes are boosted next
+  uint64 dispatched;          // Number of procs this cpu switched to
+  uint64 steals;              // Number of procs this cpu took from other queues
+  uint64 stolen;              // Number of procs other cpus took from this queue
+  uint64 demotions;           // Number of procs that used up their slice on this cpu
+  uint64 boosts;              // Number of procs moved back up by a boost
+};
+
+extern struct runqueue runqueues[NCPU];
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,276 @@
+// Slab allocator for small kernel objects.
+//
+// Each cache hands out objects of one size. Objects are carved out of
+// pages from kalloc(), every page (slab) starts with a struct slab that
+// tracks its free objects. Harts keep a few free objects per cache, so
+// most allocations and frees don't take the cache lock.
+//
+// kmalloc() picks a cache by size class for buffers whose size is only
+// known at runtime, anything above KMALLOC_MAX gets a whole page.
+
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;          // on cache->partial
+  struct slab *prev;
+  void *free;                 // free objects, linked through their first word
+  int inuse;                  // objects handed out, including those cached by harts
+};
+
+// Objects start after the header, 8-byte aligned.
+// A slab object can therefore never be page aligned.
+#define SLAB_HDR ((sizeof(struct slab) + 7) & ~7)
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *list;
+} caches;
+
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASS];
+static char *kmalloc_names[KMALLOC_NCLASS] = {
+  "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+void
+slabinit(void)
+{
+  initlock(&caches.lock, "caches");
+  for(int i = 0; i < KMALLOC_NCLASS; i++)
+    kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], KMALLOC_MIN << i);
+}
+
+// Set up an empty cache for objects of size bytes.
+// name is used for the cache lock and the ^P statistics.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*))
+    size = sizeof(void*);
+  if(size > PGSIZE - SLAB_HDR)
+    panic("kmem_cache_init: object too large");
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLAB_HDR) / size;
+  initlock(&c->lock, name);
+  c->partial = 0;
+  c->nslabs = 0;
+  memset(c->cpu, 0, sizeof(c->cpu));
+
+  acquire(&caches.lock);
+  c->next = caches.list;
+  caches.list = c;
+  release(&caches.lock);
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(s->next)
+    s->next->prev = s;
+  c->partial = s;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+// Carve a new page into free objects of c.
+// Caller must hold c->lock. Returns 0 if out of memory.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    obj = (char*)s + SLAB_HDR + i * c->size;
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  slab_link(c, s);
+  c->nslabs++;
+  return s;
+}
+
+// Give obj back to its slab. An empty slab goes back to kalloc()
+// unless it is the only one with free objects.
+// Caller must hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+
+  if(s->free == 0)
+    slab_link(c, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+
+  if(s->inuse == 0 && (s->prev || s->next)){
+    slab_unlink(c, s);
+    c->nslabs--;
+    kfree(s);
+  }
+}
+
+// Move up to SLAB_CPU_BATCH objects from the slabs to cc.
+// Must be called with interrupts off.
+static void
+slab_refill(struct kmem_cache *c, struct kmem_cache_cpu *cc)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&c->lock);
+  for(int n = 0; n < SLAB_CPU_BATCH; n++){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    if(s->free == 0)
+      slab_unlink(c, s);
+    *(void**)obj = cc->objs;
+    cc->objs = obj;
+    cc->count++;
+  }
+  release(&c->lock);
+}
+
+// Move SLAB_CPU_BATCH objects from cc back to their slabs.
+// Must be called with interrupts off.
+static void
+slab_drain(struct kmem_cache *c, struct kmem_cache_cpu *cc)
+{
+  void *obj;
+
+  acquire(&c->lock);
+  for(int n = 0; n < SLAB_CPU_BATCH; n++){
+    obj = cc->objs;
+    cc->objs = *(void**)obj;
+    cc->count--;
+    slab_put(c, obj);
+  }
+  release(&c->lock);
+}
+
+// Allocate one object of c. The contents are undefined.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmem_cache_cpu *cc;
+  void *obj;
+
+  push_off();
+  cc = &c->cpu[cpuid()];
+  if(cc->count == 0)
+    slab_refill(c, cc);
+  else
+    cc->hits++;
+  obj = cc->objs;
+  if(obj){
+    cc->objs = *(void**)obj;
+    cc->count--;
+    cc->allocs++;
+  }
+  pop_off();
+  return obj;
+}
+
+// Free an object allocated from c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct kmem_cache_cpu *cc;
+
+  push_off();
+  cc = &c->cpu[cpuid()];
+  if(cc->count >= SLAB_CPU_MAX)
+    slab_drain(c, cc);
+  *(void**)obj = cc->objs;
+  cc->objs = obj;
+  cc->count++;
+  cc->frees++;
+  pop_off();
+}
+
+// Allocate size bytes from the smallest fitting size class,
+// or a whole page if size exceeds KMALLOC_MAX.
+// Returns 0 if out of memory.
+void*
+kmalloc(uint size)
+{
+  if(size > KMALLOC_MAX)
+    return size <= PGSIZE ? kalloc() : 0;
+  for(int i = 0; i < KMALLOC_NCLASS; i++){
+    if(size <= (KMALLOC_MIN << i))
+      return kmem_cache_alloc(&kmalloc_caches[i]);
+  }
+  return 0;
+}
+
+// Like kmalloc(), but zeroes the first size bytes.
+void*
+kmalloc_zero(uint size)
+{
+  void *p;
+
+  if((p = kmalloc(size)) != 0)
+    memset(p, 0, size);
+  return p;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  // Whole pages are page aligned, slab objects never are.
+  if((uint64)p % PGSIZE == 0){
+    kfree(p);
+    return;
+  }
+  kmem_cache_free(((struct slab*)PGROUNDDOWN((uint64)p))->cache, p);
+}
+
+// Print usage of every cache. For debugging.
+// No locks, like procdump.
+void
+kmem_cache_dump(void)
+{
+  pr_info("cache size slabs inuse allocs hits\n");
+  for(struct kmem_cache *c = caches.list; c; c = c->next){
+    uint64 allocs = 0, frees = 0, hits = 0;
+    for(int i = 0; i < NCPU; i++){
+      allocs += c->cpu[i].allocs;
+      frees += c->cpu[i].frees;
+      hits += c->cpu[i].hits;
+    }
+    if(allocs == 0)
+      continue;
+    pr_info("%s %d %d %d %d %d\n", c->name, c->size, c->nslabs,
+            (int)(allocs - frees), (int)allocs, (int)hits);
+  }
+}
@@ -0,0 +1,57 @@
+/*! \file slab.h
+ * \brief object caches for small kernel structures
+ */
+
+#ifndef INCLUDED_kernel_slab_h
+#define INCLUDED_kernel_slab_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/spinlock.h"
+
+#define SLAB_CPU_MAX   16     // free objects cached per hart and cache
+#define SLAB_CPU_BATCH 8      // objects moved between a hart and the slabs at once
+
+#define KMALLOC_MIN    32     // smallest kmalloc() size class
+#define KMALLOC_MAX    1024   // larger kmalloc()s get a whole page
+#define KMALLOC_NCLASS 6      // size classes from KMALLOC_MIN to KMALLOC_MAX
+
+struct slab;
+
+/**
+ * Free objects of one cache cached by one hart.
+ * Only touched by the owning hart with interrupts off.
+*/
+struct kmem_cache_cpu {
+  void *objs;           // free objects, linked through their first word
+  int count;            // number of objects on objs
+  uint64 allocs;        // objects handed out on this hart
+  uint64 frees;         // objects given back on this hart
+  uint64 hits;          // allocs served without taking the cache lock
+};
+
+/**
+ * Cache of equally sized objects, carved out of single pages (slabs).
+ * Every slab page starts with a struct slab, so an object finds its
+ * slab by rounding down to the page.
+*/
+struct kmem_cache {
+  char *name;
+  uint size;                         // object size, multiple of 8
+  uint perslab;                      // objects per slab page
+  struct spinlock lock;              // protects partial, nslabs and all slabs of this cache
+  struct slab *partial;              // slabs with at least one free object
+  int nslabs;                        // slab pages currently owned by this cache
+  struct kmem_cache_cpu cpu[NCPU];   // per hart free lists
+  struct kmem_cache *next;           // next cache in the list of all caches
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -75,6 +75,19 @@ holding(struct spinlock *lk)
   return r;
 }
 
+// Check whether this cpu holds any spinlock,
+// in which case the caller must not sleep.
+int
+holdingany(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n > 1;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
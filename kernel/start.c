@@ -9,7 +9,10 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][6];
+uint64 timer_scratch[NCPU][8];
+
+// harts that answer TLB shootdowns, see tlb_shootdown().
+uint64 harts_online;
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -72,10 +75,14 @@ timerinit()
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
   // scratch[5] : halt flag to signal halt to timervec.
+  // scratch[6] : address of CLINT MSIP register, for TLB shootdowns.
+  // scratch[7] : TLB shootdowns, odd while one is under way.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
   scratch[5] = 0;
+  scratch[6] = CLINT_MSIP(id);
+  scratch[7] = 0;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,8 +91,9 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
+  __atomic_fetch_or(&harts_online, 1L << id, __ATOMIC_SEQ_CST);
 }
 
 // signal halt to timervec.
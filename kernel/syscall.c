@@ -6,7 +6,8 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
+  uint64 sz = p->group->sz;
+  if(addr >= sz || addr+sizeof(uint64) > sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -104,10 +105,22 @@ extern uint64 sys_munmap(void);
 extern uint64 sys_futex_init(void);
 extern uint64 sys_futex_wait(void);
 extern uint64 sys_futex_wake(void);
+extern uint64 sys_futex_timedwait(void);
+extern uint64 sys_futex_requeue(void);
+extern uint64 sys_futex_wake_op(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_thread_join(void);
+extern uint64 sys_upcall(void);
+extern uint64 sys_upcall_return(void);
+extern uint64 sys_thread_exit(void);
 extern uint64 sys_net_test(void);
 extern uint64 sys_net_bind(void);
 extern uint64 sys_net_send_listen(void);
 extern uint64 sys_net_unbind(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_bcachectl(void);
+extern uint64 sys_fsync(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -142,10 +155,22 @@ static uint64 (*syscalls[])(void) = {
 [SYS_futex_init] sys_futex_init,
 [SYS_futex_wait] sys_futex_wait,
 [SYS_futex_wake] sys_futex_wake,
+[SYS_futex_timedwait] sys_futex_timedwait,
+[SYS_futex_requeue] sys_futex_requeue,
+[SYS_futex_wake_op] sys_futex_wake_op,
+[SYS_clone]   sys_clone,
+[SYS_thread_join] sys_thread_join,
+[SYS_upcall]  sys_upcall,
+[SYS_upcall_return] sys_upcall_return,
+[SYS_thread_exit] sys_thread_exit,
 [SYS_net_test] sys_net_test,
 [SYS_net_bind] sys_net_bind,
 [SYS_net_send_listen] sys_net_send_listen,
 [SYS_net_unbind] sys_net_unbind,
+[SYS_setpriority] sys_setpriority,
+[SYS_spawn] sys_spawn,
+[SYS_bcachectl] sys_bcachectl,
+[SYS_fsync] sys_fsync,
 };
 
 void
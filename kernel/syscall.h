@@ -41,6 +41,18 @@ extern "C" {
 #define SYS_net_bind 28
 #define SYS_net_send_listen 29
 #define SYS_net_unbind 30
+#define SYS_setpriority 31
+#define SYS_spawn 32
+#define SYS_bcachectl 33
+#define SYS_fsync 34
+#define SYS_futex_timedwait 35
+#define SYS_futex_requeue 36
+#define SYS_futex_wake_op 37
+#define SYS_clone 38
+#define SYS_thread_join 39
+#define SYS_upcall 40
+#define SYS_upcall_return 41
+#define SYS_thread_exit 42
 #define SYS_hello_kernel 50
 #define SYS_printPT 51
 #define SYS_cxx    100
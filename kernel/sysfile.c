@@ -9,19 +9,28 @@
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// Another thread may close the descriptor at any time, so the
+// caller gets a reference of its own and drops it with fileclose().
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *g = myproc()->group;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  acquire(&g->grouplock);
+  if((f=g->ofile[fd]) == 0){
+    release(&g->grouplock);
+    return -1;
+  }
+  filedup(f);
+  release(&g->grouplock);
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -31,17 +40,38 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct proc *g = myproc()->group;
 
+  acquire(&g->grouplock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(g->ofile[fd] == 0){
+      g->ofile[fd] = f;
+      release(&g->grouplock);
       return fd;
     }
   }
+  release(&g->grouplock);
   return -1;
 }
 
+// Free fd if it still refers to f, another thread may have
+// closed it already. Returns 1 if the caller takes over
+// the reference of fd.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct proc *g = myproc()->group;
+  int freed = 0;
+
+  acquire(&g->grouplock);
+  if(g->ofile[fd] == f){
+    g->ofile[fd] = 0;
+    freed = 1;
+  }
+  release(&g->grouplock);
+  return freed;
+}
+
 uint64
 sys_dup(void)
 {
@@ -50,9 +80,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -63,11 +94,15 @@ sys_read(void)
   int n;
   uint64 p;
 
+  int r;
+
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
@@ -76,13 +111,16 @@ sys_write(void)
   struct file *f;
   int n;
   uint64 p;
+  int r;
   
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 uint64
@@ -93,7 +131,8 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  if(fdfree(fd, f))
+    fileclose(f);
   fileclose(f);
   return 0;
 }
@@ -103,11 +142,14 @@ sys_fstat(void)
 {
   struct file *f;
   uint64 st; // user pointer to struct stat
+  int r;
 
   argaddr(1, &st);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -401,8 +443,8 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct proc *g = myproc()->group;
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -416,53 +458,137 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&g->grouplock);
+  old = g->cwd;
+  g->cwd = ip;
+  release(&g->grouplock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the null-terminated user array of strings at uargv
+// into argv, one kalloc'd page per string.
+// Returns 0, or -1 with argv partially filled on failure.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, sizeof(char*) * MAXARG);
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
-      break;
+      return 0;
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+}
 
-  int ret = exec(path, argv);
+static void
+freeargv(char **argv)
+{
+  int i;
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0){
+    freeargv(argv);
+    return -1;
+  }
 
+  int ret = exec(path, argv);
+
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  int fdmap[NOFILE], nfd;
+  uint64 uargv, ufdmap;
+
+  argaddr(1, &uargv);
+  argaddr(2, &ufdmap);
+  argint(3, &nfd);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(ufdmap != 0){
+    if(nfd < 0 || nfd > NOFILE)
+      return -1;
+    if(copyin(myproc()->pagetable, (char*)fdmap, ufdmap, sizeof(int) * nfd) < 0)
+      return -1;
+  }
+  if(fetchargv(uargv, argv) < 0){
+    freeargv(argv);
+    return -1;
+  }
+
+  int ret = spawn(path, argv, ufdmap ? fdmap : 0, nfd);
+
+  freeargv(argv);
+  return ret;
+}
+
+// Wait until the completed writes to the file are on disk.
+// The log commits all files at once, so this syncs everything.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  fileclose(f);
+  log_sync();
+  return 0;
+}
+
+// Set the target size of the buffer cache if target > 0,
+// and copy its size and counters to info if info != 0.
+uint64
+sys_bcachectl(void)
+{
+  int target;
+  uint64 uinfo;
+  struct bcache_info info;
+
+  argint(0, &target);
+  argaddr(1, &uinfo);
+  if(target > 0 && bcache_settarget(target) < 0)
+    return -1;
+  if(uinfo != 0){
+    bcache_stats(&info);
+    if(copyout(myproc()->pagetable, uinfo, (char*)&info, sizeof(info)) < 0)
+      return -1;
+  }
+  return 0;
 }
 
 uint64
@@ -478,18 +604,17 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdfree(fd0, rf))
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    if(fdfree(fd0, rf))
+      fileclose(rf);
+    if(fdfree(fd1, wf))
+      fileclose(wf);
     return -1;
   }
   return 0;
@@ -508,19 +633,25 @@ sys_mmap(void)
   uint64 length;
   int prot, flags, fd;
   struct file *f;
-  uint64 offset;
+  uint64 offset, ret;
 
   argaddr(0, (void*)&addr);
   argaddr(1, &length);
   argint(2, &prot);
   argint(3, &flags);
+  argint(4, &fd);
 
-  if (argfd(4,&fd,&f) < 0 && fd != -1 && !(flags & MAP_ANON)) {
-    return EBADF;
+  if (argfd(4, 0, &f) < 0) {
+    if (fd != -1 && !(flags & MAP_ANON))
+      return EBADF;
+    f = 0;
   }
 
   argaddr(5, &offset);
-  return __intern_mmap(addr, length, prot, flags, f, offset);
+  ret = __intern_mmap(addr, length, prot, flags, f, offset);
+  if (f)
+    fileclose(f);
+  return ret;
 }
 
 uint64
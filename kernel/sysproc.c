@@ -29,6 +29,61 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_thread_exit(void)
+{
+  int n;
+  argint(0, &n);
+  thread_exit(n);
+  return 0;  // not reached
+}
+
+uint64
+sys_thread_join(void)
+{
+  int tid;
+  uint64 p;
+  argint(0, &tid);
+  argaddr(1, &p);
+  return thread_join(tid, p);
+}
+
+// Enter handler every ticks timer ticks the thread runs in user mode,
+// ticks <= 0 stops the upcalls.
+uint64
+sys_upcall(void)
+{
+  struct proc *p = myproc();
+  uint64 handler;
+  int n;
+
+  argaddr(0, &handler);
+  argint(1, &n);
+  p->upcall = n > 0 ? handler : 0;
+  p->upcall_ticks = n;
+  p->upcall_left = n;
+  p->upcall_active = 0;
+  return 0;
+}
+
+uint64
+sys_upcall_return(void)
+{
+  uint64 frame;
+  argaddr(0, &frame);
+  return upcall_return(frame);
+}
+
 uint64
 sys_sbrk(void)
 {
@@ -36,8 +91,7 @@ sys_sbrk(void)
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(growproc(n, &addr) < 0)
     return -1;
   return addr;
 }
@@ -91,6 +145,16 @@ sys_uptime(void)
   return xticks;
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, priority;
+
+  argint(0, &pid);
+  argint(1, &priority);
+  return setpriority(pid, priority);
+}
+
 uint64
 sys_futex_init(void)
 {
@@ -103,10 +167,24 @@ uint64
 sys_futex_wait(void)
 {
   uint64* futex;
-  int val;
+  uint64 val;
+  argaddr(0, (uint64*)&futex);
+  argaddr(1, &val);
+  return __futex_wait(futex, val, 0);
+}
+
+uint64
+sys_futex_timedwait(void)
+{
+  uint64* futex;
+  uint64 val;
+  int timeout;
   argaddr(0, (uint64*)&futex);
-  argint(1, &val);
-  return __futex_wait(futex, val);
+  argaddr(1, &val);
+  argint(2, &timeout);
+  if (timeout <= 0)
+    return ETIMEDOUT;
+  return __futex_wait(futex, val, timeout);
 }
 
 uint64
@@ -114,7 +192,36 @@ sys_futex_wake(void)
 {
   uint64* futex;
   int num_wake;
+  int flags;
+  argaddr(0, (uint64*)&futex);
+  argint(1, &num_wake);
+  argint(2, &flags);
+  return __futex_wake(futex, num_wake, flags);
+}
+
+uint64
+sys_futex_requeue(void)
+{
+  uint64 *futex, *futex2;
+  int num_wake, num_requeue;
+  uint64 val;
+  argaddr(0, (uint64*)&futex);
+  argint(1, &num_wake);
+  argaddr(2, (uint64*)&futex2);
+  argint(3, &num_requeue);
+  argaddr(4, &val);
+  return __futex_requeue(futex, num_wake, futex2, num_requeue, val);
+}
+
+uint64
+sys_futex_wake_op(void)
+{
+  uint64 *futex, *futex2;
+  int num_wake, num_wake2, op;
   argaddr(0, (uint64*)&futex);
   argint(1, &num_wake);
-  return __futex_wake(futex, num_wake);
+  argaddr(2, (uint64*)&futex2);
+  argint(3, &num_wake2);
+  argint(4, &op);
+  return __futex_wake_op(futex, num_wake, futex2, num_wake2, op);
 }
\ No newline at end of file
@@ -12,6 +12,70 @@ void kernelvec();
 
 extern int devintr();
 
+// Returns 1 if the user page at va allows the access of
+// the page fault scause by now. Another thread of the group
+// may have handled a fault on the same page in the meantime.
+static int
+fault_resolved(pagetable_t pagetable, uint64 va, uint64 scause)
+{
+  pte_t *pte;
+  uint64 perm = PTE_V | PTE_U;
+
+  if(scause == SCAUSE_ST_AMO_PF)
+    perm |= PTE_W;
+  else if(scause == SCAUSE_IPF)
+    perm |= PTE_X;
+  else
+    perm |= PTE_R;
+
+  if(va >= MAXVA)
+    return 0;
+  if((pte = walk(pagetable, va, 0)) == 0 && (pte = walkmega(pagetable, va, 0)) == 0)
+    return 0;
+  return (*pte & perm) == perm;
+}
+
+// Enter the upcall handler of p if its interval ran out.
+// The interrupted registers go onto the user stack, the handler
+// gets them in a0 and resumes them with upcall_return().
+// No upcall interrupts the handler before that.
+static void
+upcall_tick(struct proc *p)
+{
+  struct upcall_frame f;
+  uint64 sp;
+
+  if(p->upcall == 0 || p->upcall_active || --p->upcall_left > 0)
+    return;
+  p->upcall_left = p->upcall_ticks;
+
+  memmove(&f, &p->trapframe->ra, sizeof(f) - sizeof(f.epc));
+  f.epc = p->trapframe->epc;
+  sp = (p->trapframe->sp - sizeof(f)) & ~15L;
+  if(copyout(p->pagetable, sp, (char*)&f, sizeof(f)) < 0)
+    return;
+  p->trapframe->epc = p->upcall;
+  p->trapframe->sp = sp;
+  p->trapframe->a0 = sp;
+  p->upcall_active = 1;
+}
+
+// Resume the registers an upcall interrupted, see upcall_tick().
+// Returns the interrupted a0, so that syscall() keeps it.
+uint64
+upcall_return(uint64 frame)
+{
+  struct proc *p = myproc();
+  struct upcall_frame f;
+
+  if(copyin(p->pagetable, (char*)&f, frame, sizeof(f)) < 0)
+    return -1;
+  memmove(&p->trapframe->ra, &f, sizeof(f) - sizeof(f.epc));
+  p->trapframe->epc = f.epc;
+  p->upcall_active = 0;
+  return p->trapframe->a0;
+}
+
 void
 trapinit(void)
 {
@@ -85,15 +149,28 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if (scause == SCAUSE_LOAD_PF || scause == SCAUSE_ST_AMO_PF) { // If load or store failed, try to recover
+  } else if (scause == SCAUSE_LOAD_PF || scause == SCAUSE_ST_AMO_PF || scause == SCAUSE_IPF) { // If load, store or fetch failed, try to recover
     //pr_debug("usertrap(): scause LOAD/STORE page fault. pid=%d\n", p->pid);
     //pr_debug("            sepc=%p stval=%p\n", r_sepc(), r_stval());
-    int recovery_failed = populate_mmap_page(r_stval());
+    int recovery_failed = 1;
+    uint64 failed_addr = r_stval();
+    // Loading a program page may sleep on the disk, stval
+    // is saved now because kerneltrap() doesn't preserve it
+    intr_on();
+    // Writes to pages shared by fork() get their own copy
+    if (scause == SCAUSE_ST_AMO_PF)
+      recovery_failed = uvmcow(p->pagetable, PGROUNDDOWN(failed_addr));
+    // First touch of a program page
+    if (recovery_failed)
+      recovery_failed = exec_fault(p, failed_addr, 1);
+    if (recovery_failed)
+      recovery_failed = populate_mmap_page(failed_addr);
+    if (recovery_failed && fault_resolved(p->pagetable, failed_addr, scause))
+      recovery_failed = 0;
     if (recovery_failed) {
-      uint64 failed_addr = r_stval();
       pr_warning("\nusertrap(): unrecoverable LOAD/STORE page fault: pid=%d\n", p->pid);
       pr_warning("            %s\n", scause_map[scause]);
-      pr_warning("            sepc=%p stval=%p\n", r_sepc(), failed_addr);
+      pr_warning("            sepc=%p stval=%p\n", p->trapframe->epc, failed_addr);
       pr_warning("            Page: %d.%d.%d\n", PX(2, failed_addr), PX(1, failed_addr), PX(0, failed_addr));
       setkilled(p);
     }
@@ -109,9 +186,13 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
-    yield();
+  // give up the CPU if this is a timer interrupt
+  // and the scheduler wants the CPU back.
+  if(which_dev == 2){
+    upcall_tick(p);
+    if(scheduler_tick(p))
+      yield();
+  }
 
   usertrapret();
 }
@@ -156,10 +237,11 @@ usertrapret(void)
   uint64 satp = MAKE_SATP(p->pagetable);
 
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
+  // switches to the user page table, restores user registers
+  // from the trapframe at p->tfva,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -186,8 +268,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this is a timer interrupt
+  // and the scheduler wants the CPU back.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING && scheduler_tick(myproc()))
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -203,6 +286,7 @@ clockintr()
   ticks++;
   wakeup(&ticks);
   release(&tickslock);
+  futex_tick();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -96,7 +96,9 @@ extern "C" {
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// a disk request takes two plus one per block.
+#define NUM 32
+
 
 // a single descriptor, from the spec.
 struct virtq_desc {
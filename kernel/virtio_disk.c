@@ -40,11 +40,14 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    int in_use;
-    struct buf *b;
+    struct buf *b[DISK_MAXSEG]; // consecutive blocks of the request
+    int n;
     char status;
   } info[NUM];
 
+  // chains added to the avail ring since the device was last notified.
+  int unnotified;
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
@@ -188,12 +191,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -204,27 +206,58 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// tell the device about the chains added to the avail ring,
+// unless it said it will look at the ring by itself.
+// caller must hold disk.vdisk_lock.
+static void
+notify(void)
+{
+  if(disk.unnotified == 0)
+    return;
+  __sync_synchronize();
+  if(!(disk.used->flags & VIRTQ_USED_F_NO_NOTIFY))
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.unnotified = 0;
+}
+
+// queue a read or write of the n buffers in bs and return without
+// waiting for it. the buffers must hold consecutive blocks, they
+// are transferred by one request with a data descriptor per buffer.
+// the device is only notified by virtio_disk_kick(), virtio_disk_wait()
+// or when the ring is full, so requests queued back to back
+// cost one notification.
+// once the request completes, b->disk is cleared, b->iodone is
+// called from the interrupt handler if set, and waiters are woken,
+// for every buffer.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submitv(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+
+  if(n < 1 || n > DISK_MAXSEG)
+    panic("virtio_disk_submitv: n");
+  for(int i = 1; i < n; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i)
+      panic("virtio_disk_submitv: not consecutive");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // one descriptor for type/reserved/sector, the data descriptors,
+  // and one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[DISK_MAXSEG + 2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc_descs(idx, n + 2) == 0) {
       break;
     }
+    // queued requests can't complete before the device hears of them
+    notify();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -241,52 +274,85 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    int d = idx[i + 1];
+    disk.desc[d].addr = (uint64) bs[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[i + 2];
+  }
 
+  int st = idx[n + 1];
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  disk.info[idx[0]].in_use = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[st].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[st].len = 1;
+  disk.desc[st].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[st].next = 0;
+
+  // record the bufs for virtio_disk_intr().
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    disk.info[idx[0]].b[i] = bs[i];
+  }
+  disk.info[idx[0]].n = n;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
+  // another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.unnotified++;
 
-  __sync_synchronize();
-
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  int* in_use = &disk.info[idx[0]].in_use;
-  while(*in_use == 1) {
-    sleep(in_use, &disk.vdisk_lock);
-  }
+// queue a read or write of b, see virtio_disk_submitv().
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// let the device start on all queued requests.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  notify();
+  release(&disk.vdisk_lock);
+}
 
+// wait for the request queued for b to complete.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  notify();
+  while(b->disk) {
+    sleep(b, &disk.vdisk_lock);
+  }
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
+
 void
 virtio_disk_intr()
 {
+  struct buf *done[NUM];
+  int ndone = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -309,12 +375,23 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    int* in_use = &disk.info[id].in_use;
-    *in_use = 0;   // disk is done with buf
-    wakeup(in_use);
+    for(int i = 0; i < disk.info[id].n; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      if(b->iodone)
+        done[ndone++] = b;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    }
+    disk.info[id].n = 0;
+    free_chain(id);
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  // the callbacks may take buffer cache locks
+  for(int i = 0; i < ndone; i++)
+    done[i]->iodone(done[i]);
 }
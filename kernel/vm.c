@@ -30,6 +30,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, to send TLB shootdowns to other harts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -40,9 +43,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped by procpool_grow() as procs are carved out.
+
   return kpgtbl;
 }
 
@@ -67,6 +69,45 @@ kvminithart()
   sfence_vma();
 }
 
+extern uint64 timer_scratch[NCPU][8];
+extern uint64 harts_online;
+
+// Flush the TLBs of the harts in mask, ours included, and wait
+// until they are flushed. Call after changing or removing PTEs
+// that other harts may have cached, before freeing their pages.
+// The other harts flush in timervec in machine mode, so they
+// answer even while they spin with interrupts off.
+void
+tlb_shootdown(uint64 mask)
+{
+  uint64 target[NCPU];
+  int me, i;
+
+  push_off();
+  me = cpuid();
+  mask &= __atomic_load_n(&harts_online, __ATOMIC_SEQ_CST);
+
+  // The PTE changes must be visible before the flushes start.
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    if(i == me || (mask & (1L << i)) == 0)
+      continue;
+    // A flush under way may have missed our changes, wait for the next
+    uint64 n = __atomic_load_n(&timer_scratch[i][7], __ATOMIC_SEQ_CST);
+    target[i] = n + ((n & 1) ? 3 : 2);
+    *(volatile uint32*)CLINT_MSIP(i) = 1;
+  }
+  if(mask & (1L << me))
+    sfence_vma();
+  for(i = 0; i < NCPU; i++){
+    if(i == me || (mask & (1L << i)) == 0)
+      continue;
+    while(__atomic_load_n(&timer_scratch[i][7], __ATOMIC_SEQ_CST) < target[i])
+      ;
+  }
+  pop_off();
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -79,6 +120,7 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// Returns 0 if va lies in a megapage, see walkmega().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -88,6 +130,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return 0;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc_zero()) == 0)
@@ -98,6 +142,27 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   return &pagetable[PX(0, va)];
 }
 
+// Like walk(), but stops at the level-1 PTE for va,
+// which is either a megapage leaf or points to a level-0 table.
+pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkmega");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zero()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -110,6 +175,14 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
+  // Megapages resolve to the 4096-byte page of va inside them.
+  pte = walkmega(pagetable, va, 0);
+  if(pte != 0 && (*pte & PTE_V) && PTE_LEAF(*pte)){
+    if((*pte & PTE_U) == 0)
+      return 0;
+    return PTE2PA(*pte) + PGROUNDDOWN(va - MEGAPGROUNDDOWN(va));
+  }
+
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     return 0;
@@ -160,10 +233,13 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
-// Something goes wrong in here, upper tables are freed even though they should not be
-void
+// Unlinks the empty page-table pages of the mmap area. Other harts
+// may still walk them, so they are returned chained through their
+// first entry, to be freed after a TLB shootdown.
+void*
 uvmfreelevels(pagetable_t pagetable)
 {
+  void *unlinked = 0;
   // Yay, magic numbers! 128 is MMAP_MIN_ADDR and 256 is MAXVA :)
   for (int u = 0; u < 256; u++) {
     pte_t *upper = &pagetable[u];
@@ -176,6 +252,11 @@ uvmfreelevels(pagetable_t pagetable)
       int midEmpty = 1;
       if (*mid == 0) 
         continue;
+      // Megapages are no tables, but keep the upper table in use
+      if (PTE_LEAF(*mid)) {
+        upEmpty = 0;
+        continue;
+      }
 
       for (int l = 0; l < 512; l++) {
         pte_t* low = &((pagetable_t)PTE2PA(*mid))[l];
@@ -191,15 +272,29 @@ uvmfreelevels(pagetable_t pagetable)
         //break; // BUT! We can't abort early cuz other entries might be empty that need checking
         // Lowest level can break, mid & up cannot, cuz low does not free only check
       } else {
-        kfree((void*)PTE2PA(*mid));
+        *(void**)PTE2PA(*mid) = unlinked;
+        unlinked = (void*)PTE2PA(*mid);
         *mid = 0;
       }
     }
     if (upEmpty == 1) {
-      kfree((void*)PTE2PA(*upper));
+      *(void**)PTE2PA(*upper) = unlinked;
+      unlinked = (void*)PTE2PA(*upper);
       *upper = 0;
     }
   }
+  return unlinked;
+}
+
+// Whether va lies in one of the nsegs lazily loaded program
+// segments at segs, whose pages are only mapped once touched.
+static int
+inexecseg(struct execseg *segs, int nsegs, uint64 va)
+{
+  for(int i = 0; i < nsegs; i++)
+    if(va >= segs[i].vaddr && va < segs[i].vaddr + segs[i].memsz)
+      return 1;
+  return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
@@ -207,6 +302,16 @@ uvmfreelevels(pagetable_t pagetable)
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  uvmunmap_lazy(pagetable, va, npages, do_free, 0, 0);
+}
+
+// Like uvmunmap(), but pages of the nsegs lazily loaded program
+// segments at segs may be missing, they were never touched,
+// see exec_fault().
+void
+uvmunmap_lazy(pagetable_t pagetable, uint64 va, uint64 npages, int do_free,
+              struct execseg *segs, int nsegs)
 {
   uint64 a;
   pte_t *pte;
@@ -215,9 +320,14 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
+    if((pte = walk(pagetable, a, 0)) == 0){
+      if(inexecseg(segs, nsegs, a))
+        continue;
       panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0) {
+    }
+    if((*pte & PTE_V) == 0){
+      if(inexecseg(segs, nsegs, a))
+        continue;
       panic("uvmunmap: not mapped");
     }
     if(PTE_FLAGS(*pte) == PTE_V)
@@ -272,12 +382,12 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   for(a = oldsz; a < newsz; a += PGSIZE){
     mem = kalloc_zero();
     if(mem == 0){
-      uvmdealloc(pagetable, a, oldsz);
+      uvmdealloc(pagetable, a, oldsz, 0, 0);
       return 0;
     }
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
+      uvmdealloc(pagetable, a, oldsz, 0, 0);
       return 0;
     }
   }
@@ -287,16 +397,52 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Pages of the nsegs lazily loaded segments at segs
+// may be missing.  Returns the new process size.
 uint64
-uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, struct execseg *segs, int nsegs)
 {
   if(newsz >= oldsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    uvmunmap_lazy(pagetable, PGROUNDUP(newsz), npages, 1, segs, nsegs);
+  }
+
+  return newsz;
+}
+
+// Like uvmdealloc(), but for the page table of group leader g,
+// which its threads may be using on other harts. The pages are
+// freed in batches, each after a TLB shootdown.
+// Caller must hold group_lockvm(g).
+uint64
+uvmshrink(struct proc *g, uint64 oldsz, uint64 newsz)
+{
+  uint64 a, pa[32];
+  pte_t *pte;
+  int i, n;
+
+  if(newsz >= oldsz)
+    return oldsz;
+
+  a = PGROUNDUP(newsz);
+  while(a < PGROUNDUP(oldsz)){
+    for(n = 0; n < NELEM(pa) && a < PGROUNDUP(oldsz); a += PGSIZE){
+      if((pte = walk(g->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0){
+        if(inexecseg(g->exec_segs, g->exec_nsegs, a))
+          continue;
+        panic("uvmshrink: not mapped");
+      }
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmshrink: not a leaf");
+      pa[n++] = PTE2PA(*pte);
+      *pte = 0;
+    }
+    group_shootdown(g);
+    for(i = 0; i < n; i++)
+      kfree((void*)pa[i]);
   }
 
   return newsz;
@@ -325,16 +471,21 @@ freewalk(pagetable_t pagetable)
 /**
  * Free mmaped user memory pages
  * Walks through the pagetable and unmaps any mmaped entries, builds a constructed address using the PT indices
+ * level is the level of pagetable, 2 for the root
 */
 uint64
-uvmfreemmap(pagetable_t highestLevel, pagetable_t pagetable, uint64 constructedAddr) 
+uvmfreemmap(pagetable_t highestLevel, pagetable_t pagetable, uint64 constructedAddr, int level) 
 {
   for (int i = 0; i < 512; i++) {
     pte_t pte = pagetable[i];
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
-      uvmfreemmap(highestLevel, (pagetable_t)child, (constructedAddr << 9) + i);
+      uvmfreemmap(highestLevel, (pagetable_t)child, (constructedAddr << 9) + i, level - 1);
+    } else if (level == 1 && (pte & PTE_MM) && (pte & PTE_V) && (pte & PTE_U)){
+      // Megapage, always private
+      kfree_pages((void*)PTE2PA(pte), MEGAPAGE_ORDER);
+      pagetable[i] = 0;
     } else if ((pte & PTE_MM) && (pte & PTE_V) && (pte & PTE_U)){
       // Address for this entry
       uint64 entryAddr = ((constructedAddr << 9) + i) << PGSHIFT;
@@ -354,24 +505,57 @@ uvmfreemmap(pagetable_t highestLevel, pagetable_t pagetable, uint64 constructedA
 
 // Free user memory pages,
 // then free page-table pages.
+// Pages of the nsegs lazily loaded segments at segs may be missing.
 void
-uvmfree(pagetable_t pagetable, uint64 sz)
+uvmfree(pagetable_t pagetable, uint64 sz, struct execseg *segs, int nsegs)
 {
   if(sz > 0)
-    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
-  uvmfreemmap(pagetable, pagetable, 0); 
+    uvmunmap_lazy(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1, segs, nsegs);
+  uvmfreemmap(pagetable, pagetable, 0, 2); 
   freewalk(pagetable);
 }
 
+// Prepare the page mapped by *pte to be shared with a child.
+// Writable pages lose PTE_W and become copy-on-write, see uvmcow().
+// Read-only pages are shared as they are.
+// Adds a reference for the child's mapping.
+static void
+cowshare(pte_t *pte)
+{
+  void *pa = (void*)PTE2PA(*pte);
+
+  if(*pte & PTE_W){
+    kpage_setcow(pa, 1);
+    *pte &= ~PTE_W;
+  }
+  kpage_dup(pa);
+}
+
 // Basically like uvmfreemmap, but instead of freeing it copies
-uint64 uvmcopymmap(pagetable_t new, pagetable_t old, pagetable_t curOld, uint64 constructedAddr)
+uint64 uvmcopymmap(pagetable_t new, pagetable_t old, pagetable_t curOld, uint64 constructedAddr, int level)
 {
   for (int i = 0; i < 512; i++) {
     pte_t pte = curOld[i];
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
-      uvmcopymmap(new, old, (pagetable_t)child, (constructedAddr << 9) + i);
+      uint64 rVal = uvmcopymmap(new, old, (pagetable_t)child, (constructedAddr << 9) + i, level - 1);
+      if (rVal != 0)
+        return rVal;
+    } else if (level == 1 && (pte & PTE_MM) && (pte & PTE_V) && (pte & PTE_U)){ // Megapage
+      uint64 entryVA = ((constructedAddr << 9) + i) << MEGAPGSHIFT;
+      void* newMemory = kalloc_pages(MEGAPAGE_ORDER);
+      if (newMemory == NULL) {
+        return 1;
+      }
+      memmove(newMemory, (void*)PTE2PA(pte), MEGAPGSIZE);
+      pte_t* newEntry = walkmega(new, entryVA, 1);
+      if (newEntry == 0) {
+        kfree_pages(newMemory, MEGAPAGE_ORDER);
+        uvmfreemmap(new, new, 0, 2);
+        return 2;
+      }
+      *newEntry = PA2PTE(newMemory) | PTE_FLAGS(pte);
     } else if ((pte & PTE_MM) && (pte & PTE_U)){ // If this is an mmaped entry
       // Address for this entry
       uint64 entryVA = ((constructedAddr << 9) + i) << PGSHIFT;
@@ -381,14 +565,10 @@ uint64 uvmcopymmap(pagetable_t new, pagetable_t old, pagetable_t curOld, uint64
       void* newMemory = (void*) entryPA;
       // Add a new entry to the shared table if shared
       if ((entryFlags & PTE_SH)) {
-        acquire_or_insert_table(NULL, newMemory);
-      } else if (entryFlags & PTE_V){ // valid entry gets copied
-        // Copy this entry
-        newMemory = kalloc();
-        if (newMemory == NULL) {
-          return 1;
-        }
-        memmove(newMemory, (void*)entryPA, PGSIZE);
+        acquire_or_insert_table(NULL, 0, newMemory, NULL);
+      } else if (entryFlags & PTE_V){ // valid entry gets shared copy-on-write
+        cowshare(&curOld[i]);
+        entryFlags = PTE_FLAGS(curOld[i]);
       }
 
       pte_t* newEntry = walk(new, entryVA, 1);
@@ -397,7 +577,7 @@ uint64 uvmcopymmap(pagetable_t new, pagetable_t old, pagetable_t curOld, uint64
         if (!(entryFlags & PTE_SH) && newMemory != NULL) {
           kfree(newMemory);
         }
-        uvmfreemmap(new, new, 0);
+        uvmfreemmap(new, new, 0, 2);
         return 2;
       }
       // Else: Set PA and Flags
@@ -410,46 +590,126 @@ uint64 uvmcopymmap(pagetable_t new, pagetable_t old, pagetable_t curOld, uint64
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Shares the physical pages copy-on-write instead
+// of copying them, megapages are still copied.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, struct execseg *segs, int nsegs)
 {
   pte_t *pte;
   uint64 pa, i;
-  uint flags;
-  char *mem;
 
-  // Copy sbrk area
+  // Share sbrk area, program pages that aren't loaded
+  // yet are loaded by the child itself
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0){
+      if(inexecseg(segs, nsegs, i))
+        continue;
       panic("uvmcopy: page not present");
+    }
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, PTE_FLAGS(*pte) & ~PTE_W) != 0)
       goto err;
-    }
+    cowshare(pte);
   }
 
-  uint64 rVal = uvmcopymmap(new, old, old, 0);
+  uint64 rVal = uvmcopymmap(new, old, old, 0, 2);
   if (rVal != 0)
     goto err;
 
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap_lazy(new, 0, i / PGSIZE, 1, segs, nsegs);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va.
+// The last user of a page gets it back writable, everyone
+// else gets a private copy.
+// Returns 0 on success or if va is writable already,
+// -1 if va is no copy-on-write page or memory ran out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  void *pa;
+  char *mem;
+  int locked, ret = -1;
+
+  if(va >= MAXVA)
+    return -1;
+
+  // The threads of a group share the page table
+  locked = p != 0 && p->pagetable == pagetable ? group_lockvm(p->group) : 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    goto out;
+  // Another thread copied it first
+  if(*pte & PTE_W){
+    ret = 0;
+    goto out;
+  }
+  pa = (void*)PTE2PA(*pte);
+  if(!kpage_iscow(pa))
+    goto out;
+
+  if(kpage_refs(pa) == 1){
+    kpage_setcow(pa, 0);
+    *pte |= PTE_W;
+    ret = 0;
+    goto out;
+  }
+
+  if((mem = kalloc()) == 0)
+    goto out;
+  memmove(mem, pa, PGSIZE);
+  *pte = PA2PTE(mem) | PTE_FLAGS(*pte) | PTE_W;
+  // Other threads may still read the old page through their TLBs
+  if(p != 0 && p->pagetable == pagetable)
+    group_shootdown(p->group);
+  else
+    tlb_shootdown(-1);
+  kfree(pa);
+  ret = 0;
+ out:
+  if(locked)
+    group_unlockvm(p->group, locked);
+  return ret;
+}
+
+// Look up the physical address of the user page at va
+// for a copy from or to the kernel. Program pages that were
+// never touched are loaded first, like on a page fault.
+// Return 0 if va isn't mapped.
+static uint64
+uvmfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+
+  pa = walkaddr(pagetable, va);
+  if(pa == 0 && p != 0 && p->pagetable == pagetable && exec_fault(p, va, !holdingany()) == 0)
+    pa = walkaddr(pagetable, va);
+  return pa;
+}
+
+// Load the untouched program pages among the len bytes at va
+// of the calling process, so that copyin() and copyout() find
+// them while the caller holds a spinlock.
+void
+uvmprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < p->group->sz; a += PGSIZE)
+    if(walkaddr(p->pagetable, a) == 0)
+      exec_fault(p, a, 1);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -470,12 +730,24 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmfault(pagetable, va0);
     if(pa0 == 0)
       return -1;
+    // The kernel doesn't fault on copy-on-write pages, copy them here.
+    if(kpage_iscow((void*)pa0)){
+      if(uvmcow(pagetable, va0) != 0)
+        return -1;
+      pa0 = walkaddr(pagetable, va0);
+    }
+    // Read-only pages might be program text shared with others
+    if((pte = walk(pagetable, va0, 0)) == 0)
+      pte = walkmega(pagetable, va0, 0);
+    if((*pte & PTE_W) == 0)
+      return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -498,7 +770,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmfault(pagetable, va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -525,7 +797,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmfault(pagetable, va0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -587,6 +859,10 @@ print_pt(pagetable_t pagetable)
       pte_t mid = ((pagetable_t)PTE2PA(upper))[m];
       if (!(mid & PTE_V))
         continue;
+      if (PTE_LEAF(mid)) {
+        pr_notice("%d %d megapage pa:%p\n", u, m, PTE2PA(mid));
+        continue;
+      }
       for (int l = 0; l < 512; l++) {
         pte_t low = ((pagetable_t)PTE2PA(mid))[l];
         if (!(low & (PTE_V | PTE_MM)))
@@ -1,4 +1,5 @@
 #include "own/alloc.h"
+#include "user/futex.h"
 /**
  * IDEA: There*s a list of buddy managers, each pointing to their own buddy manager with contiguous space
  * Once a buddy manager can't add more space (because of fragmentation or whatever), we try the next one in the list
@@ -15,6 +16,24 @@ struct __managerList {
 
 struct __managerList managerList = {.start = NULL, .length = 0};
 
+/**
+ * Serializes malloc() and free() of the threads of a process.
+ * A zeroed mutex is free, so it works before main() runs.
+*/
+osdev_mutex_t malloc_mutex;
+
+/**
+ * Take and drop malloc_mutex. A thread runtime overrides them
+ * to keep the holder from being preempted, see user/uthreads.c
+*/
+__attribute__((weak)) void malloc_lock(void) {
+    osdev_mutex_lock(&malloc_mutex);
+}
+
+__attribute__((weak)) void malloc_unlock(void) {
+    osdev_mutex_unlock(&malloc_mutex);
+}
+
 /**
  * Returns a pointer to manager the address resides in
 */
@@ -46,13 +65,14 @@ void free(void* pointer) {
     if (pointer == NULL) {
         return;
     }
+    malloc_lock();
     BuddyManager* manager = get_responsible_manager(pointer); 
-    if (manager == NULL) {
-        return;
+    if (manager != NULL) {
+        bufree(pointer, manager->anchor, manager->base);
+        // Heck
+        manager->freeMap = manager->anchor->freeLeft | manager->anchor->freeRight;
     }
-    bufree(pointer, manager->anchor, manager->base);
-    // Heck
-    manager->freeMap = manager->anchor->freeLeft | manager->anchor->freeRight;
+    malloc_unlock();
 }
 
 
@@ -275,9 +295,9 @@ int manGrow(uint32 requiredLevel, BuddyManager* manager) {
 }
 
 /**
- *
+ * malloc() with malloc_mutex held
 */
-void* malloc(uint32 nBytes) {
+static void* malloc_locked(uint32 nBytes) {
     if(nBytes == 0) {
         return NULL;
     }
@@ -325,9 +345,17 @@ void* malloc(uint32 nBytes) {
     return NULL;
 }
 
+void* malloc(uint32 nBytes) {
+    malloc_lock();
+    void* result = malloc_locked(nBytes);
+    malloc_unlock();
+    return result;
+}
 
 void setup_malloc() {
     // Make first Manager in here
     // And initialize it
+    malloc_lock();
     get_and_init_manager(MIN_BUDDY_SIZE);
+    malloc_unlock();
 }
@@ -0,0 +1,45 @@
+/*!
+ * \brief measures exec latency of a program with a large text and data segment
+ * \file
+ */
+
+#include "user/user.h"
+
+#define ITERATIONS 200
+#define CONCURRENT 8
+
+// Large initialized data, only a small part is touched by each run
+int table[16 * 1024] = {[0] = 1, [16 * 1024 - 1] = 2};
+
+static char* self = "exec-bench";
+
+void run(char* mode, int concurrent) {
+    char* argv[] = {self, mode, 0};
+    int start = uptime();
+    for (int i = 0; i < ITERATIONS; i += concurrent) {
+        for (int j = 0; j < concurrent; j++) {
+            if (spawn(self, argv, 0, 0) < 0) {
+                printf("spawn failed\n");
+                exit(1);
+            }
+        }
+        for (int j = 0; j < concurrent; j++) {
+            int status = 0;
+            wait(&status);
+            if (status != 0)
+                exit(1);
+        }
+    }
+    int ticks = uptime() - start;
+    printf("exec %d x %d: %d iterations in %d ticks\n", concurrent, ITERATIONS / concurrent, ITERATIONS, ticks);
+}
+
+void main(int argc, char** argv) {
+    // Started copy, touch one data page and leave
+    if (argc > 1)
+        exit(table[0] == 1 ? 0 : 1);
+
+    run("child", 1);
+    run("child", CONCURRENT);
+    exit(0);
+}
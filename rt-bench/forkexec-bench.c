@@ -0,0 +1,51 @@
+/*!
+ * \brief measures fork+exit and fork+exec+exit latency of a process with a large heap
+ * \file
+ */
+
+#include "user/user.h"
+
+#define ITERATIONS 200
+#define HEAP_PAGES 256
+
+static char* self = "forkexec-bench";
+
+void run(int do_exec) {
+    char* argv[] = {self, "child", 0};
+    int start = uptime();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("fork failed\n");
+            exit(1);
+        }
+        if (pid == 0) {
+            if (do_exec)
+                exec(self, argv);
+            exit(0);
+        }
+        int status = 0;
+        wait(&status);
+        if (status != 0)
+            exit(1);
+    }
+    int ticks = uptime() - start;
+    printf("%s: %d iterations in %d ticks\n", do_exec ? "fork+exec" : "fork", ITERATIONS, ticks);
+}
+
+void main(int argc, char** argv) {
+    // Child of the exec run, nothing to do
+    if (argc > 1)
+        exit(0);
+
+    // Give fork something to copy
+    char* heap = sbrk(HEAP_PAGES * 4096);
+    if (heap == (char*)-1)
+        exit(1);
+    for (int i = 0; i < HEAP_PAGES; i++)
+        heap[i * 4096] = i;
+
+    run(0);
+    run(1);
+    exit(0);
+}
@@ -41,16 +41,16 @@ int main(void) {
         ">>>> starting benchmark [%s]\n"
         "\033[0m",
         readbuffer);
-      auto pid = fork();
-      if (pid < 0)
-        exit(1);
-      else if (pid == 0) {
-        exec(readbuffer, const_cast<char **>(argv));
+      // Only pass on stdin, stdout and stderr, not the directory
+      const int fdmap[] = {0, 1, 2};
+      auto pid = spawn(readbuffer, const_cast<char **>(argv), fdmap, 3);
+      if (pid < 0) {
         printf(
           "\033[1;31m"
-          ">>>> exit failed\n"
-          "\033[0m");
-        exit(1);
+          ">>>> testcase [%s] could not be started\n"
+          "\033[0m",
+          readbuffer);
+        continue;
       }
       int retcode = 0;
       auto ret    = wait(&retcode);
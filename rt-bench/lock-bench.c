@@ -0,0 +1,141 @@
+/*!
+ * \brief measures the futex based locks against the sutex spinlock under contention
+ * \file
+ */
+
+#include "user/user.h"
+#include "user/mmap.h"
+#include "user/sync.h"
+
+#define NPROC 3
+#define ITERATIONS 2000
+#define ROUNDS 200
+
+struct shared {
+    osdev_sutex_t sutex;
+    osdev_mutex_t mutex;
+    osdev_sem_t sem;
+    osdev_rwlock_t rwlock;
+    osdev_cond_t cond;
+    osdev_barrier_t barrier;
+    uint64 counter;
+    uint64 turn;
+};
+
+static struct shared* s;
+
+// A short critical section, long enough that others run into the lock
+static void work(void) {
+    for (volatile int i = 0; i < 50; i++)
+        ;
+    s->counter++;
+}
+
+static void body(int kind, int id) {
+    switch (kind) {
+    case 0:
+        for (int i = 0; i < ITERATIONS; i++) {
+            osdev_sutex_lock(&s->sutex);
+            work();
+            osdev_sutex_unlock(&s->sutex);
+        }
+        break;
+    case 1:
+        for (int i = 0; i < ITERATIONS; i++) {
+            osdev_mutex_lock(&s->mutex);
+            work();
+            osdev_mutex_unlock(&s->mutex);
+        }
+        break;
+    case 2:
+        for (int i = 0; i < ITERATIONS; i++) {
+            osdev_sem_wait(&s->sem);
+            work();
+            osdev_sem_post(&s->sem);
+        }
+        break;
+    case 3:
+        // Read mostly, every tenth access writes
+        for (int i = 0; i < ITERATIONS; i++) {
+            if (i % 10 == 0) {
+                osdev_rwlock_wrlock(&s->rwlock);
+                work();
+            } else {
+                osdev_rwlock_rdlock(&s->rwlock);
+                for (volatile int j = 0; j < 50; j++)
+                    ;
+            }
+            osdev_rwlock_unlock(&s->rwlock);
+        }
+        break;
+    case 4:
+        // Procs take turns, each waits on the condition for its turn
+        for (int i = 0; i < ROUNDS; i++) {
+            osdev_mutex_lock(&s->mutex);
+            while (s->turn % NPROC != id)
+                osdev_cond_wait(&s->cond, &s->mutex);
+            s->turn++;
+            osdev_cond_broadcast(&s->cond, &s->mutex);
+            osdev_mutex_unlock(&s->mutex);
+        }
+        break;
+    case 5:
+        for (int i = 0; i < ROUNDS; i++)
+            osdev_barrier_wait(&s->barrier);
+        break;
+    }
+}
+
+static char* names[] = {"sutex", "mutex", "semaphore", "rwlock 90% reads", "condvar turns", "barrier"};
+
+static void run(int kind) {
+    osdev_sutex_init(&s->sutex);
+    osdev_mutex_init(&s->mutex);
+    osdev_sem_init(&s->sem, 1);
+    osdev_rwlock_init(&s->rwlock);
+    osdev_cond_init(&s->cond);
+    osdev_barrier_init(&s->barrier, NPROC);
+    s->counter = 0;
+    s->turn = 0;
+
+    int start = uptime();
+    for (int id = 0; id < NPROC; id++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("fork failed\n");
+            exit(1);
+        }
+        if (pid == 0) {
+            body(kind, id);
+            exit(0);
+        }
+    }
+    for (int id = 0; id < NPROC; id++) {
+        int status = 0;
+        wait(&status);
+        if (status != 0)
+            exit(1);
+    }
+    int ticks = uptime() - start;
+    printf("%s: %d procs in %d ticks\n", names[kind], NPROC, ticks);
+
+    if (kind <= 2 && s->counter != NPROC * ITERATIONS) {
+        printf("%s: lost updates, counter %d\n", names[kind], (int)s->counter);
+        exit(1);
+    }
+    if (kind == 4 && s->turn != NPROC * ROUNDS) {
+        printf("%s: %d turns\n", names[kind], (int)s->turn);
+        exit(1);
+    }
+}
+
+void main(int argc, char** argv) {
+    s = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    if (s == MAP_FAILED) {
+        printf("mmap failed\n");
+        exit(1);
+    }
+    for (int kind = 0; kind < sizeof(names) / sizeof(names[0]); kind++)
+        run(kind);
+    exit(0);
+}
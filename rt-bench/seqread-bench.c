@@ -0,0 +1,55 @@
+/*!
+ * \brief measures sequential reads of a file that is not cached
+ * \file
+ */
+
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define FILE_BLOCKS 256
+
+char buffer[4096];
+
+static char* path = "seqread-file";
+
+void run(char* what, int chunk) {
+    struct bcache_info info;
+    // Drop the unused buffers, so the blocks come from the disk
+    bcachectl(0, &info);
+    bcachectl(info.minbuf, 0);
+    bcachectl(info.target, 0);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("open failed\n");
+        exit(1);
+    }
+    int start = uptime();
+    int total = 0, n;
+    while ((n = read(fd, buffer, chunk)) > 0)
+        total += n;
+    int ticks = uptime() - start;
+    close(fd);
+    printf("%s, %d byte reads: %d bytes in %d ticks\n", what, chunk, total, ticks);
+}
+
+void main(int argc, char** argv) {
+    int fd = open(path, O_CREATE | O_RDWR);
+    if (fd < 0) {
+        printf("create failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+            printf("write failed\n");
+            exit(1);
+        }
+    }
+    close(fd);
+
+    run("cold", 4096);
+    run("warm", 4096);
+    run("warm", 512);
+    unlink(path);
+    exit(0);
+}
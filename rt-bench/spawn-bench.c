@@ -0,0 +1,56 @@
+/*!
+ * \brief compares the latency of starting a command with fork+exec and with spawn
+ * \file
+ */
+
+#include "user/user.h"
+
+#define ITERATIONS 200
+#define HEAP_PAGES 256
+
+static char* self = "spawn-bench";
+
+void run(int do_spawn) {
+    char* argv[] = {self, "child", 0};
+    int fdmap[3] = {0, 1, 2};
+    int start = uptime();
+    for (int i = 0; i < ITERATIONS; i++) {
+        int pid;
+        if (do_spawn) {
+            pid = spawn(self, argv, fdmap, 3);
+        } else {
+            pid = fork();
+            if (pid == 0) {
+                exec(self, argv);
+                exit(1);
+            }
+        }
+        if (pid < 0) {
+            printf("%s failed\n", do_spawn ? "spawn" : "fork");
+            exit(1);
+        }
+        int status = 0;
+        wait(&status);
+        if (status != 0)
+            exit(1);
+    }
+    int ticks = uptime() - start;
+    printf("%s: %d commands in %d ticks\n", do_spawn ? "spawn" : "fork+exec", ITERATIONS, ticks);
+}
+
+void main(int argc, char** argv) {
+    // Started command, nothing to do
+    if (argc > 1)
+        exit(0);
+
+    // A parent with some state, like a shell that ran for a while
+    char* heap = sbrk(HEAP_PAGES * 4096);
+    if (heap == (char*)-1)
+        exit(1);
+    for (int i = 0; i < HEAP_PAGES; i++)
+        heap[i * 4096] = i;
+
+    run(0);
+    run(1);
+    exit(0);
+}
@@ -0,0 +1,36 @@
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "assert.h"
+
+/**
+ * Test queries and resizes the buffer cache with bcachectl
+*/
+
+char buffer[4096];
+
+void main(int argc, char** argv) {
+    struct bcache_info info, after;
+    assert(bcachectl(0, &info) == 0);
+    assert(info.nbuf >= info.minbuf && info.target >= info.minbuf);
+
+    // Can't go below the minimum
+    assert(bcachectl(info.minbuf - 1, NULL) == -1);
+
+    // Shrinking to the minimum frees the unused buffers right away
+    assert(bcachectl(info.minbuf, &after) == 0);
+    assert(after.target == info.minbuf && after.nbuf == info.minbuf);
+
+    // Creating a file goes through the buffer cache, the inode blocks are cached already
+    assert(bcachectl(0, &info) == 0);
+    int fd = open("bcache-file", O_CREATE | O_RDWR);
+    assert(fd >= 0);
+    assert(write(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    close(fd);
+    unlink("bcache-file");
+    assert(bcachectl(0, &after) == 0);
+    assert(after.hits > info.hits);
+
+    // Restore the old target
+    assert(bcachectl(info.target, NULL) == 0);
+    exit(0);
+}
@@ -0,0 +1,49 @@
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "assert.h"
+
+/**
+ * Test writes a file past the indirect blocks into the double indirect ones,
+ * reads it back and truncates it again
+*/
+
+#define BLOCKS (NDIRECT + NINDIRECT + 64)
+
+int buffer[BSIZE / sizeof(int)];
+
+void main(int argc, char** argv) {
+    int fd = open("bigfile", O_CREATE | O_RDWR);
+    assert(fd >= 0);
+    for (int i = 0; i < BLOCKS; i++) {
+        buffer[0] = i;
+        buffer[BSIZE / sizeof(int) - 1] = ~i;
+        assert(write(fd, buffer, BSIZE) == BSIZE);
+    }
+    close(fd);
+
+    struct stat st;
+    assert(stat("bigfile", &st) == 0);
+    assert(st.size == (uint64)BLOCKS * BSIZE);
+
+    fd = open("bigfile", O_RDONLY);
+    assert(fd >= 0);
+    for (int i = 0; i < BLOCKS; i++) {
+        assert(read(fd, buffer, BSIZE) == BSIZE);
+        assert(buffer[0] == i);
+        assert(buffer[BSIZE / sizeof(int) - 1] == ~i);
+    }
+    assert(read(fd, buffer, BSIZE) == 0);
+    close(fd);
+
+    // Truncating frees the double indirect blocks, the space can be used again
+    for (int round = 0; round < 2; round++) {
+        fd = open("bigfile", O_RDWR | O_TRUNC);
+        assert(fd >= 0);
+        for (int i = 0; i < BLOCKS; i++)
+            assert(write(fd, buffer, BSIZE) == BSIZE);
+        close(fd);
+    }
+    assert(unlink("bigfile") == 0);
+    exit(0);
+}
@@ -0,0 +1,118 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "assert.h"
+
+#define NPAGES 8
+// sbrk() steps used to use up the free memory
+#define HOG_CHUNK (256 * PAGE_SIZE)
+
+const char message[] = "read into a copy-on-write page";
+
+// Writes after fork stay on their own side, in both directions
+static void isolation(char* pages) {
+    int to_child[2], to_parent[2];
+    char c;
+    assert(pipe(to_child) == 0 && pipe(to_parent) == 0);
+    for (int i = 0; i < NPAGES; i++)
+        pages[i * PAGE_SIZE] = 'p';
+
+    int pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < NPAGES; i++)
+            pages[i * PAGE_SIZE] = 'c';
+        assert(write(to_parent[1], "w", 1) == 1);
+        // The parent writes its copy meanwhile
+        assert(read(to_child[0], &c, 1) == 1);
+        for (int i = 0; i < NPAGES; i++)
+            assert(pages[i * PAGE_SIZE] == 'c');
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(read(to_parent[0], &c, 1) == 1);
+    for (int i = 0; i < NPAGES; i++) {
+        assert(pages[i * PAGE_SIZE] == 'p');
+        pages[i * PAGE_SIZE] = 'P';
+    }
+    assert(write(to_child[1], "w", 1) == 1);
+    int status = -1;
+    assert(wait(&status) == pid && status == 0);
+    for (int i = 0; i < NPAGES; i++)
+        assert(pages[i * PAGE_SIZE] == 'P');
+
+    close(to_child[0]);
+    close(to_child[1]);
+    close(to_parent[0]);
+    close(to_parent[1]);
+}
+
+// The kernel's copyout() into a shared page copies it first
+static void kernel_write(char* pages) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    memset(pages, 0, PAGE_SIZE);
+
+    int pid = fork();
+    if (pid == 0) {
+        // The page is still shared, only read() writes it
+        assert(read(fds[0], pages, sizeof(message)) == sizeof(message));
+        assert(strcmp(pages, message) == 0);
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(write(fds[1], message, sizeof(message)) == sizeof(message));
+    int status = -1;
+    assert(wait(&status) == pid && status == 0);
+    for (int i = 0; i < sizeof(message); i++)
+        assert(pages[i] == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Once the child is gone, the parent writes its pages without a copy.
+// Runs with all free memory taken, where a copy would fail and kill us.
+static void last_sharer(char* pages) {
+    for (int i = 0; i < NPAGES; i++)
+        pages[i * PAGE_SIZE] = 's';
+    int pid = fork();
+    if (pid == 0)
+        exit(0);
+    assert(pid > 0);
+    int status = -1;
+    assert(wait(&status) == pid && status == 0);
+
+    // Nothing is asserted until the memory is given back
+    int hogged = 0;
+    for (int chunk = HOG_CHUNK; chunk >= PAGE_SIZE; chunk /= 2) {
+        while (sbrk(chunk) != (char*)-1)
+            hogged += chunk;
+    }
+    for (int i = 0; i < NPAGES; i++)
+        pages[i * PAGE_SIZE] = 'S';
+    sbrk(-hogged);
+
+    assert(hogged > 0);
+    for (int i = 0; i < NPAGES; i++)
+        assert(pages[i * PAGE_SIZE] == 'S');
+}
+
+void main(int argc, char** argv) {
+    char* pages = sbrk(NPAGES * PAGE_SIZE);
+    assert(pages != (char*)-1);
+
+    isolation(pages);
+    kernel_write(pages);
+
+    // In a child, a copy that fails for lack of memory kills it
+    int pid = fork();
+    if (pid == 0) {
+        last_sharer(pages);
+        exit(0);
+    }
+    assert(pid > 0);
+    int status = -1;
+    assert(wait(&status) == pid);
+    assert(status == 0);
+
+    exit(0);
+}
@@ -0,0 +1,53 @@
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "assert.h"
+
+// Spans several pages of .data, nothing touches them before the checks
+int table[3 * 1024] = {[0] = 1, [1024] = 2, [3 * 1024 - 1] = 3};
+// Spans several pages of .bss
+char buffer[3 * 4096];
+const char message[] = "program pages are loaded on first touch";
+
+void main(int argc, char** argv) {
+    if (argc > 1) {
+        // Re-executed copy, its pages come from the same file
+        assert(table[3 * 1024 - 1] == 3);
+        exit(0);
+    }
+
+    // Kernel copies from untouched rodata, into untouched bss, under a pipe lock
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], message, sizeof(message)) == sizeof(message));
+    assert(read(fds[0], buffer + 2 * 4096, sizeof(message)) == sizeof(message));
+    assert(strcmp(buffer + 2 * 4096, message) == 0);
+
+    // A child loads the pages the parent didn't touch
+    int pid = fork();
+    if (pid == 0) {
+        assert(table[1024] == 2);
+        table[1024] = 5;
+        exit(0);
+    }
+    int status = -1;
+    assert(wait(&status) == pid && status == 0);
+    assert(table[1024] == 2 && table[0] == 1);
+
+    // Reading a file into an untouched data page
+    int fd = open("exec-test-lazy", O_RDONLY);
+    assert(fd >= 0);
+    assert(read(fd, &table[2 * 1024], 4) == 4);
+
+    // Program text is read-only, even for the kernel
+    assert(read(fd, (void*) main, 4) == -1);
+    close(fd);
+
+    char* args[] = {"exec-test-lazy", "again", 0};
+    pid = fork();
+    if (pid == 0) {
+        exec(args[0], args);
+        exit(1);
+    }
+    assert(wait(&status) == pid && status == 0);
+    exit(0);
+}
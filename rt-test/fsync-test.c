@@ -0,0 +1,41 @@
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "assert.h"
+
+/**
+ * Test waits for writes to reach the disk with fsync, while other processes keep writing
+*/
+
+char buffer[1024];
+
+void writer(char* path) {
+    int fd = open(path, O_CREATE | O_RDWR);
+    assert(fd >= 0);
+    for (int i = 0; i < 20; i++) {
+        assert(write(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+        if (i % 5 == 0)
+            assert(fsync(fd) == 0);
+    }
+    close(fd);
+    assert(unlink(path) == 0);
+}
+
+void main(int argc, char** argv) {
+    assert(fsync(-1) == -1);
+    assert(fsync(50) == -1);
+
+    memset(buffer, 'x', sizeof(buffer));
+    int pid = fork();
+    writer(pid == 0 ? "fsync-child" : "fsync-parent");
+    if (pid == 0)
+        exit(0);
+    int status = -1;
+    assert(wait(&status) == pid && status == 0);
+
+    // Nothing left to commit returns right away
+    int fd = open("fsync-test", O_RDONLY);
+    assert(fd >= 0);
+    assert(fsync(fd) == 0);
+    close(fd);
+    exit(0);
+}
@@ -0,0 +1,64 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "user/futex.h"
+#include "uk-shared/error_codes.h"
+#include "assert.h"
+
+/**
+ * Test uses more mutexes than the old fixed futex table held, at offsets
+ * inside a shared page, from several processes at once
+*/
+
+#define NMUTEX 100
+#define NPROC 4
+#define ROUNDS 200
+
+struct counter {
+    osdev_mutex_t mutex;
+    uint64 value;
+};
+
+void main(int argc, char** argv) {
+    struct counter* counters = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    assert(counters != MAP_FAILED);
+    assert(sizeof(struct counter) * NMUTEX <= PAGE_SIZE);
+    for (int i = 0; i < NMUTEX; i++) {
+        osdev_mutex_init(&counters[i].mutex);
+        counters[i].value = 0;
+    }
+
+    // Unaligned words are rejected, a changed word returns right away
+    assert(futex_wait((uint64*)((char*)&counters[1].value + 1), 0) == EINVAL);
+    counters[1].value = 1;
+    assert(futex_wait(&counters[1].value, 0) == 0);
+    counters[1].value = 0;
+    // Waking a futex nobody waits on is fine
+    assert(futex_wake(&counters[2].value, 1, 0) == 0);
+
+    for (int p = 0; p < NPROC; p++) {
+        if (fork() == 0) {
+            for (int r = 0; r < ROUNDS; r++) {
+                struct counter* c = &counters[(r * 7 + p) % NMUTEX];
+                osdev_mutex_lock(&c->mutex);
+                uint64 v = c->value;
+                // Give the others a chance to run into the lock
+                if (r % 16 == 0)
+                    sleep(1);
+                c->value = v + 1;
+                osdev_mutex_unlock(&c->mutex);
+            }
+            exit(0);
+        }
+    }
+    for (int p = 0; p < NPROC; p++) {
+        int status = -1;
+        assert(wait(&status) > 0 && status == 0);
+    }
+
+    uint64 total = 0;
+    for (int i = 0; i < NMUTEX; i++)
+        total += counters[i].value;
+    assert(total == NPROC * ROUNDS);
+    assert(munmap(counters, PAGE_SIZE) == 0);
+    exit(0);
+}
@@ -0,0 +1,89 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "uk-shared/error_codes.h"
+#include "assert.h"
+
+/**
+ * Test waits with timeouts, requeues waiters from one futex to another
+ * and wakes them with futex_wake_op
+*/
+
+#define NCHILD 3
+
+struct shared {
+    uint64 a;
+    uint64 b;
+    uint64 arrived;
+    uint64 woken;
+};
+
+// Waits until n children arrived at their futex_wait, then a while longer
+void wait_arrived(struct shared* s, uint64 n) {
+    while (__atomic_load_n(&s->arrived, __ATOMIC_SEQ_CST) < n)
+        sleep(1);
+    sleep(2);
+}
+
+void child_wait(struct shared* s, uint64* word) {
+    __atomic_fetch_add(&s->arrived, 1, __ATOMIC_SEQ_CST);
+    assert(futex_wait(word, 0) == 0);
+    __atomic_fetch_add(&s->woken, 1, __ATOMIC_SEQ_CST);
+    exit(0);
+}
+
+void reap(int n) {
+    for (int i = 0; i < n; i++) {
+        int status = -1;
+        assert(wait(&status) > 0 && status == 0);
+    }
+}
+
+void main(int argc, char** argv) {
+    struct shared* s = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    assert(s != MAP_FAILED);
+    memset(s, 0, sizeof(*s));
+
+    // Timeouts
+    int start = uptime();
+    assert(futex_timedwait(&s->a, 0, 3) == ETIMEDOUT);
+    assert(uptime() - start >= 3);
+    assert(futex_timedwait(&s->a, 1, 3) == 0);
+    assert(futex_timedwait(&s->a, 0, 0) == ETIMEDOUT);
+
+    // Requeue all but one waiter from a to b, nobody wakes on a afterwards
+    for (int i = 0; i < NCHILD; i++)
+        if (fork() == 0)
+            child_wait(s, &s->a);
+    wait_arrived(s, NCHILD);
+    assert(futex_requeue(&s->a, 1, &s->b, NCHILD, 1) == EAGAIN);
+    assert(futex_requeue(&s->a, 1, &s->b, NCHILD, 0) == 0);
+    sleep(2);
+    assert(s->woken == 1);
+    assert(futex_wake(&s->a, NCHILD, 0) == 0);
+    sleep(2);
+    assert(s->woken == 1);
+    assert(futex_wake(&s->b, NCHILD, FUTEX_YIELD) == 0);
+    reap(NCHILD);
+    assert(s->woken == NCHILD);
+
+    // wake_op sets b and wakes its waiter because the old value was 0
+    s->arrived = 0;
+    s->woken = 0;
+    s->b = 0;
+    if (fork() == 0)
+        child_wait(s, &s->b);
+    wait_arrived(s, 1);
+    assert(futex_wake_op(&s->a, 1, &s->b, 1, FUTEX_OP(FUTEX_OP_ADD, 5, FUTEX_OP_CMP_NE, 0)) == 0);
+    sleep(2);
+    assert(s->b == 5 && s->woken == 0);
+    assert(futex_wake_op(&s->a, 1, &s->b, 1, FUTEX_OP(FUTEX_OP_SET, -1, FUTEX_OP_CMP_EQ, 5)) == 0);
+    reap(1);
+    assert(s->b == (uint64)-1 && s->woken == 1);
+
+    // Unaligned words and invalid ops are rejected
+    assert(futex_wake_op(&s->a, 1, (uint64*)((char*)&s->b + 4), 1, 0) == EINVAL);
+    assert(futex_wake_op(&s->a, 1, &s->b, 1, FUTEX_OP(7, 0, 0, 0)) == EINVAL);
+
+    assert(munmap(s, PAGE_SIZE) == 0);
+    exit(0);
+}
@@ -0,0 +1,53 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "assert.h"
+
+#define HUGE_PAGE_SIZE (512 * PAGE_SIZE)
+
+void main (int arg, char** argv) {
+
+    // Length and address must be megapage aligned, shared huge mappings are not supported
+    assert(mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) == MAP_FAILED);
+    assert(mmap(NULL, HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0) == MAP_FAILED);
+
+    char* huge = mmap(NULL, 2 * HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    assert(huge != MAP_FAILED);
+    assert((uint64) huge % HUGE_PAGE_SIZE == 0);
+
+    // Megapages come zeroed and span both halves
+    assert(huge[0] == 0 && huge[2 * HUGE_PAGE_SIZE - 1] == 0);
+    huge[0] = 33;
+    huge[HUGE_PAGE_SIZE + 5] = 44;
+
+    // Small mappings don't land on top of a megapage
+    char* small = mmap(huge, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(small != MAP_FAILED);
+    assert(small < huge || small >= huge + 2 * HUGE_PAGE_SIZE);
+
+    // Kernel copies in and out of megapages work
+    int fds[2];
+    assert(pipe(fds) == 0);
+    assert(write(fds[1], huge, 1) == 1);
+    assert(read(fds[0], huge + 100, 1) == 1);
+    assert(huge[100] == 33);
+
+    int pid = fork();
+    if (pid == 0) {
+        // Child has its own copy
+        assert(huge[0] == 33 && huge[HUGE_PAGE_SIZE + 5] == 44);
+        huge[0] = 5;
+        // Partial unmaps of a megapage fail
+        assert(munmap(huge, PAGE_SIZE) != 0);
+        assert(munmap(huge, HUGE_PAGE_SIZE) == 0);
+        exit(0);
+    }
+
+    int status = -1;
+    wait(&status);
+    assert(status == 0);
+    assert(huge[0] == 33);
+
+    assert(munmap(huge, 2 * HUGE_PAGE_SIZE) == 0);
+    assert(munmap(small, PAGE_SIZE) == 0);
+    exit(0);
+}
@@ -0,0 +1,48 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "kernel/fcntl.h"
+#include "assert.h"
+
+/**
+ * Shared file mappings map the page cache page, so read() and write()
+ * see the same bytes as the mapping before it is unmapped
+*/
+
+char buffer[2 * PAGE_SIZE];
+
+void main(int argc, char** argv) {
+    int fd = open("pcache-file", O_CREATE | O_RDWR);
+    assert(fd >= 0);
+    memset(buffer, 'a', sizeof(buffer));
+    assert(write(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+
+    char* map = mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(map != MAP_FAILED);
+    assert(map[0] == 'a' && map[2 * PAGE_SIZE - 1] == 'a');
+
+    // Stores through the mapping are visible to read()
+    map[PAGE_SIZE + 7] = 'b';
+    int fd2 = open("pcache-file", O_RDONLY);
+    assert(fd2 >= 0);
+    assert(read(fd2, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(buffer[PAGE_SIZE + 7] == 'b' && buffer[PAGE_SIZE + 6] == 'a');
+
+    // write() is visible through the mapping
+    int fd3 = open("pcache-file", O_WRONLY);
+    assert(fd3 >= 0);
+    assert(write(fd3, "cc", 2) == 2);
+    assert(map[0] == 'c' && map[1] == 'c' && map[2] == 'a');
+
+    // Unmapping writes the page back, a new mapping sees it
+    assert(munmap(map, 2 * PAGE_SIZE) == 0);
+    map = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, PAGE_SIZE);
+    assert(map != MAP_FAILED);
+    assert(map[7] == 'b');
+    munmap(map, PAGE_SIZE);
+
+    close(fd);
+    close(fd2);
+    close(fd3);
+    unlink("pcache-file");
+    exit(0);
+}
@@ -0,0 +1,87 @@
+#include "kernel/param.h"
+#include "user/user.h"
+#include "assert.h"
+
+// Background hogs, more than harts
+#define NHOGS 6
+// Sleeps of the interactive child, each may wait about a tick for a cpu
+#define ROUNDS 10
+// Slowdown of the interactive child allowed under the hogs
+#define MAX_SLOWDOWN 4
+
+// Ticks a child takes for ROUNDS short sleeps, -1 on failure
+static int interactive(void) {
+    int status = -1;
+    int pid = fork();
+    if (pid == 0) {
+        int start = uptime();
+        for (int i = 0; i < ROUNDS; i++)
+            sleep(1);
+        exit(uptime() - start);
+    }
+    if (pid < 0 || wait(&status) != pid)
+        return -1;
+    return status;
+}
+
+void main(int argc, char** argv) {
+    // Own priority can be changed with pid 0 and with our own pid
+    assert(setpriority(0, NPRIO - 1) == 0);
+    assert(setpriority(getpid(), 0) == 0);
+
+    // Out of range levels and unknown pids are rejected
+    assert(setpriority(0, NPRIO) == -1);
+    assert(setpriority(0, -1) == -1);
+    assert(setpriority(-5, 0) == -1);
+
+    // A child inherits the base priority, low priority children still finish
+    assert(setpriority(0, NPRIO - 1) == 0);
+    int pid = fork();
+    if (pid == 0) {
+        volatile uint64 spin = 0;
+        for (int i = 0; i < 1000000; i++)
+            spin += i;
+        exit(0);
+    }
+    assert(pid > 0);
+    assert(setpriority(pid, NPRIO - 1) == 0);
+    assert(setpriority(0, 0) == 0);
+
+    int status = -1;
+    assert(wait(&status) == pid);
+    assert(status == 0);
+
+    // A short interactive child isn't held up by low priority hogs
+    int idle = interactive();
+    assert(idle >= 0);
+
+    // Nothing is asserted while the hogs run, so they are always reaped
+    int hogs[NHOGS];
+    int nhogs = 0;
+    int ok = 1;
+    for (; nhogs < NHOGS; nhogs++) {
+        hogs[nhogs] = fork();
+        if (hogs[nhogs] == 0) {
+            for (;;)
+                ;
+        }
+        if (hogs[nhogs] < 0) {
+            ok = 0;
+            break;
+        }
+        if (setpriority(hogs[nhogs], NPRIO - 1) != 0)
+            ok = 0;
+    }
+    int loaded = ok ? interactive() : -1;
+    for (int i = 0; i < nhogs; i++) {
+        if (kill(hogs[i]) != 0 || wait(0) < 0)
+            ok = 0;
+    }
+
+    printf("interactive child: %d sleeps in %d ticks, %d without hogs\n", ROUNDS, loaded, idle);
+    assert(ok);
+    assert(loaded >= 0);
+    assert(loaded <= MAX_SLOWDOWN * (idle > ROUNDS ? idle : ROUNDS));
+
+    exit(0);
+}
@@ -0,0 +1,89 @@
+#include "user/user.h"
+#include "user/mmap.h"
+#include "user/sync.h"
+#include "assert.h"
+
+/**
+ * Test uses the futex based sync primitives from several processes
+*/
+
+#define NPROC 3
+#define ROUNDS 50
+
+struct shared {
+    osdev_mutex_t mutex;
+    osdev_cond_t cond;
+    osdev_rwlock_t rwlock;
+    osdev_sem_t sem;
+    osdev_barrier_t barrier;
+    uint64 ready;
+    uint64 serial;
+    uint64 readers;
+    uint64 counter;
+};
+
+void child(struct shared* s) {
+    // Wait on the condition until the parent says go
+    osdev_mutex_lock(&s->mutex);
+    while (!s->ready)
+        osdev_cond_wait(&s->cond, &s->mutex);
+    osdev_mutex_unlock(&s->mutex);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        // Exactly one proc per round is told it was the last
+        if (osdev_barrier_wait(&s->barrier))
+            __atomic_fetch_add(&s->serial, 1, __ATOMIC_SEQ_CST);
+
+        osdev_sem_wait(&s->sem);
+        s->counter++;
+        osdev_sem_post(&s->sem);
+
+        osdev_rwlock_wrlock(&s->rwlock);
+        assert(s->readers == 0);
+        osdev_rwlock_unlock(&s->rwlock);
+
+        osdev_rwlock_rdlock(&s->rwlock);
+        __atomic_fetch_add(&s->readers, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_sub(&s->readers, 1, __ATOMIC_SEQ_CST);
+        osdev_rwlock_unlock(&s->rwlock);
+    }
+    exit(0);
+}
+
+void main(int argc, char** argv) {
+    struct shared* s = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+    assert(s != MAP_FAILED);
+    osdev_mutex_init(&s->mutex);
+    osdev_cond_init(&s->cond);
+    osdev_rwlock_init(&s->rwlock);
+    osdev_sem_init(&s->sem, 1);
+    osdev_barrier_init(&s->barrier, NPROC);
+    s->ready = 0;
+    s->serial = 0;
+    s->readers = 0;
+    s->counter = 0;
+
+    // Semaphore counts
+    assert(osdev_sem_trywait(&s->sem));
+    assert(!osdev_sem_trywait(&s->sem));
+    osdev_sem_post(&s->sem);
+
+    for (int i = 0; i < NPROC; i++)
+        if (fork() == 0)
+            child(s);
+
+    sleep(2);
+    osdev_mutex_lock(&s->mutex);
+    s->ready = 1;
+    osdev_cond_broadcast(&s->cond, &s->mutex);
+    osdev_mutex_unlock(&s->mutex);
+
+    for (int i = 0; i < NPROC; i++) {
+        int status = -1;
+        assert(wait(&status) > 0 && status == 0);
+    }
+    assert(s->serial == ROUNDS);
+    assert(s->counter == NPROC * ROUNDS);
+    assert(munmap(s, PAGE_SIZE) == 0);
+    exit(0);
+}
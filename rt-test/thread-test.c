@@ -0,0 +1,117 @@
+#include "user/user.h"
+#include "uk-shared/error_codes.h"
+#include "user/sync.h"
+#include "assert.h"
+
+/**
+ * Test runs threads of one process on several harts
+*/
+
+#define NTHREADS 4
+#define ROUNDS 1000
+#define STACK_SIZE 4096
+
+char stacks[NTHREADS + 2][STACK_SIZE];
+osdev_mutex_t mutex;
+uint64 counter;
+int fds[2];
+int tid_a, tid_b;
+
+int count(void* arg) {
+    for (int i = 0; i < ROUNDS; i++) {
+        osdev_mutex_lock(&mutex);
+        counter++;
+        osdev_mutex_unlock(&mutex);
+    }
+    // Open files are shared
+    char c = 'a' + (uint64)arg;
+    assert(write(fds[1], &c, 1) == 1);
+    return (uint64)arg;
+}
+
+int join_b(void* arg) {
+    int status = -1;
+    assert(thread_join(tid_b, &status) == 0);
+    assert(status == 7);
+    return 0;
+}
+
+int join_a(void* arg) {
+    // a waits for us by now
+    sleep(2);
+    assert(thread_join(tid_a, 0) == ECIRC);
+    return 7;
+}
+
+int spin(void* arg) {
+    for (;;)
+        ;
+}
+
+int exit_all(void* arg) {
+    exit(3);
+}
+
+void main(int argc, char** argv) {
+    osdev_mutex_init(&mutex);
+    assert(pipe(fds) == 0);
+
+    int tids[NTHREADS];
+    for (uint64 i = 0; i < NTHREADS; i++) {
+        tids[i] = thread_create(count, (void*)i, stacks[i], STACK_SIZE);
+        assert(tids[i] > 0);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        int status = -1;
+        assert(thread_join(tids[i], &status) == 0);
+        assert(status == i);
+    }
+    assert(counter == NTHREADS * ROUNDS);
+    int seen = 0;
+    for (int i = 0; i < NTHREADS; i++) {
+        char c;
+        assert(read(fds[0], &c, 1) == 1);
+        seen |= 1 << (c - 'a');
+    }
+    assert(seen == (1 << NTHREADS) - 1);
+
+    // Joined threads are gone, the caller is no thread to join
+    assert(thread_join(tids[0], 0) == EINVAL);
+    assert(thread_join(getpid(), 0) == EINVAL);
+
+    // Only one thread waits for another, never in a circle
+    tid_b = thread_create(join_a, 0, stacks[NTHREADS + 1], STACK_SIZE);
+    tid_a = thread_create(join_b, 0, stacks[NTHREADS], STACK_SIZE);
+    assert(tid_a > 0 && tid_b > 0);
+    sleep(1);
+    assert(thread_join(tid_b, 0) == ENOJOIN);
+    int status = -1;
+    assert(thread_join(tid_a, &status) == 0);
+    assert(status == 0);
+
+    // The other threads would lose their memory
+    tid_a = thread_create(spin, 0, stacks[0], STACK_SIZE);
+    assert(tid_a > 0);
+    char* args[] = {"echo", 0};
+    assert(exec("echo", args) == -1);
+
+    // Exiting ends the threads that still run
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(thread_create(spin, 0, stacks[1], STACK_SIZE) > 0);
+        exit(0);
+    }
+    assert(wait(&status) == pid && status == 0);
+
+    // exit() in a thread ends the whole process with its status
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        assert(thread_create(exit_all, 0, stacks[1], STACK_SIZE) > 0);
+        for (;;)
+            sleep(10);
+    }
+    assert(wait(&status) == pid && status == 3);
+    exit(0);
+}
@@ -0,0 +1,103 @@
+#include "user/user.h"
+#include "user/uthreads.h"
+#include "uk-shared/error_codes.h"
+#include "assert.h"
+
+/**
+ * Test runs more user threads than workers, preempts them and
+ * keeps threads running while others block in the kernel
+*/
+
+#define NTHREADS 64
+#define NSPIN (UTHREADS_WORKERS + 2)
+#define STACK_SIZE 4096
+
+int counter;
+int started;
+int go;
+int fds[2];
+thread_id tid_a, tid_b;
+
+void* count(void* arg) {
+    __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+    uthreads_yield();
+    return arg;
+}
+
+// Never yields, only preemption lets the others run
+void* spin(void* arg) {
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&go, __ATOMIC_SEQ_CST))
+        ;
+    return 0;
+}
+
+void* block(void* arg) {
+    char c;
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    assert(read(fds[0], &c, 1) == 1);
+    return 0;
+}
+
+void* join_b(void* arg) {
+    void* retval = 0;
+    assert(uthreads_join(tid_b, &retval) == 0);
+    assert(retval == (void*)7);
+    return 0;
+}
+
+void* join_a(void* arg) {
+    // a waits for us by now
+    while (uthreads_state(tid_b) == 0)
+        uthreads_yield();
+    assert(uthreads_join(tid_a, 0) == ECIRC);
+    return (void*)7;
+}
+
+int main(int argc, char** argv) {
+    // More threads than the old fixed table
+    thread_id tids[NTHREADS];
+    for (uint64 i = 0; i < NTHREADS; i++) {
+        tids[i] = uthreads_create(count, (void*)i, STACK_SIZE);
+        assert(tids[i] > 0);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        void* retval = 0;
+        assert(uthreads_join(tids[i], &retval) == 0);
+        assert(retval == (void*)(uint64)i);
+    }
+    assert(counter == NTHREADS);
+    assert(uthreads_state(tids[0]) == EEXIST);
+    assert(uthreads_state(tids[NTHREADS - 1] + 1) == EINVAL);
+    assert(uthreads_join(0, 0) == EINVAL);
+
+    // Spinners take all workers and still let main run
+    for (int i = 0; i < NSPIN; i++)
+        assert((tids[i] = uthreads_create(spin, 0, STACK_SIZE)) > 0);
+    while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < NSPIN)
+        ;
+    __atomic_store_n(&go, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < NSPIN; i++)
+        assert(uthreads_join(tids[i], 0) == 0);
+
+    // Threads blocked in read() don't hold up the others
+    assert(pipe(fds) == 0);
+    started = 0;
+    for (int i = 0; i < UTHREADS_WORKERS; i++)
+        assert((tids[i] = uthreads_create(block, 0, STACK_SIZE)) > 0);
+    while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < UTHREADS_WORKERS)
+        uthreads_yield();
+    assert(write(fds[1], "abcdefgh", UTHREADS_WORKERS) == UTHREADS_WORKERS);
+    for (int i = 0; i < UTHREADS_WORKERS; i++)
+        assert(uthreads_join(tids[i], 0) == 0);
+
+    // Only one thread waits for another, never in a circle
+    tid_b = uthreads_create(join_a, 0, STACK_SIZE);
+    tid_a = uthreads_create(join_b, 0, STACK_SIZE);
+    assert(tid_a > 0 && tid_b > 0);
+    while (uthreads_state(tid_b) == 0)
+        uthreads_yield();
+    assert(uthreads_join(tid_b, 0) == ENOJOIN);
+    assert(uthreads_join(tid_a, 0) == 0);
+    return 0;
+}
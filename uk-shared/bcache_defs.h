@@ -0,0 +1,25 @@
+/*! \file bcache_defs.h
+ * \brief buffer cache statistics shared by the bcachectl system call
+ */
+
+#ifndef INCLUDED_shared_bcache_defs_h
+#define INCLUDED_shared_bcache_defs_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct bcache_info {
+  uint64 nbuf;      // buffers allocated right now
+  uint64 target;    // buffers the cache may grow to while memory is plentiful
+  uint64 minbuf;    // buffers the cache never shrinks below
+  uint64 hits;
+  uint64 misses;
+  uint64 evictions;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
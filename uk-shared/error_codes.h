@@ -19,6 +19,8 @@ extern "C" {
 #define EBADF   0x6   // Bad file descriptor
 #define ECIRC   0x7   // Circular wait 
 #define ENOJOIN 0x8 // Thread not joinable
+#define ETIMEDOUT 0x9 // Timeout expired before the wait ended
+#define EAGAIN  0xA   // Value changed, try again
 
 
 #ifdef __cplusplus
@@ -0,0 +1,38 @@
+/*! \file futex_defs.h
+ * \brief flags and operations of the futex system calls
+ */
+
+#ifndef INCLUDED_shared_futex_defs_h
+#define INCLUDED_shared_futex_defs_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* futex_wake() flags */
+#define FUTEX_YIELD      0x1   // Give up the cpu if a waiter was woken
+
+/* Operations futex_wake_op() applies to the second futex word */
+#define FUTEX_OP_SET     0     // word = oparg
+#define FUTEX_OP_ADD     1     // word += oparg
+#define FUTEX_OP_OR      2     // word |= oparg
+#define FUTEX_OP_ANDN    3     // word &= ~oparg
+#define FUTEX_OP_XOR     4     // word ^= oparg
+
+/* Comparisons of the old word with cmparg, waiters on the second futex are woken if true */
+#define FUTEX_OP_CMP_EQ  0
+#define FUTEX_OP_CMP_NE  1
+#define FUTEX_OP_CMP_LT  2
+#define FUTEX_OP_CMP_LE  3
+#define FUTEX_OP_CMP_GT  4
+#define FUTEX_OP_CMP_GE  5
+
+// Encodes the op argument of futex_wake_op(), oparg and cmparg are 12 bit signed
+#define FUTEX_OP(op, oparg, cmp, cmparg) \
+    ((((op) & 0xf) << 28) | (((cmp) & 0xf) << 24) | (((oparg) & 0xfff) << 12) | ((cmparg) & 0xfff))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
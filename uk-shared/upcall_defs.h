@@ -0,0 +1,57 @@
+/*! \file upcall_defs.h
+ * \brief register frame shared by the upcall system calls
+ */
+
+#ifndef INCLUDED_shared_upcall_defs_h
+#define INCLUDED_shared_upcall_defs_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * User registers at the time an upcall interrupted the program.
+ * The kernel pushes it onto the user stack and passes it to the handler,
+ * upcall_return() resumes the program with it and lets the next upcall in.
+ * The registers are in the order of struct trapframe, ra to t6.
+*/
+struct upcall_frame {
+  uint64 ra;
+  uint64 sp;
+  uint64 gp;
+  uint64 tp;
+  uint64 t0;
+  uint64 t1;
+  uint64 t2;
+  uint64 s0;
+  uint64 s1;
+  uint64 a0;
+  uint64 a1;
+  uint64 a2;
+  uint64 a3;
+  uint64 a4;
+  uint64 a5;
+  uint64 a6;
+  uint64 a7;
+  uint64 s2;
+  uint64 s3;
+  uint64 s4;
+  uint64 s5;
+  uint64 s6;
+  uint64 s7;
+  uint64 s8;
+  uint64 s9;
+  uint64 s10;
+  uint64 s11;
+  uint64 t3;
+  uint64 t4;
+  uint64 t5;
+  uint64 t6;
+  uint64 epc;    // pc the program was interrupted at
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
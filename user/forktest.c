@@ -3,7 +3,7 @@
 
 #include "user/user.h"
 
-#define N  1000
+#define N  5000
 
 void
 print(const char *s)
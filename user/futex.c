@@ -9,7 +9,7 @@ enum osdev_mutex_lock_state {
 };
 
 void osdev_mutex_init(osdev_mutex_t *mutex) {
-    futex_init((uint64*)&mutex->inner);
+    // The kernel creates wait queues on demand, no futex_init needed
     atomic_store(&mutex->inner, LOCK_FREE);
 }
 
@@ -20,17 +20,24 @@ void osdev_mutex_init(osdev_mutex_t *mutex) {
 void osdev_mutex_lock(osdev_mutex_t *mutex) {
     osdev_mutex_inner_t lock_state = LOCK_FREE;
     // Check if lock state is != LOCK_FREE (means !atomic_OP, (returns true if inner == state))
-    if (!atomic_compare_exchange_strong_explicit(&mutex->inner, &lock_state, LOCK_TAKEN, memory_order_acquire, memory_order_acquire)) {
-        // If lock is not FREE && not WAITING (means lock_state == LOCK_TAKEN) set to Waiting
-        if (lock_state != LOCK_WAITING) {
-            lock_state = atomic_exchange_explicit(&mutex->inner, LOCK_WAITING, memory_order_acquire);
-        }
-        // If lock_state is either TAKEN or WAITING, wait, set lock to waiting after wait
-        while (lock_state != LOCK_FREE) {
-            futex_wait((uint64*)&mutex->inner, LOCK_WAITING); // uses stub rn
-            lock_state = atomic_exchange_explicit(&mutex->inner, LOCK_WAITING, memory_order_acquire);
-        }
+    if (atomic_compare_exchange_strong_explicit(&mutex->inner, &lock_state, LOCK_TAKEN, memory_order_acquire, memory_order_acquire))
+        return;
+
+    // Holders usually keep the lock briefly, spin a while before going to sleep.
+    // Nobody sleeps yet, so only spin while the lock is TAKEN, not WAITING.
+    for (int i = 0; i < MAX_SPINCOUNT && lock_state == LOCK_TAKEN; i++) {
+        lock_state = atomic_load_explicit(&mutex->inner, memory_order_relaxed);
+        if (lock_state == LOCK_FREE
+            && atomic_compare_exchange_weak_explicit(&mutex->inner, &lock_state, LOCK_TAKEN, memory_order_acquire, memory_order_relaxed))
+            return;
     }
+    osdev_mutex_lock_contended(mutex);
+}
+
+void osdev_mutex_lock_contended(osdev_mutex_t *mutex) {
+    // Set to WAITING, if it was FREE we have it now, else wait and try again
+    while (atomic_exchange_explicit(&mutex->inner, LOCK_WAITING, memory_order_acquire) != LOCK_FREE)
+        futex_wait((uint64*)&mutex->inner, LOCK_WAITING);
 }
 
 //! unlock mutex
@@ -40,7 +47,7 @@ void osdev_mutex_unlock(osdev_mutex_t *mutex) {
         // Not atomic in the original but why shouldn't it be?
         atomic_store_explicit(&mutex->inner, LOCK_FREE, memory_order_release);
         //atomic_store_explicit(&mutex->inner, LOCK_FREE, memory_order_release);
-        futex_wake((uint64*)&mutex->inner, 1); // Only wakes a single sleeper
+        futex_wake((uint64*)&mutex->inner, 1, 0); // Only wakes a single sleeper, keeps the cpu
     }
 }
 
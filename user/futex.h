@@ -27,7 +27,8 @@ extern "C" {
 #endif
 #include "user/sutex.h"
 
-#define MAX_SPINCOUNT 10000
+//! times osdev_mutex_lock() looks at a taken lock before it sleeps
+#define MAX_SPINCOUNT 1000
 
 struct osdev_mutex_t;
 //! having fun with linkage...
@@ -44,14 +45,19 @@ struct osdev_mutex_t {
 
 //! initialize mutex
 void osdev_mutex_init(osdev_mutex_t *mutex);
-//! lock mutex
+//! lock mutex, spins a while before it sleeps
 void osdev_mutex_lock(osdev_mutex_t *mutex);
+//! lock mutex without spinning, marks it contended so the unlock wakes a waiter
+void osdev_mutex_lock_contended(osdev_mutex_t *mutex);
 //! unlock mutex
 void osdev_mutex_unlock(osdev_mutex_t *mutex);
 
 //! try lock mutex
 bool osdev_mutex_trylock(osdev_mutex_t *mutex);
 
+//! taken by malloc() and free(), see malloc_lock()
+extern osdev_mutex_t malloc_mutex;
+
 #ifdef __cplusplus
 }
 #endif
@@ -85,6 +85,73 @@ int fork1(void) {
   return pid;
 }
 
+// Whether cmd only consists of commands, redirections and pipes,
+// so spawncmd() can start it without forking the shell first.
+int spawnable(struct cmd *cmd) {
+  struct pipecmd *pcmd;
+
+  switch (cmd->type) {
+  case EXEC: return ((struct execcmd *)cmd)->argv[0] != 0;
+  case REDIR: return spawnable(((struct redircmd *)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  default: return 0;
+  }
+}
+
+// Start cmd with spawn() instead of fork() and exec().
+// fdmap holds the shell's fds that become fds 0-2 of the commands.
+// Returns the number of started processes, the caller waits for them.
+int spawncmd(struct cmd *cmd, int *fdmap) {
+  int p[2], n, fd;
+  int map[3];
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch (cmd->type) {
+  default: panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd *)cmd;
+    if (spawn(ecmd->argv[0], ecmd->argv, fdmap, 3) < 0) {
+      fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd *)cmd;
+    if ((fd = open(rcmd->file, rcmd->mode)) < 0) {
+      fprintf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    memmove(map, fdmap, sizeof(map));
+    map[rcmd->fd] = fd;
+    n = spawncmd(rcmd->cmd, map);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    if (pipe(p) < 0) {
+      fprintf(2, "pipe failed\n");
+      return 0;
+    }
+    map[0] = fdmap[0];
+    map[1] = p[1];
+    map[2] = fdmap[2];
+    n = spawncmd(pcmd->left, map);
+    map[0] = p[0];
+    map[1] = fdmap[1];
+    n += spawncmd(pcmd->right, map);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+}
+
 //PAGEBREAK!
 // Constructors
 
@@ -142,9 +209,54 @@ struct cmd *backcmd(struct cmd *subcmd) {
   cmd->cmd  = subcmd;
   return (struct cmd *)cmd;
 }
+
+// Free cmd and all its subcommands.
+void freecmd(struct cmd *cmd) {
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if (cmd == 0) return;
+
+  switch (cmd->type) {
+  case REDIR:
+    rcmd = (struct redircmd *)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd *)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd *)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
 //PAGEBREAK!
 // Parsing
 
+// Set once parsing the current line failed.
+static int parseerror;
+
+// Report a malformed line. Parsing goes on with what
+// was read so far, parsecmd() then returns 0.
+static void syntax(char *s) {
+  if (!parseerror) fprintf(2, "%s\n", s);
+  parseerror = 1;
+}
+
 char whitespace[] = " \t\r\n\v";
 char symbols[]    = "<|>&;()";
 
@@ -201,12 +313,17 @@ struct cmd *parsecmd(char *s) {
   char *es;
   struct cmd *cmd;
 
+  parseerror = 0;
   es  = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if (s != es) {
+  if (s != es && !parseerror) {
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if (parseerror) {
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -244,7 +361,10 @@ struct cmd *parseredirs(struct cmd *cmd, char **ps, char *es) {
 
   while (peek(ps, es, "<>")) {
     tok = gettoken(ps, es, 0, 0);
-    if (gettoken(ps, es, &q, &eq) != 'a') panic("missing file for redirection");
+    if (gettoken(ps, es, &q, &eq) != 'a') {
+      syntax("missing file for redirection");
+      break;
+    }
     switch (tok) {
     case '<': cmd = redircmd(cmd, q, eq, O_RDONLY, 0); break;
     case '>': cmd = redircmd(cmd, q, eq, O_WRONLY | O_CREATE | O_TRUNC, 1); break;
@@ -262,7 +382,10 @@ struct cmd *parseblock(char **ps, char *es) {
   if (!peek(ps, es, "(")) panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if (!peek(ps, es, ")")) panic("syntax - missing )");
+  if (!peek(ps, es, ")")) {
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -283,11 +406,17 @@ struct cmd *parseexec(char **ps, char *es) {
   ret  = parseredirs(ret, ps, es);
   while (!peek(ps, es, "|)&;")) {
     if ((tok = gettoken(ps, es, &q, &eq)) == 0) break;
-    if (tok != 'a') panic("syntax");
+    if (tok != 'a') {
+      syntax("syntax");
+      break;
+    }
+    if (argc >= MAXARGS - 1) {
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc]  = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if (argc >= MAXARGS) panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc]  = 0;
@@ -49,6 +49,10 @@ void panic(char *s);
 
 int fork1(void);
 
+int spawnable(struct cmd *cmd);
+
+int spawncmd(struct cmd *cmd, int *fdmap);
+
 //PAGEBREAK!
 // Constructors
 
@@ -61,6 +65,8 @@ struct cmd *pipecmd(struct cmd *left, struct cmd *right);
 struct cmd *listcmd(struct cmd *left, struct cmd *right);
 
 struct cmd *backcmd(struct cmd *subcmd);
+
+void freecmd(struct cmd *cmd);
 //PAGEBREAK!
 // Parsing
 
@@ -0,0 +1,133 @@
+#include "user/sync.h"
+#include <stdatomic.h>
+#include "user/user.h"
+#include "uk-shared/error_codes.h"
+
+// Wake everybody
+#define WAKE_ALL 0x7fffffff
+
+void osdev_cond_init(osdev_cond_t *cond) {
+    atomic_store(&cond->seq, 0);
+}
+
+void osdev_cond_wait(osdev_cond_t *cond, osdev_mutex_t *mutex) {
+    osdev_sync_underlying_t seq = atomic_load(&cond->seq);
+    osdev_mutex_unlock(mutex);
+    // Returns right away if a signal came in since we read seq
+    futex_wait((uint64*)&cond->seq, seq);
+    // A broadcast may have moved us to the mutex, its unlock must wake the next one
+    osdev_mutex_lock_contended(mutex);
+}
+
+void osdev_cond_signal(osdev_cond_t *cond) {
+    atomic_fetch_add(&cond->seq, 1);
+    futex_wake((uint64*)&cond->seq, 1, 0);
+}
+
+void osdev_cond_broadcast(osdev_cond_t *cond, osdev_mutex_t *mutex) {
+    osdev_sync_underlying_t seq = atomic_fetch_add(&cond->seq, 1) + 1;
+    // Only one waiter can take the mutex, the others wait for it in its queue.
+    // The woken one locks contended, so its unlock wakes the next.
+    if (futex_requeue((uint64*)&cond->seq, 1, (uint64*)&mutex->inner, WAKE_ALL, seq) != 0)
+        futex_wake((uint64*)&cond->seq, WAKE_ALL, 0);
+}
+
+void osdev_rwlock_init(osdev_rwlock_t *rwlock) {
+    atomic_store(&rwlock->state, 0);
+}
+
+// Marks rwlock as having sleepers, then sleeps unless the state changed
+static void rwlock_sleep(osdev_rwlock_t *rwlock, osdev_sync_underlying_t state) {
+    if (!(state & OSDEV_RW_WAITING)) {
+        if (!atomic_compare_exchange_strong(&rwlock->state, &state, state | OSDEV_RW_WAITING))
+            return;
+        state |= OSDEV_RW_WAITING;
+    }
+    futex_wait((uint64*)&rwlock->state, state);
+}
+
+void osdev_rwlock_rdlock(osdev_rwlock_t *rwlock) {
+    for (;;) {
+        osdev_sync_underlying_t state = atomic_load(&rwlock->state);
+        if (!(state & OSDEV_RW_WRITER)) {
+            if (atomic_compare_exchange_weak(&rwlock->state, &state, state + 1))
+                return;
+            continue;
+        }
+        rwlock_sleep(rwlock, state);
+    }
+}
+
+void osdev_rwlock_wrlock(osdev_rwlock_t *rwlock) {
+    for (;;) {
+        osdev_sync_underlying_t state = atomic_load(&rwlock->state);
+        if ((state & ~OSDEV_RW_WAITING) == 0) {
+            if (atomic_compare_exchange_weak(&rwlock->state, &state, state | OSDEV_RW_WRITER))
+                return;
+            continue;
+        }
+        rwlock_sleep(rwlock, state);
+    }
+}
+
+void osdev_rwlock_unlock(osdev_rwlock_t *rwlock) {
+    osdev_sync_underlying_t state = atomic_load(&rwlock->state);
+    osdev_sync_underlying_t next;
+    do {
+        // The writer or the last reader leaves, sleepers have to try again
+        next = (state & OSDEV_RW_WRITER) ? 0 : state - 1;
+        if ((next & ~OSDEV_RW_WAITING) == 0)
+            next = 0;
+    } while (!atomic_compare_exchange_weak(&rwlock->state, &state, next));
+    if ((state & OSDEV_RW_WAITING) && next == 0)
+        futex_wake((uint64*)&rwlock->state, WAKE_ALL, 0);
+}
+
+void osdev_sem_init(osdev_sem_t *sem, osdev_sync_underlying_t value) {
+    atomic_store(&sem->value, value);
+    atomic_store(&sem->waiters, 0);
+}
+
+bool osdev_sem_trywait(osdev_sem_t *sem) {
+    osdev_sync_underlying_t value = atomic_load(&sem->value);
+    while (value > 0) {
+        if (atomic_compare_exchange_weak(&sem->value, &value, value - 1))
+            return true;
+    }
+    return false;
+}
+
+void osdev_sem_wait(osdev_sem_t *sem) {
+    while (!osdev_sem_trywait(sem)) {
+        // A post after the increment sees us, a post before it makes value non zero
+        atomic_fetch_add(&sem->waiters, 1);
+        futex_wait((uint64*)&sem->value, 0);
+        atomic_fetch_sub(&sem->waiters, 1);
+    }
+}
+
+void osdev_sem_post(osdev_sem_t *sem) {
+    atomic_fetch_add(&sem->value, 1);
+    if (atomic_load(&sem->waiters) > 0)
+        futex_wake((uint64*)&sem->value, 1, 0);
+}
+
+void osdev_barrier_init(osdev_barrier_t *barrier, osdev_sync_underlying_t count) {
+    barrier->count = count;
+    atomic_store(&barrier->arrived, 0);
+    atomic_store(&barrier->round, 0);
+}
+
+bool osdev_barrier_wait(osdev_barrier_t *barrier) {
+    osdev_sync_underlying_t round = atomic_load(&barrier->round);
+    if (atomic_fetch_add(&barrier->arrived, 1) + 1 == barrier->count) {
+        // Last one in, nobody touches arrived until the next round starts
+        atomic_store(&barrier->arrived, 0);
+        atomic_fetch_add(&barrier->round, 1);
+        futex_wake((uint64*)&barrier->round, WAKE_ALL, 0);
+        return true;
+    }
+    while (atomic_load(&barrier->round) == round)
+        futex_wait((uint64*)&barrier->round, round);
+    return false;
+}
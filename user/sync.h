@@ -0,0 +1,103 @@
+/*! \file sync.h
+ * \brief futex based condition variables, reader-writer locks, semaphores and barriers
+ */
+
+#ifndef INCLUDED_user_sync_h
+#define INCLUDED_user_sync_h
+
+#include "user/futex.h"
+
+typedef unsigned long long osdev_sync_underlying_t;
+
+#ifndef __cplusplus
+
+typedef _Atomic osdev_sync_underlying_t osdev_sync_inner_t;
+
+#else
+
+using osdev_sync_inner_t = std::atomic<osdev_sync_underlying_t>;
+
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief condition variable, used with an osdev_mutex_t
+ */
+typedef struct osdev_cond_t {
+    //! bumped by every signal and broadcast, waiters sleep on it
+    osdev_sync_inner_t seq;
+} osdev_cond_t;
+
+//! initialize condition variable
+void osdev_cond_init(osdev_cond_t *cond);
+//! unlock mutex, sleep until signaled and lock mutex again
+void osdev_cond_wait(osdev_cond_t *cond, osdev_mutex_t *mutex);
+//! wake one waiter
+void osdev_cond_signal(osdev_cond_t *cond);
+//! wake all waiters, they are moved to the mutex instead of all waking at once
+void osdev_cond_broadcast(osdev_cond_t *cond, osdev_mutex_t *mutex);
+
+/*!
+ * \brief reader-writer lock, many readers or one writer
+ */
+typedef struct osdev_rwlock_t {
+    //! number of readers, or OSDEV_RW_WRITER, plus OSDEV_RW_WAITING if anybody sleeps
+    osdev_sync_inner_t state;
+} osdev_rwlock_t;
+
+#define OSDEV_RW_WRITER  (1ULL << 32)
+#define OSDEV_RW_WAITING (1ULL << 33)
+
+//! initialize reader-writer lock
+void osdev_rwlock_init(osdev_rwlock_t *rwlock);
+//! lock for reading
+void osdev_rwlock_rdlock(osdev_rwlock_t *rwlock);
+//! lock for writing
+void osdev_rwlock_wrlock(osdev_rwlock_t *rwlock);
+//! unlock, either kind
+void osdev_rwlock_unlock(osdev_rwlock_t *rwlock);
+
+/*!
+ * \brief counting semaphore
+ */
+typedef struct osdev_sem_t {
+    //! available units
+    osdev_sync_inner_t value;
+    //! procs that might sleep on value, posts only enter the kernel if there are any
+    osdev_sync_inner_t waiters;
+} osdev_sem_t;
+
+//! initialize semaphore with value units
+void osdev_sem_init(osdev_sem_t *sem, osdev_sync_underlying_t value);
+//! take a unit, sleeps until one is available
+void osdev_sem_wait(osdev_sem_t *sem);
+//! take a unit if one is available, returns true on success
+bool osdev_sem_trywait(osdev_sem_t *sem);
+//! return a unit
+void osdev_sem_post(osdev_sem_t *sem);
+
+/*!
+ * \brief barrier for a fixed number of participants
+ */
+typedef struct osdev_barrier_t {
+    //! participants per round
+    osdev_sync_underlying_t count;
+    //! participants that arrived in the current round
+    osdev_sync_inner_t arrived;
+    //! number of the current round, waiters sleep on it
+    osdev_sync_inner_t round;
+} osdev_barrier_t;
+
+//! initialize barrier for count participants
+void osdev_barrier_init(osdev_barrier_t *barrier, osdev_sync_underlying_t count);
+//! wait until all participants arrived, returns true for exactly one of them
+bool osdev_barrier_wait(osdev_barrier_t *barrier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -143,3 +143,32 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// What a new thread finds at the top of its stack.
+struct thread_start {
+  int (*fn)(void*);
+  void *arg;
+};
+
+// Entry of threads started by thread_create(), so that it's
+// OK if fn() returns instead of calling thread_exit().
+static void
+thread_start(void *p)
+{
+  struct thread_start *ts = p;
+  thread_exit(ts->fn(ts->arg));
+}
+
+// Run fn(arg) in a new thread on the stack_size bytes at stack.
+// The thread shares memory and open files with the caller.
+// Returns the thread id for thread_join(), or -1.
+int
+thread_create(int (*fn)(void*), void *arg, void *stack, uint stack_size)
+{
+  uint64 top = ((uint64)stack + stack_size) & ~15L;
+  struct thread_start *ts = (struct thread_start*)(top - 16);
+
+  ts->fn = fn;
+  ts->arg = arg;
+  return clone(thread_start, ts, ts);
+}
@@ -104,11 +104,18 @@ int munmap(void *addr, uint64 length) {
 }
 
 /**
- * Moved here so I can test printf
+ * Always enters the kernel, write() may be replaced
 */
-int write(int, const void*, int) {
+int __write(int, const void*, int) {
     SYSCALL(SYS_write);
     uint64 rVal = 0;
     SCGETRETURN(rVal);
     return rVal;
+}
+
+/**
+ * Moved here so I can test printf
+*/
+int write(int fd, const void* buf, int n) {
+    return __write(fd, buf, n);
 }
\ No newline at end of file
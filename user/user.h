@@ -10,6 +10,9 @@ extern "C" {
 #endif
 
 #include "kernel/stat.h"
+#include "uk-shared/bcache_defs.h"
+#include "uk-shared/futex_defs.h"
+#include "uk-shared/upcall_defs.h"
 
 
 
@@ -41,11 +44,29 @@ int hello_kernel(int);
 int printPT(void);
 int futex_init(uint64* futex);
 int futex_wait(uint64* futex, uint64 val);
-int futex_wake(uint64* futex, int num_wake);
+int futex_wake(uint64* futex, int num_wake, int flags);
+int futex_timedwait(uint64* futex, uint64 val, int timeout);
+int futex_requeue(uint64* futex, int num_wake, uint64* futex2, int num_requeue, uint64 val);
+int futex_wake_op(uint64* futex, int num_wake, uint64* futex2, int num_wake2, int op);
 int net_test(void);
 int net_send_listen(uint8 id, void* send_buffer, int send_buffer_length, void* receive_buffer, int receive_buffer_length);
 int net_bind(uint16 port);
 void net_unbind(int id);
+int setpriority(int pid, int priority);
+int spawn(const char*, char**, const int*, int);
+int bcachectl(int target, struct bcache_info* info);
+int fsync(int fd);
+int clone(void (*fn)(void*), void* arg, void* stack);
+int thread_join(int tid, int* status);
+int upcall(void (*handler)(struct upcall_frame*), int ticks);
+int upcall_return(struct upcall_frame* frame);
+// Like read(), write(), wait() and sleep(), even where a
+// thread runtime replaced them, see user/uthreads.c
+int __read(int, void*, int);
+int __write(int, const void*, int);
+int __wait(int*);
+int __sleep(int);
+int thread_exit(int) __attribute__((noreturn));
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -61,9 +82,12 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void setup_malloc();
 void free(void*);
+void malloc_lock(void);
+void malloc_unlock(void);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int thread_create(int (*fn)(void*), void* arg, void* stack, uint stack_size);
 
 
 
@@ -572,6 +572,10 @@ writetest(char *s)
   }
 }
 
+// Past the indirect blocks into the double indirect ones,
+// without filling the whole disk.
+#define BIGBLOCKS (NDIRECT + NINDIRECT + 16)
+
 void
 writebig(char *s)
 {
@@ -583,7 +587,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -603,7 +607,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
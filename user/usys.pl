@@ -14,12 +14,25 @@ sub entry {
     print " ecall\n";
     print " ret\n";
 }
+
+# System calls that may sleep are weak, so that a thread runtime can
+# wrap them. __name always enters the kernel, see user/uthreads.c.
+sub blocking_entry {
+    my $name = shift;
+    print ".weak $name\n";
+    print ".global __$name\n";
+    print "${name}:\n";
+    print "__${name}:\n";
+    print " li a7, SYS_${name}\n";
+    print " ecall\n";
+    print " ret\n";
+}
 	
 entry("fork");
 entry("exit");
-entry("wait");
+blocking_entry("wait");
 entry("pipe");
-entry("read");
+blocking_entry("read");
 entry("close");
 entry("kill");
 entry("exec");
@@ -33,7 +46,7 @@ entry("chdir");
 entry("dup");
 entry("getpid");
 entry("sbrk");
-entry("sleep");
+blocking_entry("sleep");
 entry("uptime");
 entry("cxx");
 entry("term");
@@ -41,7 +54,19 @@ entry("printPT");
 entry("futex_wait");
 entry("futex_wake");
 entry("futex_init");
+entry("futex_timedwait");
+entry("futex_requeue");
+entry("futex_wake_op");
+entry("clone");
+entry("thread_join");
+entry("upcall");
+entry("upcall_return");
+entry("thread_exit");
 entry("net_test");
 entry("net_bind");
 entry("net_send_listen");
-entry("net_unbind");
\ No newline at end of file
+entry("net_unbind");
+entry("setpriority");
+entry("spawn");
+entry("bcachectl");
+entry("fsync");
@@ -1,11 +1,25 @@
 #include "user/uthreads.h"
 #include "user/user.h"
-#include "user/mmap.h"
+#include "uk-shared/error_codes.h"
 
 // #define DEBUG_THREADING
-                        
+
+// M:N threads. Workers are kernel threads of the process (clone()),
+// each with its own run queue. A worker that runs out of threads steals
+// one from the longest queue, or sleeps until a thread is queued.
+// A timer upcall preempts the running thread every UTHREADS_SLICE ticks,
+// unless it is inside the runtime, then it yields once it leaves it.
+//
+// tp points to the running thread. Its context switches to the worker's
+// scheduler, which finishes the switch (queue, park or bury the thread)
+// before it runs the next one, so no other worker can pick the thread
+// while it is still on its stack.
+
+// Wake everybody
+#define WAKE_ALL 0x7fffffff
+
 // Context swtich
-__attribute__((naked)) static void thread_switch(thread_context* old, thread_context* new) 
+__attribute__((naked)) static void thread_switch(thread_context* old, thread_context* new)
 {
     asm volatile (
         "sd ra, 0(a0)\n"
@@ -22,6 +36,7 @@ __attribute__((naked)) static void thread_switch(thread_context* old, thread_con
         "sd s9, 88(a0)\n"
         "sd s10, 96(a0)\n"
         "sd s11, 104(a0)\n"
+        "sd tp, 112(a0)\n"
 
         "ld ra, 0(a1)\n"
         "ld sp, 8(a1)\n"
@@ -37,113 +52,358 @@ __attribute__((naked)) static void thread_switch(thread_context* old, thread_con
         "ld s9, 88(a1)\n"
         "ld s10, 96(a1)\n"
         "ld s11, 104(a1)\n"
+        "ld tp, 112(a1)\n"
         "ret\n"
     );
 }
 
-// Set after scheduling thread. If set to -1 no threading till now.
-static thread threads[MAX_NUM_THREADS] = {0};
-static thread_id current_thread_id = -1;
-static int active_threads = 0;
+struct worker {
+    // scheduler context, runs between two threads on the worker's stack
+    thread sched;
+    // run queue, oldest first
+    osdev_mutex_t qlock;
+    thread* head;
+    thread* tail;
+    int len;
+    // thread that switched to the scheduler, its switch isn't finished yet
+    thread* prev;
+    void* stack;
+};
+
+static struct {
+    // protects the thread table, joins and starting workers, taken before qlock
+    osdev_mutex_t lock;
+    thread* table[UTHREADS_HASH];
+    thread_id next_id;
+    // threads that aren't DEAD, the process ends when it drops to 0
+    int live;
+    int code;
+    int started;
+    int nworkers;
+    // workers in a system call between uthreads_block_begin() and _end()
+    int nblocked;
+    // workers looking for threads, they sleep on idle_seq
+    int nidle;
+    // threads in all run queues
+    int nready;
+    uint64 idle_seq;
+    int done;
+    thread main;
+    struct worker workers[UTHREADS_MAX_WORKERS];
+} rt;
+
+static void preempt_handler(struct upcall_frame* f);
+
+static inline thread* self(void) {
+    thread* t;
+    asm volatile("mv %0, tp" : "=r"(t));
+    return t;
+}
+
+static inline void preempt_disable(void) {
+    self()->preempt_off++;
+}
+
+static void preempt_enable(void) {
+    thread* t = self();
+    if (--t->preempt_off == 0 && t->preempt_pending) {
+        uthreads_yield();
+    }
+}
 
-static thread_id ringbuffer[MAX_NUM_THREADS] = {-1};
-static int16 current_index = 0;
-static int16 insert_index = 0;
+// Caller must hold rt.lock.
+static thread** bucket(thread_id id) {
+    return &rt.table[id % UTHREADS_HASH];
+}
 
-static thread_context scheduler_context = {0};
-static void* scheduler_stack_start = NULL;
+// Caller must hold rt.lock.
+static thread* lookup(thread_id id) {
+    for (thread* t = *bucket(id); t != NULL; t = t->hnext) {
+        if (t->id == id) {
+            return t;
+        }
+    }
+    return NULL;
+}
 
-static void append_ring(thread_id id) {
-    ringbuffer[insert_index] = id;
-    insert_index++;
-    insert_index = insert_index % MAX_NUM_THREADS;
+// Caller must hold rt.lock.
+static void table_remove(thread* t) {
+    thread** pp;
+    for (pp = bucket(t->id); *pp != t; pp = &(*pp)->hnext)
+        ;
+    *pp = t->hnext;
 }
 
-static thread_id pop_ring() {
-    thread_id popped = ringbuffer[current_index];
-    ringbuffer[current_index] = -1;
-    current_index++;
-    current_index = current_index % MAX_NUM_THREADS;
-    return popped;
+// Queue t on w and wake an idle worker, which steals it if w is busy.
+static void enqueue(struct worker* w, thread* t) {
+    t->state = READY;
+    t->qnext = NULL;
+    osdev_mutex_lock(&w->qlock);
+    if (w->tail != NULL) {
+        w->tail->qnext = t;
+    } else {
+        w->head = t;
+    }
+    w->tail = t;
+    __atomic_store_n(&w->len, w->len + 1, __ATOMIC_RELAXED);
+    osdev_mutex_unlock(&w->qlock);
+
+    // An idle worker counts itself before it looks at nready
+    __atomic_add_fetch(&rt.nready, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rt.nidle, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&rt.idle_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&rt.idle_seq, 1, 0);
+    }
+}
+
+static thread* dequeue(struct worker* w) {
+    osdev_mutex_lock(&w->qlock);
+    thread* t = w->head;
+    if (t != NULL) {
+        w->head = t->qnext;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+        __atomic_store_n(&w->len, w->len - 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&rt.nready, 1, __ATOMIC_SEQ_CST);
+    }
+    osdev_mutex_unlock(&w->qlock);
+    return t;
+}
+
+// Take the oldest thread of the worker with the longest run queue.
+static thread* steal(struct worker* w) {
+    struct worker* victim = NULL;
+    int most = 0;
+    int n = __atomic_load_n(&rt.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        int len = __atomic_load_n(&rt.workers[i].len, __ATOMIC_RELAXED);
+        if (&rt.workers[i] != w && len > most) {
+            victim = &rt.workers[i];
+            most = len;
+        }
+    }
+    return victim != NULL ? dequeue(victim) : NULL;
+}
+
+// Next thread for w to run, NULL once all threads are dead.
+static thread* next_thread(struct worker* w) {
+    for (;;) {
+        thread* t = dequeue(w);
+        if (t == NULL) {
+            t = steal(w);
+        }
+        if (t != NULL) {
+            return t;
+        }
+        // Returns right away if a thread was queued since we read seq
+        uint64 seq = __atomic_load_n(&rt.idle_seq, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&rt.nidle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rt.nready, __ATOMIC_SEQ_CST) == 0 && !__atomic_load_n(&rt.done, __ATOMIC_SEQ_CST)) {
+            futex_wait(&rt.idle_seq, seq);
+        }
+        __atomic_sub_fetch(&rt.nidle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rt.done, __ATOMIC_SEQ_CST)) {
+            return NULL;
+        }
+    }
 }
 
-static void uthreads_sched() {
-    while(active_threads > 0) {
-        thread_id id = pop_ring();
-        if (id == -1) {
-            printf("Scheduler: Threading broke. -1 ID\n");
-            for (int i = 0; i < MAX_NUM_THREADS; i++) {
-                printf("IDX: %d, PID:%d;;; ", i, ringbuffer[i]);
-            }
-            printf("\nRing contents\n");
-            exit(-1);
+// Finish the switch of the thread that left w for the scheduler.
+static void finish_switch(struct worker* w) {
+    thread* t = w->prev;
+    if (t == NULL) {
+        return;
+    }
+    w->prev = NULL;
+
+    if (t->exiting) {
+        osdev_mutex_lock(&rt.lock);
+        #ifdef DEBUG_THREADING
+        printf("Scheduler: %d is dead\n", (int)t->id);
+        #endif
+        // Only now may a join free the stack
+        t->state = DEAD;
+        thread* sub = t->subscriber != -1 ? lookup(t->subscriber) : NULL;
+        if (sub != NULL && sub->parked) {
+            sub->parked = 0;
+            enqueue(w, sub);
+        }
+        if (--rt.live == 0) {
+            __atomic_store_n(&rt.done, 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&rt.idle_seq, 1, __ATOMIC_SEQ_CST);
+            futex_wake(&rt.idle_seq, WAKE_ALL, 0);
         }
+        osdev_mutex_unlock(&rt.lock);
+    } else if (t->state == WAITING) {
+        osdev_mutex_lock(&rt.lock);
+        thread* waitfor = lookup(t->waitfor);
+        if (waitfor->state == DEAD) {
+            enqueue(w, t);
+        } else {
+            // The exit of waitfor queues it
+            t->parked = 1;
+        }
+        osdev_mutex_unlock(&rt.lock);
+    } else {
+        enqueue(w, t);
+    }
+}
 
-        thread* current_thread = threads + id;
-        switch(current_thread->state) {
-            case READY:
-                #ifdef DEBUG_THREADING
-                printf("Scheduler: Now running: %d\n", id);
-                #endif
-                current_thread_id = current_thread->id;
-                current_thread->state = RUNNING;
-                thread_switch(&scheduler_context, &current_thread->context);
-                break;
-            case WAITING:
-                thread waitfor = threads[current_thread->waitfor];
-                #ifdef DEBUG_THREADING
-                    printf("Scheduler: Thread waitfor: %d:%d, state: %d\n", current_thread->id, waitfor.id, waitfor.state);
-                #endif
-                // DEAD or INVALID? Stop waiting
-                if (waitfor.state == DEAD || waitfor.state == INVALID) {
-                    current_thread->state = READY;
-                }
-                
-                append_ring(id);
-                break;
-            default:
-                printf("Scheduling broke. Thread State: %d", current_thread->state);
-                exit(-1);
-                break;
+static void worker_loop(void) {
+    struct worker* w = self()->worker;
+    for (;;) {
+        finish_switch(w);
+        thread* t = next_thread(w);
+        if (t == NULL) {
+            // Ends the other workers as well
+            exit(rt.code);
         }
+        #ifdef DEBUG_THREADING
+        printf("Scheduler %d: Now running: %d\n", (int)(w - rt.workers), (int)t->id);
+        #endif
+        t->worker = w;
+        t->state = RUNNING;
+        w->prev = t;
+        thread_switch(&w->sched.context, &t->context);
+    }
+}
+
+// Give the worker back to its scheduler.
+// Preemption must be disabled, it stays disabled when t runs again.
+static void switch_to_sched(thread* t) {
+    t->preempt_pending = 0;
+    thread_switch(&t->context, &t->worker->sched.context);
+}
+
+static void init_worker(struct worker* w) {
+    osdev_mutex_init(&w->qlock);
+    w->sched.id = -1;
+    w->sched.worker = w;
+    // The scheduler is never preempted
+    w->sched.preempt_off = 1;
+}
+
+static int worker_main(void* arg) {
+    struct worker* w = arg;
+    asm volatile("mv tp, %0" : : "r"(&w->sched));
+    upcall(preempt_handler, UTHREADS_SLICE);
+    worker_loop();
+    return 0;
+}
+
+// Start another worker, returns 0 on success.
+// Caller must hold rt.lock.
+static int start_worker(void) {
+    if (rt.nworkers == UTHREADS_MAX_WORKERS) {
+        return -1;
+    }
+    struct worker* w = &rt.workers[rt.nworkers];
+    if ((w->stack = malloc(UTHREADS_WORKER_STACK)) == NULL) {
+        return -1;
+    }
+    init_worker(w);
+    if (thread_create(worker_main, w, w->stack, UTHREADS_WORKER_STACK) < 0) {
+        free(w->stack);
+        return -1;
     }
     #ifdef DEBUG_THREADING
-        printf("END SCHEDULER: Freeing Memory\n");
+    printf("Started worker %d\n", rt.nworkers);
     #endif
-    // Free memory
-    for (int i = 1; i < MAX_NUM_THREADS; i++) {
-        free(threads[i].stack_start);
+    // Stealers only look at workers that are set up
+    __atomic_store_n(&rt.nworkers, rt.nworkers + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Upcall every UTHREADS_SLICE ticks. The handler runs on the stack of the
+// interrupted thread, the kernel holds off further upcalls until it calls
+// upcall_return(). So it returns to preempt_resume() to yield, which restores
+// the interrupted registers once the thread runs again. An upcall that comes
+// in before preempt_resume() yields nests another frame, it yields twice.
+static void preempt_resume(struct upcall_frame* f) {
+    uthreads_yield();
+    upcall_return(f);
+}
+
+static void preempt_handler(struct upcall_frame* f) {
+    thread* t = self();
+    if (t->preempt_off > 0) {
+        // preempt_enable() yields
+        t->preempt_pending = 1;
+        upcall_return(f);
+    } else {
+        // f stays on the stack above preempt_resume()'s frame
+        struct upcall_frame resume = *f;
+        resume.sp = (uint64)f;
+        resume.a0 = (uint64)f;
+        resume.epc = (uint64)preempt_resume;
+        upcall_return(&resume);
     }
 }
 
+// malloc() takes malloc_mutex, a thread preempted while holding it
+// would keep the other threads of its worker waiting.
+void malloc_lock(void) {
+    preempt_disable();
+    osdev_mutex_lock(&malloc_mutex);
+}
+
+void malloc_unlock(void) {
+    osdev_mutex_unlock(&malloc_mutex);
+    preempt_enable();
+}
+
 void uthreads_yield() {
     #ifdef DEBUG_THREADING
-    printf("yield: %d\n", current_thread_id);
+    printf("yield: %d\n", (int)self()->id);
     #endif
-    thread* current_thread = &threads[current_thread_id];
-    current_thread->state = READY;
-    append_ring(current_thread_id);
-    thread_switch(&current_thread->context, &scheduler_context);
+    preempt_disable();
+    switch_to_sched(self());
+    preempt_enable();
+}
+
+static void thread_finish(void* retval) {
+    preempt_disable();
+    thread* t = self();
+    t->saved_value = retval;
+    t->exiting = 1;
+    switch_to_sched(t);
+    // Never runs again
 }
 
 void uthreads_exit() {
     #ifdef DEBUG_THREADING
-    printf("Exit: %d\n", current_thread_id);
+    printf("Exit: %d\n", (int)self()->id);
     #endif
-    active_threads--;
-    thread* current_thread = &threads[current_thread_id];
-    current_thread->state = DEAD;
-    thread_switch(&current_thread->context, &scheduler_context);
+    thread_finish(NULL);
 }
 
 static void uthreads_execute() {
+    thread* current_thread = self();
     #ifdef DEBUG_THREADING
-    printf("Execute: %d\n", current_thread_id);
+    printf("Execute: %d\n", (int)current_thread->id);
     #endif
-    active_threads++;
-    thread* current_thread = &threads[current_thread_id];
-    current_thread->saved_value = current_thread->func(current_thread->saved_value);
-    uthreads_exit();
+    // Started by a scheduler, which left preemption disabled
+    preempt_enable();
+    thread_finish(current_thread->func(current_thread->saved_value));
+}
+
+// Caller must hold rt.lock.
+static int state_locked(thread_id id) {
+    if (id < 0 || id >= rt.next_id) {
+        // Invalid args
+        return EINVAL;
+    }
+    thread* t = lookup(id);
+    if (t == NULL) {
+        // Thread was joined already
+        return EEXIST;
+    }
+    if (t->subscriber != -1) {
+        // Thread is not joinable
+        return ENOJOIN;
+    }
+    return 0;
 }
 
 /**
@@ -154,162 +414,192 @@ static void uthreads_execute() {
  * @return EEXIST: Thread invalid
 */
 int uthreads_state(thread_id id) {
-    if (!(id >= 0 && id < MAX_NUM_THREADS)) {
-        printf("Joinable: Invalid join ID\n");
-        // Invalid args
-        return EINVAL;
-    }
-    thread* waitfor_thread = &threads[id];
-    if (waitfor_thread->subscriber != -1) {
-        // Thread is not joinable
-        return ENOJOIN;
-    }
-    if (waitfor_thread->state == INVALID) {
-        // Thread does not exit
-        return EEXIST;
-    }
-    return 0;
+    preempt_disable();
+    osdev_mutex_lock(&rt.lock);
+    int state = state_locked(id);
+    osdev_mutex_unlock(&rt.lock);
+    preempt_enable();
+    return state;
 }
 
 // Returns 0 on success
 int uthreads_join(thread_id id, void** retval) {
     #ifdef DEBUG_THREADING
-    printf("Join: %d waitfor: %d\n", current_thread_id, id);
+    printf("Join: %d waitfor: %d\n", (int)self()->id, (int)id);
     #endif
+    preempt_disable();
+    thread* current_thread = self();
+    osdev_mutex_lock(&rt.lock);
 
-    if (!(id >= 0 && id < MAX_NUM_THREADS) || id == current_thread_id) {
-        #ifdef DEBUG_THREADING
-        printf("Join: Invalid join ID\n");
-        #endif
-        return EINVAL;
-    }
-
-    thread* current_thread = &threads[current_thread_id];
-    thread* waitfor_thread = &threads[id];
-
+    int err = id == current_thread->id ? EINVAL : state_locked(id);
+    thread* waitfor_thread = err == 0 ? lookup(id) : NULL;
     // Protect against circular waits
-    if (waitfor_thread->state == WAITING && waitfor_thread->waitfor == current_thread_id) {
-        #ifdef DEBUG_THREADING
-        printf("Join: Circular wait\n");
-        #endif
-        // Only fails join. Not entire Process? Smart? Dunno
-        return ECIRC;
+    for (thread* t = waitfor_thread; err == 0 && t != NULL && t->state == WAITING; t = lookup(t->waitfor)) {
+        if (t->waitfor == current_thread->id) {
+            err = ECIRC;
+        }
     }
-    
-    if (uthreads_state(id) == 0) {
-        // Thread not joinable. Return immeadiately
-        #ifdef DEBUG_THREADING
-        printf("Threading: Not joinable: %d\n", id);
-        #endif
-        return ENOJOIN;
+    if (err != 0) {
+        osdev_mutex_unlock(&rt.lock);
+        preempt_enable();
+        return err;
     }
 
-    switch(waitfor_thread->state) {
-        case READY:
-        case WAITING:
-            current_thread->state = WAITING;
-            current_thread->waitfor = id;
-            append_ring(current_thread_id);
-            waitfor_thread->subscriber = current_thread_id;
-            thread_switch(&current_thread->context, &scheduler_context);
-            break;
-        case INVALID:
-        case DEAD:
-            waitfor_thread->state = INVALID;
-            break;
-        case RUNNING:
-            // Gets handled earlier, unless Threading broke
-            printf("Join: Threading broke: Waiting for running thread?!?");
-            exit(-1);
+    waitfor_thread->subscriber = current_thread->id;
+    if (waitfor_thread->state != DEAD) {
+        current_thread->waitfor = id;
+        current_thread->state = WAITING;
+        osdev_mutex_unlock(&rt.lock);
+        switch_to_sched(current_thread);
+        osdev_mutex_lock(&rt.lock);
+        current_thread->waitfor = -1;
     }
 
+    table_remove(waitfor_thread);
     if (retval != NULL) {
         *retval = waitfor_thread->saved_value;
     }
+    if (waitfor_thread != &rt.main) {
+        free(waitfor_thread->stack_start);
+        free(waitfor_thread);
+    }
+    osdev_mutex_unlock(&rt.lock);
+    preempt_enable();
     return 0;
 }
 
-
 thread_id uthreads_create(void* func_pointer (void*), void* arg, int stack_size) {
     #ifdef DEBUG_THREADING
-    printf("Create: %d\n", current_thread_id);
+    printf("Create: %d\n", (int)self()->id);
     #endif
-    // Inits parent if not initted
-    thread* parent_thread = NULL;
-    if (current_thread_id == -1) {
-        parent_thread = &threads[0];
-        parent_thread->state = RUNNING;
-        parent_thread->id = 0;
-        parent_thread->stack_start = (void*)-1;
-        parent_thread->subscriber = -1;
-        // Actually init scheduler
-        scheduler_stack_start = malloc(PAGE_SIZE);
-        scheduler_context.ra = uthreads_sched;
-        // Stack grows down so we use highest address as stack
-        scheduler_context.sp = scheduler_stack_start + PAGE_SIZE;
-
-    } else {
-        parent_thread = &threads[current_thread_id];
-    }
-
-    // Get an empty thread from Thread table
-    thread* new_thread = NULL;
-    for (int i = 0; i < MAX_NUM_THREADS; i++) {
-        if (threads[i].state == INVALID) {
-            new_thread = &threads[i];
-            new_thread->id = i;
-            break;
+    preempt_disable();
+    osdev_mutex_lock(&rt.lock);
+    if (!rt.started) {
+        rt.started = 1;
+        upcall(preempt_handler, UTHREADS_SLICE);
+        for (int i = 1; i < UTHREADS_WORKERS; i++) {
+            start_worker();
         }
     }
 
-    if (new_thread == NULL) {
-        printf("No valid thread\n");
-        return -1;
-    }
-
+    thread* new_thread = malloc(sizeof(thread));
     void* new_stack = malloc(stack_size);
-
-    if (new_stack == NULL) {
+    if (new_thread == NULL || new_stack == NULL) {
+        free(new_thread);
+        free(new_stack);
+        osdev_mutex_unlock(&rt.lock);
+        preempt_enable();
         printf("Thread stack allocation fail\n");
         return -1;
     }
 
+    memset(new_thread, 0, sizeof(thread));
+    new_thread->id = rt.next_id++;
     new_thread->stack_start = new_stack;
-    new_thread->context.sp = (new_stack + stack_size);
+    new_thread->context.sp = (void*)(((uint64)new_stack + stack_size) & ~15L);
+    new_thread->context.ra = uthreads_execute;
+    new_thread->context.tp = (uint64)new_thread;
     new_thread->func = func_pointer;
     new_thread->saved_value = arg;
-    new_thread->context.ra = uthreads_execute;
-    new_thread->state = READY;
     new_thread->subscriber = -1;
-    append_ring(new_thread->id);
+    new_thread->waitfor = -1;
+    // Enabled by uthreads_execute()
+    new_thread->preempt_off = 1;
+    new_thread->hnext = *bucket(new_thread->id);
+    *bucket(new_thread->id) = new_thread;
+    rt.live++;
+    thread_id id = new_thread->id;
+    osdev_mutex_unlock(&rt.lock);
+
+    enqueue(self()->worker, new_thread);
+    preempt_enable();
+    return id;
+}
+
+void uthreads_block_begin() {
+    // The thread stays on its worker until uthreads_block_end()
+    preempt_disable();
+    osdev_mutex_lock(&rt.lock);
+    rt.nblocked++;
+    // Keep UTHREADS_WORKERS workers running while this one sleeps in the kernel
+    if (rt.started && rt.nworkers - rt.nblocked < UTHREADS_WORKERS) {
+        start_worker();
+    }
+    osdev_mutex_unlock(&rt.lock);
+}
 
-    parent_thread->state = READY;
-    append_ring(parent_thread->id);
-    
-    // Context switch to scheduler
-    thread_switch(&parent_thread->context, &scheduler_context);
-    return new_thread->id;
-}  
+void uthreads_block_end() {
+    osdev_mutex_lock(&rt.lock);
+    rt.nblocked--;
+    osdev_mutex_unlock(&rt.lock);
+    preempt_enable();
+}
 
+// The system calls that may sleep hand the worker over by default,
+// these replace the ones of usys.S and user.c.
+int read(int fd, void* buf, int n) {
+    uthreads_block_begin();
+    int ret = __read(fd, buf, n);
+    uthreads_block_end();
+    return ret;
+}
+
+int write(int fd, const void* buf, int n) {
+    uthreads_block_begin();
+    int ret = __write(fd, buf, n);
+    uthreads_block_end();
+    return ret;
+}
+
+int wait(int* status) {
+    uthreads_block_begin();
+    int ret = __wait(status);
+    uthreads_block_end();
+    return ret;
+}
+
+int sleep(int ticks) {
+    uthreads_block_begin();
+    int ret = __sleep(ticks);
+    uthreads_block_end();
+    return ret;
+}
 
 // Wrapper so it's ok if main doesn't call exit
-// Modified to lead back to scheduler unless everyone is done
+// Runs main as thread 0, the process exits once all threads are done
 void
-_main() 
+_main()
 {
     #ifdef DEBUG_THREADING
     printf("Starting Threaded Program\n");
     #endif
-    active_threads++;
-    // Uncomment if needed
     extern int main();
-    int code = main();
-    active_threads--;
-    #ifdef DEBUG_THREADING
-        printf("EXIT: Replacing scheduler: %d\n");
-    #endif
-    free(scheduler_stack_start);
-    // There's no need to context switch to or modify scheduler_context.
-    uthreads_sched();
-    exit(code);
-}
\ No newline at end of file
+    struct worker* w = &rt.workers[0];
+    thread* main_thread = &rt.main;
+
+    // malloc() and the system call wrappers look at the running thread
+    asm volatile("mv tp, %0" : : "r"(main_thread));
+    osdev_mutex_init(&rt.lock);
+    init_worker(w);
+    if ((w->stack = malloc(UTHREADS_WORKER_STACK)) == NULL) {
+        printf("uthreads: no scheduler stack\n");
+        exit(-1);
+    }
+    w->sched.context.ra = worker_loop;
+    // Stack grows down so we use highest address as stack
+    w->sched.context.sp = w->stack + UTHREADS_WORKER_STACK;
+    w->sched.context.tp = (uint64)&w->sched;
+    rt.nworkers = 1;
+
+    // main keeps the process stack
+    main_thread->id = rt.next_id++;
+    main_thread->state = RUNNING;
+    main_thread->subscriber = -1;
+    main_thread->waitfor = -1;
+    main_thread->worker = w;
+    *bucket(main_thread->id) = main_thread;
+    rt.live = 1;
+
+    rt.code = main();
+    uthreads_exit();
+}
@@ -2,12 +2,22 @@
 #define ULTHREADS_H
 
 #include "user/user.h"
+#include "user/futex.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define MAX_NUM_THREADS 4
+// Kernel threads running user threads, one per hart by default
+#define UTHREADS_WORKERS 3
+// Kernel threads at most, spare ones replace workers blocked in system calls
+#define UTHREADS_MAX_WORKERS 16
+// Stack of a worker's scheduler
+#define UTHREADS_WORKER_STACK 8192
+// Timer ticks a thread runs before it is preempted
+#define UTHREADS_SLICE 1
+// Buckets of the thread table
+#define UTHREADS_HASH 64
 
 typedef int64 thread_id;
 
@@ -37,10 +47,14 @@ typedef struct __context {
   uint64 s9;
   uint64 s10;
   uint64 s11;
+
+  // points to the running thread
+  uint64 tp;
 } thread_context;
 
+struct worker;
 
-typedef struct {
+typedef struct thread {
     thread_context context;
     void* (*func) (void*);
     void* saved_value;
@@ -50,18 +64,30 @@ typedef struct {
     thread_id waitfor;
     thread_id id;
     thread_state state;
+    // set once a WAITING thread left its worker, its target's exit makes it READY
+    int parked;
+    // switched to the scheduler for the last time, the scheduler marks it DEAD
+    int exiting;
+    // no preemption while > 0, a timer upcall in that time only sets preempt_pending
+    int preempt_off;
+    int preempt_pending;
+    // worker running the thread
+    struct worker* worker;
+    // thread table chain and run queue
+    struct thread* hnext;
+    struct thread* qnext;
 } thread;
 
-// Moves Thread to scheduler. ä
+// Moves Thread to scheduler.
 // Invokes scheduler
 extern void uthreads_yield();
 
-// Moves current thread to scheduler.
-// Creates new thread with stack_size amount of stack memory. 
-// Invokes new thread
+// Creates new thread with stack_size amount of stack memory.
+// The new thread is queued on the caller's worker, idle workers steal it.
+// The first call starts the workers, before it all threads run on one.
 extern thread_id uthreads_create(void* func_pointer (void*), void* arg, int stack_size);
 
-// Stops execution of current ULT. 
+// Stops execution of current ULT.
 // Invokes scheduler
 extern void uthreads_exit();
 
@@ -79,8 +105,18 @@ extern int uthreads_join(thread_id thread_id, void** retval);
 */
 extern int uthreads_state(thread_id thread_id);
 
+/**
+ * Wrap system calls that may sleep, like reading a pipe, in
+ * uthreads_block_begin() and uthreads_block_end(). The worker stays
+ * with the thread meanwhile, a spare worker runs the other threads.
+ * read(), write(), wait() and sleep() do so by default.
+ * exit() ends the process from any thread.
+*/
+extern void uthreads_block_begin();
+extern void uthreads_block_end();
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif